@@ -0,0 +1,291 @@
+#include "aead.h"
+
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define AEAD_NONCE		12
+
+
+struct aead {
+    EVP_CIPHER_CTX *ctx;
+};
+
+
+
+/* an OpenSSL failure: its error queue says why */
+#define aead_error(msg) \
+    do { fprintf(stderr, "%s: OpenSSL error\n", msg); \
+         ERR_print_errors_fp(stderr); exit(EXIT_FAILURE); } while (0)
+
+
+
+/*
+ * Function:	aead_psk
+ * --------------------------------------------------
+ * Returns:
+ * 		true	if RUDP_PSK holds a key: the segments are sealed
+ */
+bool aead_psk(void)
+{
+    char *env = getenv(AEAD_PSK_ENV);
+
+    return env && *env;
+}
+
+
+
+/* true if the CPU has AES instructions: AES-GCM is the faster cipher */
+bool aead_hw_aes(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & (HWCAP_AES | HWCAP_PMULL))
+        == (HWCAP_AES | HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+
+
+void aead_random(void *buf, size_t len)
+{
+    if (RAND_bytes(buf, len) != 1)
+        aead_error("RAND_bytes()");
+}
+
+
+
+/*
+ * Function:	hkdf
+ * --------------------------------------------------
+ * Derive len bytes from the pre-shared key (HKDF-SHA256).
+ */
+void hkdf(const uint8_t *salt, size_t salt_len, const char *info,
+          uint8_t *out, size_t len)
+{
+    const char *psk = getenv(AEAD_PSK_ENV);
+    EVP_PKEY_CTX *pctx;
+
+    if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL))
+        || EVP_PKEY_derive_init(pctx) <= 0
+        || EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0
+        || EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, salt_len) <= 0
+        || EVP_PKEY_CTX_set1_hkdf_key(pctx, (const uint8_t *) psk,
+                                      strlen(psk)) <= 0
+        || EVP_PKEY_CTX_add1_hkdf_info(pctx, (const uint8_t *) info,
+                                       strlen(info)) <= 0
+        || EVP_PKEY_derive(pctx, out, &len) <= 0)
+        aead_error("hkdf()");
+
+    EVP_PKEY_CTX_free(pctx);
+}
+
+
+
+/*
+ * Function:	aead_auth
+ * --------------------------------------------------
+ * Prove the knowledge of the pre-shared key in a handshake message,
+ * bound to the randomness of the ends and to the connection request.
+ *
+ * Parameters:
+ * 		label		who proves (different for the two ends)
+ * 		crandom		the random bytes of the client
+ * 		srandom		those of the server (NULL in the SYN)
+ * 		nonce		the nonce of the SYN
+ * 		auth		where to store the proof (AEAD_AUTH bytes)
+ */
+void aead_auth(const char *label, const uint8_t *crandom,
+               const uint8_t *srandom, uint32_t nonce, uint8_t *auth)
+{
+    uint8_t salt[2 * AEAD_RANDOM + sizeof(nonce)];
+    size_t len = 0;
+
+    memcpy(salt, crandom, AEAD_RANDOM);
+    len += AEAD_RANDOM;
+    if (srandom) {
+        memcpy(salt + len, srandom, AEAD_RANDOM);
+        len += AEAD_RANDOM;
+    }
+    nonce = htonl(nonce);
+    memcpy(salt + len, &nonce, sizeof(nonce));
+    len += sizeof(nonce);
+
+    hkdf(salt, len, label, auth, AEAD_AUTH);
+}
+
+
+
+/* true if auth is the proof aead_auth would make (constant time) */
+bool aead_auth_ok(const char *label, const uint8_t *crandom,
+                  const uint8_t *srandom, uint32_t nonce,
+                  const uint8_t *auth)
+{
+    uint8_t expected[AEAD_AUTH];
+
+    aead_auth(label, crandom, srandom, nonce, expected);
+    return CRYPTO_memcmp(expected, auth, AEAD_AUTH) == 0;
+}
+
+
+
+/*
+ * Function:	aead_derive
+ * --------------------------------------------------
+ * Derive the keys of a connection from the pre-shared key and the
+ * random bytes of both ends: every connection has its own, so that
+ * the sequence numbers can be the nonces.
+ *
+ * Parameters:
+ * 		crandom		the random bytes of the client
+ * 		srandom		those of the server
+ * 		client		true on the client (tx is the client to server key)
+ * 		keys		where to store the keys
+ */
+void aead_derive(const uint8_t *crandom, const uint8_t *srandom,
+                 bool client, struct aead_keys *keys)
+{
+    uint8_t salt[2 * AEAD_RANDOM];
+
+    memcpy(salt, crandom, AEAD_RANDOM);
+    memcpy(salt + AEAD_RANDOM, srandom, AEAD_RANDOM);
+
+    hkdf(salt, sizeof(salt), "rudp c2s", client ? keys->tx : keys->rx,
+         AEAD_KEY);
+    hkdf(salt, sizeof(salt), "rudp s2c", client ? keys->rx : keys->tx,
+         AEAD_KEY);
+}
+
+
+
+/*
+ * Function:	aead_new
+ * --------------------------------------------------
+ * Key a cipher for one direction of a connection. Not thread safe:
+ * each direction is served by a single thread.
+ *
+ * Parameters:
+ * 		cipher	AEAD_AES_GCM or AEAD_CHACHA
+ * 		key		the key (AEAD_KEY bytes)
+ * 		seal	true to encrypt, false to decrypt
+ *
+ * Returns:
+ * 		the cipher, to be freed with aead_free
+ */
+struct aead *aead_new(uint8_t cipher, const uint8_t *key, bool seal)
+{
+    const EVP_CIPHER *type = cipher == AEAD_AES_GCM ? EVP_aes_256_gcm()
+        : EVP_chacha20_poly1305();
+    struct aead *a;
+
+    if (!(a = malloc(sizeof(*a))))
+        aead_error("malloc() - aead_new");
+
+    if (!(a->ctx = EVP_CIPHER_CTX_new())
+        || EVP_CipherInit_ex(a->ctx, type, NULL, NULL, NULL, seal) != 1
+        || EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCE,
+                               NULL) != 1
+        || EVP_CipherInit_ex(a->ctx, NULL, NULL, key, NULL, seal) != 1)
+        aead_error("aead_new()");
+
+    return a;
+}
+
+
+
+void aead_free(struct aead *a)
+{
+    if (!a)
+        return;
+    EVP_CIPHER_CTX_free(a->ctx);
+    free(a);
+}
+
+
+
+/* the nonce of a segment: its extended sequence number */
+void aead_nonce(uint64_t seq, uint8_t *nonce)
+{
+    unsigned int i;
+
+    memset(nonce, 0, AEAD_NONCE);
+    for (i = 0; i < 8; i++)
+        nonce[AEAD_NONCE - 1 - i] = seq >> (8 * i);
+}
+
+
+
+/*
+ * Function:	aead_seal
+ * --------------------------------------------------
+ * Encrypt data in place and append its tag, which also covers
+ * the additional data (e.g. the header).
+ *
+ * Parameters:
+ * 		a		the cipher
+ * 		seq		the sequence number, never reused with the same key
+ * 		aad		the additional data
+ * 		aad_len	its size
+ * 		data	the data, with room for AEAD_TAG more bytes
+ * 		len		its size
+ */
+void aead_seal(struct aead *a, uint64_t seq, const void *aad,
+               size_t aad_len, uint8_t *data, size_t len)
+{
+    uint8_t nonce[AEAD_NONCE];
+    int n;
+
+    aead_nonce(seq, nonce);
+    if (EVP_EncryptInit_ex(a->ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_EncryptUpdate(a->ctx, NULL, &n, aad, aad_len) != 1
+        || EVP_EncryptUpdate(a->ctx, data, &n, data, len) != 1
+        || EVP_EncryptFinal_ex(a->ctx, data + n, &n) != 1
+        || EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG,
+                               data + len) != 1)
+        aead_error("aead_seal()");
+}
+
+
+
+/*
+ * Function:	aead_open
+ * --------------------------------------------------
+ * Check the tag following data and decrypt it in place.
+ *
+ * Parameters:
+ * 		as aead_seal, len not counting the tag
+ *
+ * Returns:
+ * 		true	if data and additional data are authentic
+ * 		false	otherwise (data is garbage)
+ */
+bool aead_open(struct aead *a, uint64_t seq, const void *aad,
+               size_t aad_len, uint8_t *data, size_t len)
+{
+    uint8_t nonce[AEAD_NONCE];
+    int n;
+
+    aead_nonce(seq, nonce);
+    if (EVP_DecryptInit_ex(a->ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_DecryptUpdate(a->ctx, NULL, &n, aad, aad_len) != 1
+        || EVP_DecryptUpdate(a->ctx, data, &n, data, len) != 1
+        || EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG,
+                               data + len) != 1)
+        aead_error("aead_open()");
+
+    return EVP_DecryptFinal_ex(a->ctx, data + n, &n) == 1;
+}
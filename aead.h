@@ -0,0 +1,49 @@
+#ifndef _AEAD_H
+#define _AEAD_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AEAD_PSK_ENV	"RUDP_PSK"  // pre-shared key: encrypt the segments
+#define AEAD_KEY		32
+#define AEAD_TAG		16          // appended to every sealed segment
+#define AEAD_RANDOM		16          // fresh bytes of each end (handshake)
+#define AEAD_AUTH		16          // proof of the key (handshake)
+
+// ciphers
+#define AEAD_NONE		0
+#define AEAD_AES_GCM	1           // AES-256-GCM, on CPUs with AES-NI
+#define AEAD_CHACHA		2           // ChaCha20-Poly1305 otherwise
+
+
+/* the keys of a connection, one per direction */
+struct aead_keys {
+	uint8_t tx[AEAD_KEY];
+	uint8_t rx[AEAD_KEY];
+};
+
+/* a cipher keyed for one direction: the key schedule is done once */
+struct aead;
+
+
+bool aead_psk(void);
+bool aead_hw_aes(void);
+void aead_random(void *buf, size_t len);
+void aead_auth(const char *label, const uint8_t *crandom,
+               const uint8_t *srandom, uint32_t nonce, uint8_t *auth);
+bool aead_auth_ok(const char *label, const uint8_t *crandom,
+                  const uint8_t *srandom, uint32_t nonce,
+                  const uint8_t *auth);
+void aead_derive(const uint8_t *crandom, const uint8_t *srandom,
+                 bool client, struct aead_keys *keys);
+struct aead *aead_new(uint8_t cipher, const uint8_t *key, bool seal);
+void aead_free(struct aead *a);
+void aead_seal(struct aead *a, uint64_t seq, const void *aad,
+               size_t aad_len, uint8_t *data, size_t len);
+bool aead_open(struct aead *a, uint64_t seq, const void *aad,
+               size_t aad_len, uint8_t *data, size_t len);
+
+
+#endif /* _AEAD_H */
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE             // cpu_set_t, sched_getcpu
+#include "affinity.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_DIR	"/sys/devices/system/node"
+#define CPU_DIR		"/sys/devices/system/cpu"
+
+
+enum affinity_policy aff_policy;
+cpu_set_t aff_cpus;             // irq and cpus policies
+unsigned int aff_next_node;     // spread policy
+pthread_once_t aff_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * Function:	parse_cpulist
+ * --------------------------------------------------
+ * Parse a CPU list in the kernel format ("0-3,8").
+ *
+ * Returns:
+ * 		0	on success (at least one CPU)
+ * 		-1	on a malformed list
+ */
+int parse_cpulist(const char *list, cpu_set_t *set)
+{
+    unsigned long lo, hi;
+    const char *p = list;
+    char *end;
+
+    CPU_ZERO(set);
+    while (*p && *p != '\n') {
+        errno = 0;
+        lo = hi = strtoul(p, &end, 10);
+        if (errno || end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtoul(p, &end, 10);
+            if (errno || end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+
+
+/*
+ * Function:	read_cpulist
+ * --------------------------------------------------
+ * Read a CPU list from a sysfs or procfs file.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the file is missing or malformed
+ */
+int read_cpulist(const char *path, cpu_set_t *set)
+{
+    char buf[1024];
+    FILE *f;
+    int ret = -1;
+
+    if (!(f = fopen(path, "r")))
+        return -1;
+    if (fgets(buf, sizeof(buf), f))
+        ret = parse_cpulist(buf, set);
+    fclose(f);
+
+    return ret;
+}
+
+
+
+/*
+ * Function:	affinity_init
+ * --------------------------------------------------
+ * Read the placement policy from the environment.
+ */
+void affinity_init(void)
+{
+    char *env = getenv(AFFINITY_ENV), path[64], *end;
+    unsigned long irq;
+
+    if (!env || !*env || strcmp(env, "none") == 0)
+        aff_policy = AFF_NONE;
+    else if (strcmp(env, "app") == 0)
+        aff_policy = AFF_APP;
+    else if (strcmp(env, "node") == 0)
+        aff_policy = AFF_NODE;
+    else if (strcmp(env, "spread") == 0)
+        aff_policy = AFF_SPREAD;
+    else if (strncmp(env, "irq=", 4) == 0) {
+        errno = 0;
+        irq = strtoul(env + 4, &end, 10);
+        if (errno || *end || end == env + 4)
+            goto invalid;
+        snprintf(path, sizeof(path), "/proc/irq/%lu/smp_affinity_list",
+                 irq);
+        if (read_cpulist(path, &aff_cpus) == -1) {
+            fprintf(stderr, "%s: cannot read %s\n", AFFINITY_ENV, path);
+            exit(EXIT_FAILURE);
+        }
+        aff_policy = AFF_IRQ;
+    } else if (strncmp(env, "cpus=", 5) == 0) {
+        if (parse_cpulist(env + 5, &aff_cpus) == -1)
+            goto invalid;
+        aff_policy = AFF_CPUS;
+    } else
+        goto invalid;
+
+    return;
+
+  invalid:
+    fprintf(stderr, "%s: invalid policy '%s'\n", AFFINITY_ENV, env);
+    exit(EXIT_FAILURE);
+}
+
+
+
+/*
+ * Function:	node_cpus
+ * --------------------------------------------------
+ * Get the CPUs of a NUMA node. A kernel without NUMA
+ * support has a single node with all the CPUs.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the node does not exist
+ */
+int node_cpus(unsigned int node, cpu_set_t *set)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), NODE_DIR "/node%u/cpulist", node);
+    if (read_cpulist(path, set) == 0)
+        return 0;
+    if (node == 0 && access(NODE_DIR, F_OK) == -1)
+        return sched_getaffinity(0, sizeof(*set), set);
+
+    return -1;
+}
+
+
+
+/*
+ * Function:	affinity_cpus
+ * --------------------------------------------------
+ * Choose the CPUs for the threads of a new connection,
+ * according to the policy and to where the caller runs.
+ *
+ * Returns:
+ * 		true	if the threads must be pinned to set
+ * 		false	otherwise
+ */
+bool affinity_cpus(cpu_set_t *set)
+{
+    unsigned int cpu, node, n;
+    char path[96];
+
+    pthread_once(&aff_once, affinity_init);
+
+    switch (aff_policy) {
+
+    case AFF_APP:
+    case AFF_NODE:
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+            return false;
+        if (aff_policy == AFF_NODE)
+            return node_cpus(node, set) == 0;
+        snprintf(path, sizeof(path),
+                 CPU_DIR "/cpu%u/topology/thread_siblings_list", cpu);
+        if (read_cpulist(path, set) == -1) {
+            CPU_ZERO(set);
+            CPU_SET(cpu, set);
+        }
+        return true;
+
+    case AFF_SPREAD:
+        n = __atomic_fetch_add(&aff_next_node, 1, __ATOMIC_RELAXED);
+        if (node_cpus(n, set) == 0)
+            return true;
+        /* past the last node: start over (nodes are numbered densely) */
+        __atomic_store_n(&aff_next_node, 1, __ATOMIC_RELAXED);
+        return node_cpus(0, set) == 0;
+
+    case AFF_IRQ:
+    case AFF_CPUS:
+        *set = aff_cpus;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+
+/*
+ * Function:	affinity_attr
+ * --------------------------------------------------
+ * Initialize the attributes of the threads of a new connection,
+ * pinning them as the policy requires. The threads they start
+ * inherit the placement.
+ *
+ * Parameters:
+ * 		attr	the attributes to initialize (to destroy after use)
+ *
+ * Returns:
+ * 		true	if the threads are pinned
+ * 		false	otherwise
+ */
+bool affinity_attr(pthread_attr_t *attr)
+{
+    cpu_set_t set;
+
+    if (pthread_attr_init(attr) != 0)
+        return false;
+    if (!affinity_cpus(&set))
+        return false;
+
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
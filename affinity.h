@@ -0,0 +1,40 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define AFFINITY_ENV	"RUDP_AFFINITY"
+
+
+/*
+ * Placement of the threads serving a connection, read from the
+ * RUDP_AFFINITY environment variable:
+ *
+ * 		none			let the scheduler move them (default)
+ * 		app				the core of the thread starting the connection
+ * 						(and its hyperthread siblings)
+ * 		node			the NUMA node of the thread starting the connection
+ * 		spread			the NUMA nodes in turn, one connection each
+ * 		irq=<n>			the CPUs serving interrupt n (the NIC's queue)
+ * 		cpus=<list>		the given CPUs, e.g. cpus=0-3,8
+ *
+ * The segments in flight, the bulk of a connection's memory, are
+ * allocated and first written by its send thread, so the kernel
+ * places their pages on the node it runs on.
+ */
+enum affinity_policy {
+	AFF_NONE,
+	AFF_APP,
+	AFF_NODE,
+	AFF_SPREAD,
+	AFF_IRQ,
+	AFF_CPUS
+};
+
+
+bool affinity_attr(pthread_attr_t *attr);
+
+
+#endif /* _AFFINITY_H */
@@ -25,13 +25,21 @@
 #define LIST 		0
 #define GET 		1
 #define PUT 		2
-#define MAXCMD 		2
+#define RGET 		3
+#define RPUT 		4
+#define DPUT 		5
+#define LISTX 		6
+#define MAXCMD 		6
 
 // response codes
 #define GET_OK 		0
 #define GET_NOENT 	1
 #define PUT_SUCCESS 2
 #define PUT_FAILURE 3
+#define PUT_RESUME 	4
+#define GET_RANGE 	5	// the copy is not a prefix, file size follows
+
+#define RPUT_ABORT	UINT64_MAX	// RPUT length: the copy is not a prefix
 
 #define handle_error(msg) \
     do { perror(msg); exit(EXIT_FAILURE); } while (0)
@@ -42,6 +50,10 @@ struct proto_params {
 	uint8_t  P;
 	uint8_t  N;
 	uint8_t  adaptive;
+	uint8_t  compress;
+	uint16_t mss;		// largest payload both ends accept (0: MSS)
+	uint8_t  aead;		// cipher of the segments (AEAD_NONE: plaintext)
+	uint32_t cid;		// connection ID, chosen by the server
 };
 
 
@@ -0,0 +1,584 @@
+#include "basic.h"
+#include "transport.h"
+#include "clicmd.h"
+#include "srvcmd.h"
+#include "strto.h"
+#include "timespec_utils.h"
+#include "netem.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+
+/*
+ * Throughput/latency benchmark of the transport layer.
+ *
+ * Every run transfers a file with a GET between a server process and
+ * a client process connected over loopback (each end in a process of
+ * its own, as the real server and client: their CPU time and their
+ * counters stay apart).
+ * The parent sweeps the cartesian product of the parameter lists,
+ * repeats each point and prints one CSV row per point on stdout.
+ * With RUDP_PSK set the segments are sealed, as the handshake would
+ * agree, with fresh keys at every run.
+ */
+
+
+#define BENCH_DONE		0xff    // client -> server: transfer verified
+#define MAX_VALUES		32
+#define MAX_RUNS		1000
+#define BENCH_SEED		0x2545F4914F6CDD1DULL
+
+
+struct bench_list {
+    unsigned long v[MAX_VALUES];
+    unsigned int n;
+};
+
+/* result of a run, as reported by the client */
+struct bench_sample {
+    long long elapsed;          // transfer time (ns)
+    bool ok;                    // the file was received entirely
+};
+
+/* what the parent measures of a run */
+struct bench_run {
+    long long elapsed;          // ns
+    long long cpu;              // user + system time of both ends (ns)
+    struct rdt_stats stats;     // server side counters
+};
+
+
+char bench_dir[] = "/tmp/rudp-bench.XXXXXX";
+
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-N widths] [-T timeouts] [-P losses] [-a 0,1]\n"
+            "          [-s sizes] [-r repeats] [-t run_timeout] [-z]\n"
+            "Lists are comma separated, sizes accept K/M/G suffixes.\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+
+/*
+ * Function:	parse_list
+ * --------------------------------------------------
+ * Parse a comma separated list, checking every value with
+ * the given conversion function.
+ */
+void parse_list(struct bench_list *list, char *arg,
+                unsigned long (*conv)(const char *))
+{
+    char *tok, *save;
+
+    list->n = 0;
+    for (tok = strtok_r(arg, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (list->n == MAX_VALUES) {
+            fprintf(stderr, "Too many values in '%s'\n", arg);
+            exit(EXIT_FAILURE);
+        }
+        list->v[list->n++] = conv(tok);
+    }
+    if (!list->n)
+        usage("bench");
+}
+
+
+
+unsigned long conv_width(const char *arg)
+{
+    return strtowidth(arg);
+}
+
+unsigned long conv_timeout(const char *arg)
+{
+    return strtotimeout(arg);
+}
+
+unsigned long conv_loss(const char *arg)
+{
+    return strtoloss(arg);
+}
+
+unsigned long conv_bool(const char *arg)
+{
+    if (strcmp(arg, "0") && strcmp(arg, "1")) {
+        fprintf(stderr, "Invalid boolean '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return arg[0] == '1';
+}
+
+unsigned long conv_size(const char *arg)
+{
+    unsigned long v;
+    char *p;
+
+    errno = 0;
+    v = strtoul(arg, &p, 0);
+    if (*p == 'K' || *p == 'k')
+        v <<= 10, p++;
+    else if (*p == 'M' || *p == 'm')
+        v <<= 20, p++;
+    else if (*p == 'G' || *p == 'g')
+        v <<= 30, p++;
+    if (errno || *p) {
+        fprintf(stderr, "Invalid size '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+
+
+/*
+ * Function:	make_file
+ * --------------------------------------------------
+ * Create the file to transfer, filled by a seeded xorshift
+ * generator so that every run sends the same bytes.
+ */
+void make_file(const char *path, unsigned long size)
+{
+    uint64_t x = BENCH_SEED ^ size, buf[MAX_BUFSIZE / sizeof(uint64_t)];
+    unsigned long done, n;
+    unsigned int i;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        handle_error("open() - creating benchmark file");
+
+    for (done = 0; done < size; done += n) {
+        for (i = 0; i < MAX_BUFSIZE / sizeof(uint64_t); i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = x;
+        }
+        n = size - done < MAX_BUFSIZE ? size - done : MAX_BUFSIZE;
+        if (writen(fd, buf, n) == -1)
+            handle_error("writen() - writing benchmark file");
+    }
+
+    if (close(fd) == -1)
+        handle_error("close() - closing benchmark file");
+}
+
+
+
+/*
+ * Function:	loopback_pair
+ * --------------------------------------------------
+ * Create two UDP sockets bound to ephemeral loopback ports and
+ * connected to each other.
+ */
+void loopback_pair(int sd[2])
+{
+    struct sockaddr_in addr[2];
+    socklen_t len;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if ((sd[i] = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+            handle_error("socket()");
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].sin_family = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        len = sizeof(addr[i]);
+        if (bind(sd[i], (struct sockaddr *) &addr[i], len) == -1
+            || getsockname(sd[i], (struct sockaddr *) &addr[i], &len) == -1)
+            handle_error("bind()");
+    }
+
+    for (i = 0; i < 2; i++)
+        if (connect(sd[i], (struct sockaddr *) &addr[1 - i],
+                    sizeof(addr[1 - i])) == -1)
+            handle_error("connect()");
+}
+
+
+
+/*
+ * Function:	enter_child
+ * --------------------------------------------------
+ * Common setup of the two ends: move into the end's directory
+ * and silence the progress and log output of the commands.
+ */
+void enter_child(const char *subdir)
+{
+    char path[sizeof(bench_dir) + 8];
+    int devnull;
+
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, subdir);
+    if (chdir(path) == -1)
+        handle_error("chdir()");
+
+    if ((devnull = open("/dev/null", O_WRONLY)) == -1
+        || dup2(devnull, STDOUT_FILENO) == -1
+        || dup2(devnull, STDERR_FILENO) == -1)
+        handle_error("redirecting output");
+    close(devnull);
+}
+
+
+
+void server_end(int sd, struct proto_params *params, int report,
+                struct aead_keys *keys)
+{
+    struct rdt_stats stats;
+
+    enter_child("srv");
+    init_transport(sd, NULL, params, keys);
+
+    if (recvcmd() != GET)
+        exit(EXIT_FAILURE);
+    srv_get();
+
+    /* the counters are final once the client got the whole file */
+    if (recvcmd() != BENCH_DONE)
+        exit(EXIT_FAILURE);
+    rdt_get_stats(&stats);
+    if (writen(report, &stats, sizeof(stats)) == -1)
+        handle_error("writen() - reporting server stats");
+
+    for (;;)
+        pause();
+}
+
+
+
+void client_end(int sd, struct proto_params *params, int report,
+                struct aead_keys *keys, const char *name,
+                unsigned long size)
+{
+    struct bench_sample sample;
+    struct timespec start, end, elapsed;
+    struct stat st;
+    uint8_t done = BENCH_DONE;
+
+    enter_child("cli");
+    init_transport(sd, NULL, params, keys);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+        handle_error("clock_gettime()");
+    cli_get(name);
+    if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+        handle_error("clock_gettime()");
+
+    timespec_sub(&elapsed, &end, &start);
+    sample.elapsed = tstonsec(&elapsed);
+    sample.ok = stat(name, &st) == 0 && (unsigned long) st.st_size == size;
+    unlink(name);
+
+    rdt_send(&done, sizeof(done));
+    if (writen(report, &sample, sizeof(sample)) == -1)
+        handle_error("writen() - reporting sample");
+
+    for (;;)
+        pause();
+}
+
+
+
+/*
+ * Function:	read_report
+ * --------------------------------------------------
+ * Read a report from a child before the deadline.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on timeout or if the child died
+ */
+int read_report(int fd, void *buf, size_t len, struct timespec *deadline)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timespec now, left;
+    int r;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+        handle_error("clock_gettime()");
+    if (timespec_sub(&left, deadline, &now) == -1)
+        return -1;
+
+    do
+        r = poll(&pfd, 1, tstonsec(&left) / 1000000 + 1);
+    while (r == -1 && errno == EINTR);
+
+    if (r <= 0)
+        return -1;
+    return readn(fd, buf, len) == (ssize_t) len ? 0 : -1;
+}
+
+
+
+long long child_cpu(pid_t pid)
+{
+    struct rusage ru;
+
+    kill(pid, SIGKILL);
+    if (wait4(pid, NULL, 0, &ru) == -1)
+        handle_error("wait4()");
+
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+
+
+/*
+ * Function:	bench_one
+ * --------------------------------------------------
+ * Transfer a file once.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the transfer failed or timed out
+ */
+int bench_one(struct proto_params *params, const char *name,
+              unsigned long size, unsigned int timeout,
+              struct bench_run *run)
+{
+    int sd[2], srv_pipe[2], cli_pipe[2], ret = 0;
+    struct bench_sample sample = { 0, false };
+    struct timespec deadline;
+    struct aead_keys srv_keys, cli_keys;
+    uint8_t crandom[AEAD_RANDOM], srandom[AEAD_RANDOM];
+    pid_t srv, cli;
+
+    if (params->aead) {
+        aead_random(crandom, AEAD_RANDOM);
+        aead_random(srandom, AEAD_RANDOM);
+        aead_derive(crandom, srandom, false, &srv_keys);
+        aead_derive(crandom, srandom, true, &cli_keys);
+    }
+
+    loopback_pair(sd);
+    if (pipe(srv_pipe) == -1 || pipe(cli_pipe) == -1)
+        handle_error("pipe()");
+
+    fflush(stdout);
+    if ((srv = fork()) == -1)
+        handle_error("fork()");
+    if (!srv) {
+        close(sd[1]);
+        server_end(sd[0], params, srv_pipe[1], &srv_keys);
+    }
+
+    if ((cli = fork()) == -1)
+        handle_error("fork()");
+    if (!cli) {
+        close(sd[0]);
+        client_end(sd[1], params, cli_pipe[1], &cli_keys, name, size);
+    }
+
+    close(sd[0]);
+    close(sd[1]);
+    close(srv_pipe[1]);
+    close(cli_pipe[1]);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1)
+        handle_error("clock_gettime()");
+    deadline.tv_sec += timeout;
+
+    if (read_report(cli_pipe[0], &sample, sizeof(sample), &deadline) == -1
+        || !sample.ok
+        || read_report(srv_pipe[0], &run->stats, sizeof(run->stats),
+                       &deadline) == -1)
+        ret = -1;
+
+    run->elapsed = sample.elapsed;
+    run->cpu = child_cpu(cli) + child_cpu(srv);
+
+    close(srv_pipe[0]);
+    close(cli_pipe[0]);
+    return ret;
+}
+
+
+
+int ll_cmp(const void *x, const void *y)
+{
+    long long a = *(const long long *) x, b = *(const long long *) y;
+
+    return (a > b) - (a < b);
+}
+
+
+
+/* nearest-rank percentile of sorted samples */
+long long percentile(long long *v, unsigned int n, unsigned int p)
+{
+    unsigned int rank = (p * n + 99) / 100;
+
+    return v[rank ? rank - 1 : 0];
+}
+
+
+
+/*
+ * Function:	bench_point
+ * --------------------------------------------------
+ * Repeat the transfer for a point of the sweep and print its row.
+ */
+void bench_point(struct proto_params *params, unsigned long size,
+                 unsigned int repeats, unsigned int timeout)
+{
+    long long elapsed[MAX_RUNS], cpu = 0, p50, p99;
+    uint64_t sent = 0, rtx = 0;
+    struct bench_run run;
+    unsigned int i, ok = 0, failed = 0;
+    char name[32];
+
+    snprintf(name, sizeof(name), "f%lu", size);
+
+    for (i = 0; i < repeats; i++) {
+        if (bench_one(params, name, size, timeout, &run) == -1) {
+            failed++;
+            continue;
+        }
+        elapsed[ok++] = run.elapsed;
+        cpu += run.cpu;
+        sent += run.stats.sent;
+        rtx += run.stats.rtx;
+    }
+
+    printf("%u,%u,%u,%u,%u,%lu,%u,%u,", params->N, params->T, params->P,
+           params->adaptive, params->compress, size, ok, failed);
+
+    if (!ok) {
+        puts("nan,nan,nan,nan,nan");
+        fflush(stdout);
+        return;
+    }
+
+    qsort(elapsed, ok, sizeof(elapsed[0]), ll_cmp);
+    p50 = percentile(elapsed, ok, 50);
+    p99 = percentile(elapsed, ok, 99);
+
+    printf("%.3f,%.3f,%.3f,%.4f,%.3f\n",
+           size * 8 / (p50 / 1e3),          // Mbit/s at the median time
+           p50 / 1e6, p99 / 1e6,
+           sent ? (double) rtx / sent : 0.0, cpu / 1e6 / ok);
+    fflush(stdout);
+}
+
+
+
+void cleanup(struct bench_list *sizes)
+{
+    char path[sizeof(bench_dir) + 40];
+    unsigned int i;
+
+    for (i = 0; i < sizes->n; i++) {
+        snprintf(path, sizeof(path), "%s/srv/f%lu", bench_dir,
+                 sizes->v[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/srv", bench_dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/cli", bench_dir);
+    rmdir(path);
+    rmdir(bench_dir);
+}
+
+
+
+int main(int argc, char **argv)
+{
+    struct bench_list widths = { { 30 }, 1 }, timeouts = { { 1000 }, 1 };
+    struct bench_list losses = { { 0 }, 1 }, adaptive = { { 0 }, 1 };
+    struct bench_list sizes = { { 1 << 20 }, 1 };
+    unsigned int repeats = 5, timeout = 120, i, n, t, p, a, s;
+    struct proto_params params;
+    char path[sizeof(bench_dir) + 40];
+    int c;
+
+    memset(&params, 0, sizeof(params));
+    params.mss = MSS_MAX;       // as far as the path MTU allows
+    params.cid = 1;             // the two ends are alone on their sockets
+
+    while ((c = getopt(argc, argv, "N:T:P:a:s:r:t:z")) != -1) {
+        switch (c) {
+        case 'N':
+            parse_list(&widths, optarg, conv_width);
+            break;
+        case 'T':
+            parse_list(&timeouts, optarg, conv_timeout);
+            break;
+        case 'P':
+            parse_list(&losses, optarg, conv_loss);
+            break;
+        case 'a':
+            parse_list(&adaptive, optarg, conv_bool);
+            break;
+        case 's':
+            parse_list(&sizes, optarg, conv_size);
+            break;
+        case 'r':
+            repeats = argtoul(optarg);
+            if (!repeats || repeats > MAX_RUNS)
+                usage(argv[0]);
+            break;
+        case 't':
+            timeout = argtoul(optarg);
+            if (!timeout)
+                usage(argv[0]);
+            break;
+        case 'z':
+            params.compress = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (aead_psk())
+        params.aead = aead_hw_aes() ? AEAD_AES_GCM : AEAD_CHACHA;
+
+    /* a dead end must not kill the parent writing to its socket */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* check the link emulator configuration before forking the ends */
+    netem_rand();
+
+    if (!mkdtemp(bench_dir))
+        handle_error("mkdtemp()");
+    snprintf(path, sizeof(path), "%s/srv", bench_dir);
+    if (mkdir(path, 0755) == -1)
+        handle_error("mkdir()");
+    snprintf(path, sizeof(path), "%s/cli", bench_dir);
+    if (mkdir(path, 0755) == -1)
+        handle_error("mkdir()");
+    for (i = 0; i < sizes.n; i++) {
+        snprintf(path, sizeof(path), "%s/srv/f%lu", bench_dir,
+                 sizes.v[i]);
+        make_file(path, sizes.v[i]);
+    }
+
+    puts("N,T,P,adaptive,compress,size,runs,failures,"
+         "mbps,p50_ms,p99_ms,rtx_ratio,cpu_ms");
+
+    for (n = 0; n < widths.n; n++)
+        for (t = 0; t < timeouts.n; t++)
+            for (p = 0; p < losses.n; p++)
+                for (a = 0; a < adaptive.n; a++)
+                    for (s = 0; s < sizes.n; s++) {
+                        params.N = widths.v[n];
+                        params.T = timeouts.v[t];
+                        params.P = losses.v[p];
+                        params.adaptive = adaptive.v[a];
+                        fprintf(stderr, "N=%u T=%u P=%u a=%u size=%lu\n",
+                                params.N, params.T, params.P,
+                                params.adaptive, sizes.v[s]);
+                        bench_point(&params, sizes.v[s], repeats, timeout);
+                    }
+
+    cleanup(&sizes);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,562 @@
+#include "chunk_cache.h"
+#include "rw.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/*
+ * The cache lives in an anonymous shared mapping created by the server
+ * before forking, so every connection process sees the same chunks.
+ * Slots hold CACHE_CHUNK bytes of a file, aligned to CACHE_CHUNK, and
+ * are found through a chained hash table. Metadata is protected by a
+ * robust process-shared mutex; the chunk data is read without the lock
+ * and validated with the slot's sequence counter (odd while the slot
+ * is being refilled), so a process dying in the middle of a transfer
+ * never leaves a slot pinned.
+ */
+
+
+struct chunk_key {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;                 // detects appends within the mtime granularity
+    uint64_t offset;
+};
+
+struct cache_slot {
+    struct chunk_key key;
+    uint32_t len;               // valid bytes of the chunk
+    uint32_t seq;               // odd while filling, 0 if never used
+    int32_t next;               // next slot of the hash chain
+    uint8_t referenced;         // CLOCK reference bit
+    pid_t filler;               // process filling the slot
+};
+
+struct cache_header {
+    pthread_mutex_t mtx;
+    uint32_t nslots;
+    uint32_t nbuckets;          // power of 2
+    uint32_t hand;              // CLOCK hand
+    uint64_t hits;
+    uint64_t misses;
+};
+
+
+struct cache_header *cache = NULL;
+struct cache_slot *cache_slots;
+int32_t *cache_buckets;
+uint8_t *cache_data;
+
+
+
+/*
+ * Function:	cache_init
+ * --------------------------------------------------
+ * Create the shared chunk cache. It must be called before forking
+ * the processes that share it.
+ *
+ * Parameters:
+ * 		size	the memory reserved for chunks (0 disables the cache)
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error
+ */
+int cache_init(size_t size)
+{
+    pthread_mutexattr_t attr;
+    uint32_t nslots = size / CACHE_CHUNK, nbuckets, i;
+    size_t meta;
+    void *p;
+
+    if (!nslots)
+        return 0;
+
+    for (nbuckets = 1; nbuckets < 2 * nslots; nbuckets <<= 1);
+
+    meta = sizeof(struct cache_header) + nslots * sizeof(struct cache_slot)
+        + nbuckets * sizeof(int32_t);
+    meta = (meta + CACHE_CHUNK - 1) / CACHE_CHUNK * CACHE_CHUNK;
+
+    p = mmap(NULL, meta + (size_t) nslots * CACHE_CHUNK,
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    cache = p;
+    cache_slots = (struct cache_slot *) (cache + 1);
+    cache_buckets = (int32_t *) (cache_slots + nslots);
+    cache_data = (uint8_t *) p + meta;
+
+    cache->nslots = nslots;
+    cache->nbuckets = nbuckets;
+    for (i = 0; i < nslots; i++)
+        cache_slots[i].next = -1;
+    memset(cache_buckets, -1, nbuckets * sizeof(int32_t));
+
+    if (pthread_mutexattr_init(&attr)
+        || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)
+        || pthread_mutex_init(&cache->mtx, &attr))
+        return -1;
+    pthread_mutexattr_destroy(&attr);
+
+    return 0;
+}
+
+
+
+bool cache_enabled(void)
+{
+    return cache != NULL;
+}
+
+
+
+void cache_lock(void)
+{
+    if (pthread_mutex_lock(&cache->mtx) == EOWNERDEAD)
+        /* the owner died inside a short metadata update: go on */
+        pthread_mutex_consistent(&cache->mtx);
+}
+
+
+
+void cache_unlock(void)
+{
+    pthread_mutex_unlock(&cache->mtx);
+}
+
+
+
+uint32_t cache_bucket(struct chunk_key *key)
+{
+    uint64_t h = key->ino * 0x9E3779B185EBCA87ULL;
+
+    h ^= (key->dev + key->offset / CACHE_CHUNK) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+
+    return h & (cache->nbuckets - 1);
+}
+
+
+
+bool cache_key_equal(struct chunk_key *a, struct chunk_key *b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->offset == b->offset
+        && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec
+        && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+
+
+void cache_unlink(int32_t slot)
+{
+    int32_t *p = &cache_buckets[cache_bucket(&cache_slots[slot].key)];
+
+    for (; *p != -1; p = &cache_slots[*p].next)
+        if (*p == slot) {
+            *p = cache_slots[slot].next;
+            break;
+        }
+}
+
+
+
+/*
+ * Function:	cache_victim
+ * --------------------------------------------------
+ * Choose the slot to refill with the CLOCK algorithm, skipping the
+ * slots that a live process is filling. Called with the lock held.
+ *
+ * Returns:
+ * 		the slot index,
+ * 		-1 if every slot is busy
+ */
+int32_t cache_victim(void)
+{
+    struct cache_slot *s;
+    uint32_t i;
+
+    for (i = 0; i < 2 * cache->nslots + 1; i++) {
+
+        s = &cache_slots[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->nslots;
+
+        if (s->seq & 1) {
+            if (kill(s->filler, 0) == 0 || errno != ESRCH)
+                continue;
+            s->seq++;           // the filler died: reclaim the slot
+        }
+        if (s->referenced) {
+            s->referenced = 0;
+            continue;
+        }
+
+        return s - cache_slots;
+    }
+
+    return -1;
+}
+
+
+
+/* the slot holding a chunk, -1 if none. Called with the lock held. */
+int32_t cache_find(struct chunk_key *key, uint32_t b)
+{
+    int32_t i;
+
+    for (i = cache_buckets[b]; i != -1; i = cache_slots[i].next)
+        if (cache_key_equal(&cache_slots[i].key, key))
+            break;
+
+    return i;
+}
+
+
+
+/*
+ * Function:	cache_claim
+ * --------------------------------------------------
+ * Take a slot for a chunk and link it to its bucket, marked as being
+ * filled by the calling process. Called with the lock held.
+ *
+ * Returns:
+ * 		the slot index,
+ * 		-1 if every slot is busy
+ */
+int32_t cache_claim(struct chunk_key *key, uint32_t b)
+{
+    struct cache_slot *s;
+    int32_t i;
+
+    if ((i = cache_victim()) == -1)
+        return -1;
+
+    s = &cache_slots[i];
+    if (s->seq)
+        cache_unlink(i);
+    s->key = *key;
+    s->len = 0;
+    s->referenced = 1;
+    s->filler = getpid();
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->next = cache_buckets[b];
+    cache_buckets[b] = i;
+
+    return i;
+}
+
+
+
+/*
+ * Function:	cache_publish
+ * --------------------------------------------------
+ * End the filling of a slot taken with cache_claim.
+ *
+ * Parameters:
+ * 		i	the slot index
+ * 		n	the valid bytes of the chunk (-1: the read failed)
+ *
+ * Returns:
+ * 		the new sequence counter of the slot
+ */
+uint32_t cache_publish(int32_t i, ssize_t n)
+{
+    struct cache_slot *s = &cache_slots[i];
+    uint32_t seq;
+
+    cache_lock();
+    if (n != -1)
+        s->len = n;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    seq = s->seq + 1;
+    __atomic_store_n(&s->seq, seq, __ATOMIC_RELAXED);
+    cache_unlock();
+
+    return seq;
+}
+
+
+
+/*
+ * Function:	cache_copy
+ * --------------------------------------------------
+ * Copy a piece of a cached chunk, then check that the slot was not
+ * refilled in the meantime.
+ *
+ * Returns:
+ * 		true	if the copied data is valid
+ */
+bool cache_copy(int32_t slot, uint32_t seq, void *buf, size_t off,
+                size_t len)
+{
+    memcpy(buf, cache_data + (size_t) slot * CACHE_CHUNK + off, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&cache_slots[slot].seq, __ATOMIC_RELAXED) == seq;
+}
+
+
+
+/* the bytes of the file in a chunk: CACHE_CHUNK but at the end */
+size_t cache_chunk_len(struct chunk_key *key)
+{
+    uint64_t left = key->size - key->offset;
+
+    return left < CACHE_CHUNK ? left : CACHE_CHUNK;
+}
+
+
+
+void cache_key_init(struct chunk_key *key, struct stat *st)
+{
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->mtime = st->st_mtim;
+    key->size = st->st_size;
+}
+
+
+
+/*
+ * Function:	cache_chunk
+ * --------------------------------------------------
+ * Read a piece of a single chunk through the cache, loading the
+ * whole chunk from the file on a miss.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on read error
+ */
+int cache_chunk(int fd, struct chunk_key *key, void *buf, size_t off,
+                size_t len)
+{
+    struct cache_slot *s;
+    uint32_t b, seq;
+    int32_t i;
+    ssize_t n;
+
+    b = cache_bucket(key);
+
+    cache_lock();
+    i = cache_find(key, b);
+
+    if (i != -1 && !(cache_slots[i].seq & 1)
+        && off + len <= cache_slots[i].len) {
+        /* hit */
+        s = &cache_slots[i];
+        s->referenced = 1;
+        seq = s->seq;
+        cache->hits++;
+        cache_unlock();
+
+        if (cache_copy(i, seq, buf, off, len))
+            return 0;
+        return preadn(fd, buf, len, key->offset + off) == (ssize_t) len
+            ? 0 : -1;
+    }
+
+    cache->misses++;
+    if (i != -1 || (i = cache_claim(key, b)) == -1) {
+        /* being filled by another process, or no free slot */
+        cache_unlock();
+        return preadn(fd, buf, len, key->offset + off) == (ssize_t) len
+            ? 0 : -1;
+    }
+    cache_unlock();
+
+    n = preadn(fd, cache_data + (size_t) i * CACHE_CHUNK,
+               cache_chunk_len(key), key->offset);
+    seq = cache_publish(i, n);
+
+    if (n == -1 || off + len > (size_t) n)
+        return -1;
+
+    if (cache_copy(i, seq, buf, off, len))
+        return 0;
+    return preadn(fd, buf, len, key->offset + off) == (ssize_t) len
+        ? 0 : -1;
+}
+
+
+
+/*
+ * Function:	cache_read
+ * --------------------------------------------------
+ * Read a range of a file through the shared chunk cache.
+ * The file is identified by device, inode, modification time and size,
+ * so a modified file never hits the chunks of its previous version.
+ *
+ * Parameters:
+ * 		fd		descriptor of the file
+ * 		st		status of the file
+ * 		buf		destination buffer
+ * 		len		number of bytes to read
+ * 		offset	position of the first byte into the file
+ *
+ * Returns:
+ * 		the number of bytes read (len),
+ * 		-1 on error
+ */
+ssize_t cache_read(int fd, struct stat *st, void *buf, size_t len,
+                   uint64_t offset)
+{
+    struct chunk_key key;
+    size_t done, n, off;
+
+    if (!cache)
+        return preadn(fd, buf, len, offset);
+
+    cache_key_init(&key, st);
+
+    for (done = 0; done < len; done += n) {
+        key.offset = (offset + done) / CACHE_CHUNK * CACHE_CHUNK;
+        off = offset + done - key.offset;
+        n = CACHE_CHUNK - off;
+        if (n > len - done)
+            n = len - done;
+
+        if (cache_chunk(fd, &key, (uint8_t *) buf + done, off, n) == -1)
+            return -1;
+    }
+
+    return len;
+}
+
+
+
+/*
+ * Function:	cache_peek
+ * --------------------------------------------------
+ * Read a range of a file from the cache alone: the read ahead asks
+ * it before reading the range from the file itself.
+ *
+ * Parameters:
+ * 		st		status of the file
+ * 		buf		destination buffer
+ * 		len		number of bytes to read
+ * 		offset	position of the first byte into the file
+ *
+ * Returns:
+ * 		0	if every chunk of the range was cached (counted as hits)
+ * 		-1	otherwise (counted as misses, buf holds garbage)
+ */
+int cache_peek(struct stat *st, void *buf, size_t len, uint64_t offset)
+{
+    struct chunk_key key;
+    size_t done, n, off;
+    uint32_t seq, chunks;
+    int32_t i;
+
+    if (!cache || !len)
+        return -1;
+
+    cache_key_init(&key, st);
+    chunks = (offset + len - 1) / CACHE_CHUNK - offset / CACHE_CHUNK + 1;
+
+    for (done = 0; done < len; done += n) {
+        key.offset = (offset + done) / CACHE_CHUNK * CACHE_CHUNK;
+        off = offset + done - key.offset;
+        n = CACHE_CHUNK - off;
+        if (n > len - done)
+            n = len - done;
+
+        cache_lock();
+        i = cache_find(&key, cache_bucket(&key));
+        if (i == -1 || (cache_slots[i].seq & 1)
+            || off + n > cache_slots[i].len)
+            break;
+        cache_slots[i].referenced = 1;
+        seq = cache_slots[i].seq;
+        cache_unlock();
+
+        if (!cache_copy(i, seq, (uint8_t *) buf + done, off, n)) {
+            cache_lock();
+            break;
+        }
+    }
+
+    /* with the lock held if a chunk is missing */
+    if (done < len) {
+        cache->misses += chunks;
+        cache_unlock();
+        return -1;
+    }
+
+    cache_lock();
+    cache->hits += chunks;
+    cache_unlock();
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	cache_fill
+ * --------------------------------------------------
+ * Store the chunks that a range of a file, read elsewhere, covers
+ * in full. Chunks already cached (or being filled) are left alone.
+ *
+ * Parameters:
+ * 		st		status of the file
+ * 		buf		the data of the range
+ * 		len		size of the range
+ * 		offset	position of the range into the file
+ */
+void cache_fill(struct stat *st, const void *buf, size_t len,
+                uint64_t offset)
+{
+    struct chunk_key key;
+    size_t n;
+    uint32_t b;
+    int32_t i;
+
+    if (!cache)
+        return;
+
+    cache_key_init(&key, st);
+
+    for (key.offset = (offset + CACHE_CHUNK - 1) / CACHE_CHUNK * CACHE_CHUNK;
+         key.offset < (uint64_t) key.size; key.offset += CACHE_CHUNK) {
+
+        n = cache_chunk_len(&key);
+        if (key.offset + n > offset + len)
+            break;
+
+        b = cache_bucket(&key);
+        cache_lock();
+        if (cache_find(&key, b) != -1 || (i = cache_claim(&key, b)) == -1) {
+            cache_unlock();
+            continue;
+        }
+        cache_unlock();
+
+        memcpy(cache_data + (size_t) i * CACHE_CHUNK,
+               (const uint8_t *) buf + (key.offset - offset), n);
+        cache_publish(i, n);
+    }
+}
+
+
+
+void cache_stats(uint64_t * hits, uint64_t * misses)
+{
+    *hits = *misses = 0;
+    if (!cache)
+        return;
+
+    cache_lock();
+    *hits = cache->hits;
+    *misses = cache->misses;
+    cache_unlock();
+}
@@ -0,0 +1,23 @@
+#ifndef _CHUNK_CACHE_H
+#define _CHUNK_CACHE_H
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_CHUNK		(64 * 1024)
+
+
+int cache_init(size_t size);
+bool cache_enabled(void);
+ssize_t cache_read(int fd, struct stat *st, void *buf, size_t len,
+                   uint64_t offset);
+int cache_peek(struct stat *st, void *buf, size_t len, uint64_t offset);
+void cache_fill(struct stat *st, const void *buf, size_t len,
+                uint64_t offset);
+void cache_stats(uint64_t *hits, uint64_t *misses);
+
+
+#endif /* _CHUNK_CACHE_H */
@@ -1,6 +1,9 @@
 #include "basic.h"
 #include "transport.h"
 #include "cmd_commons.h"
+#include "delta.h"
+
+#include <sys/mman.h>
 
 
 /* Function:	get_cmdcode
@@ -16,7 +19,8 @@
 unsigned short get_cmdcode(const char *input)
 {
     unsigned short i;
-    char *commands[] = { "list", "get", "put" };
+    char *commands[] =
+        { "list", "get", "put", "rget", "rput", "dput", "ls" };
 
     for (i = 0; i <= MAXCMD; i++)
         if (strcmp(input, commands[i]) == 0)
@@ -37,15 +41,24 @@ void cli_list()
     rdt_send(&cmd, sizeof(cmd));
 
     /* read list size */
-    rdt_recv(&file_size, sizeof(file_size));
+    if (recv_exact(&file_size, sizeof(file_size)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
 
-    /* allocate buffer */
-    buffer = malloc(file_size);
+    /* allocate buffer (and the terminating null byte) */
+    buffer = malloc(file_size + 1);
     if (!buffer)
         handle_error("malloc()");
 
     /* recv file list */
-    rdt_recv(buffer, file_size);
+    if (recv_buffer(buffer, file_size) == -1) {
+        puts(errno == ECONNRESET ? "The server closed the connection."
+             : "The file list arrived corrupted.");
+        free(buffer);
+        return;
+    }
+    buffer[file_size] = '\0';
 
     /* print file list and free memory */
     printf("\n%s\n", buffer);
@@ -54,11 +67,68 @@ void cli_list()
 
 
 
+/*
+ * Function:	cli_listx
+ * ------------------------------------------
+ * Request a page of the server's file list, optionally with the
+ * size and the modification time of every file.
+ *
+ * Parameters:
+ * 		flags	listing flags (LIST_LONG)
+ * 		start	index of the first entry
+ * 		count	maximum number of entries (0 means all)
+ */
+void cli_listx(uint8_t flags, uint32_t start, uint32_t count)
+{
+    uint8_t request[sizeof(uint8_t) * 2 + sizeof(uint32_t) * 2];
+    uint64_t list_size;
+    uint32_t total, shown = 0;
+    char *buffer, *p;
+
+    /* build request */
+    request[0] = LISTX;
+    request[1] = flags;
+    memcpy(request + 2, &start, sizeof(start));
+    memcpy(request + 2 + sizeof(start), &count, sizeof(count));
+    rdt_send(request, sizeof(request));
+
+    /* read list size and number of entries */
+    if (recv_exact(&list_size, sizeof(list_size)) == -1
+        || recv_exact(&total, sizeof(total)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
+
+    buffer = malloc(list_size + 1);
+    if (!buffer)
+        handle_error("malloc()");
+
+    if (recv_buffer(buffer, list_size) == -1) {
+        puts(errno == ECONNRESET ? "The server closed the connection."
+             : "The file list arrived corrupted.");
+        free(buffer);
+        return;
+    }
+    buffer[list_size] = '\0';
+
+    for (p = buffer; (p = strchr(p, '\n')); p++)
+        shown++;
+
+    printf("\n%s", buffer);
+    if (shown)
+        printf("(%u-%u of %u)\n", start + 1, start + shown, total);
+    else
+        printf("(no entries, %u in total)\n", total);
+    free(buffer);
+}
+
+
+
 void cli_get(const char *filename)
 {
     uint64_t file_size;
     uint8_t code;
-    int fd;
+    int fd, err;
 
     size_t buf_size = sizeof(uint8_t) + strlen(filename) + sizeof(char);
     uint8_t buffer[buf_size];
@@ -70,28 +140,43 @@ void cli_get(const char *filename)
     /* send request */
     rdt_send(buffer, buf_size);
 
-    /* read response code */
-    rdt_recv(&code, sizeof(code));
-
-    /* check response code */
+    /* read response code and file size */
+    if (recv_exact(&code, sizeof(code)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
     if (code == GET_NOENT) {    // file not found
         printf("File \"%s\" does not exist.\n", filename);
         return;
     }
+    if (recv_exact(&file_size, sizeof(file_size)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
 
-    /* read file size */
-    rdt_recv(&file_size, sizeof(file_size));
-
-    /* open file */
-    if ((fd = open(filename, O_WRONLY | O_CREAT, 0644)) == -1)
+    /* open file, discarding any previous content */
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
         handle_error("open() - opening GET destination file");
 
     /* receive and store the file */
-    recv_file(fd, file_size);
+    err = recv_file(fd, file_size) == -1 ? errno : 0;
 
     /* close file */
     if (close(fd) == -1)
         handle_error("close() - closing GET destination file");
+
+    /* what arrived before a close is intact: RGET resumes it */
+    if (err == ECONNRESET)
+        printf("The server closed the connection: \"%s\" is partial.\n",
+               filename);
+
+    /* a damaged copy is not worth keeping (nor resuming) */
+    if (err == EBADMSG || err == ENOSPC) {
+        printf(err == EBADMSG ? "File \"%s\" arrived corrupted: removed.\n"
+               : "No room for \"%s\": not stored.\n", filename);
+        if (unlink(filename) == -1)
+            handle_error("unlink() - removing GET destination file");
+    }
 }
 
 
@@ -142,9 +227,438 @@ void cli_put(const char *filename)
         handle_error("close() - closing PUT file");
 
     /* receive and print operation outcome */
-    rdt_recv(&outcome, sizeof(outcome));
-    if (outcome == PUT_SUCCESS)
+    if (recv_exact(&outcome, sizeof(outcome)) == -1)
+        puts("The server closed the connection.");
+    else if (outcome == PUT_SUCCESS)
         puts("PUT operation succeed!\n");
     else
         puts("PUT operation failed.\n");
 }
+
+
+
+/*
+ * Function:	cli_rget
+ * ---------------------------------------------------------------
+ * Resume the download of a file, requesting to the server only the
+ * bytes after the end of the partial local copy, with the CRC-32C of
+ * the copy: the server refuses the resume if it is not a prefix.
+ * If the local file does not exist, the whole file is requested.
+ *
+ * Parameters:
+ * 		filename	the name of the file to download
+ */
+void cli_rget(const char *filename)
+{
+    struct stat st;
+    uint64_t offset, length, range_size;
+    uint32_t prefix = 0;
+    uint8_t code;
+    int fd, err;
+
+    size_t name_size = strlen(filename) + sizeof(char);
+    size_t buf_size = sizeof(uint8_t) + name_size + sizeof(offset)
+        + sizeof(length) + sizeof(prefix);
+    uint8_t buffer[buf_size];
+
+    /* resume from the size of the local copy */
+    errno = 0;
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            handle_error("open() - opening RGET destination file");
+        st.st_size = 0;
+    } else {
+        if (fstat(fd, &st) == -1)
+            handle_error("fstat() - getting RGET destination file stats");
+        prefix = htonl(prefix_crc(fd, st.st_size));
+        if (close(fd) == -1)
+            handle_error("close() - closing RGET destination file");
+    }
+    offset = st.st_size;
+    length = 0;                 // until the end of the file
+
+    /* build request */
+    buffer[0] = RGET;
+    memcpy(buffer + 1, filename, name_size);
+    memcpy(buffer + 1 + name_size, &offset, sizeof(offset));
+    memcpy(buffer + 1 + name_size + sizeof(offset), &length,
+           sizeof(length));
+    memcpy(buffer + 1 + name_size + sizeof(offset) + sizeof(length),
+           &prefix, sizeof(prefix));
+
+    /* send request */
+    rdt_send(buffer, buf_size);
+
+    /* read response code and the size that follows it */
+    if (recv_exact(&code, sizeof(code)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
+    if (code == GET_NOENT) {    // file not found
+        printf("File \"%s\" does not exist.\n", filename);
+        return;
+    }
+    if (recv_exact(&range_size, sizeof(range_size)) == -1) {
+        puts("The server closed the connection.");
+        return;
+    }
+    if (code == GET_RANGE) {    // the local copy is not a prefix
+        printf("Local copy of \"%s\" (%" PRIu64 " bytes) is not a prefix "
+               "of the remote file (%" PRIu64 " bytes): use GET to download "
+               "it again.\n", filename, offset, range_size);
+        return;
+    }
+
+    if (!range_size) {
+        printf("File \"%s\" has nothing left to download.\n", filename);
+        return;
+    }
+    printf("Resuming \"%s\" from byte %" PRIu64 "\n", filename, offset);
+
+    /* open file and move to the end of the partial copy */
+    if ((fd = open(filename, O_WRONLY | O_CREAT, 0644)) == -1)
+        handle_error("open() - opening RGET destination file");
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        handle_error("lseek() - seeking RGET destination file");
+
+    /* receive and store the rest of the file */
+    err = recv_file(fd, range_size) == -1 ? errno : 0;
+
+    /* close file */
+    if (close(fd) == -1)
+        handle_error("close() - closing RGET destination file");
+
+    if (err == ECONNRESET)
+        printf("The server closed the connection: \"%s\" is partial.\n",
+               filename);
+
+    if (err == ENOSPC)
+        printf("No room for the rest of \"%s\".\n", filename);
+
+    /* the bytes before the resume were complete: keep them */
+    if (err == EBADMSG) {
+        printf("File \"%s\" arrived corrupted: back to byte %" PRIu64
+               ".\n", filename, offset);
+        if (truncate(filename, offset) == -1)
+            handle_error("truncate() - dropping the damaged RGET part");
+    }
+}
+
+
+
+/*
+ * Function:	cli_rput
+ * ---------------------------------------------------------------
+ * Resume the upload of a file: the server replies with the size of
+ * its partial copy and its CRC-32C, and only the bytes after that
+ * offset are sent, if the copy is a prefix of the file.
+ *
+ * Parameters:
+ * 		filename	the name of the file to upload
+ */
+void cli_rput(const char *filename)
+{
+    struct stat st;
+    int fd;
+    uint8_t code, outcome;
+    uint64_t offset, length;
+    uint32_t prefix;
+
+    size_t name_size = strlen(filename) + sizeof(char);
+    size_t buf_size = sizeof(uint8_t) + name_size;
+    uint8_t buffer[buf_size];
+
+    /* open the file */
+    errno = 0;
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {  // The file does not exist
+            printf("The file \"%s\" does not exist\n", filename);
+            return;
+        } else
+            handle_error("open() - opening RPUT file");
+    }
+
+    /* get file size */
+    if (fstat(fd, &st) == -1)
+        handle_error("fstat() - getting RPUT file stats");
+
+    /* send request */
+    buffer[0] = RPUT;
+    memcpy(buffer + 1, filename, name_size);
+    rdt_send(buffer, buf_size);
+
+    /* read the size of the server's partial copy and its digest */
+    if (recv_exact(&code, sizeof(code)) == -1
+        || (code == PUT_RESUME
+            && (recv_exact(&offset, sizeof(offset)) == -1
+                || recv_exact(&prefix, sizeof(prefix)) == -1))) {
+        puts("The server closed the connection.");
+        if (close(fd) == -1)
+            handle_error("close() - closing RPUT file");
+        return;
+    }
+    if (code != PUT_RESUME) {
+        puts("RPUT operation failed.\n");
+        if (close(fd) == -1)
+            handle_error("close() - closing RPUT file");
+        return;
+    }
+
+    /* the remote copy is not a prefix of this file: give up */
+    if (offset > (uint64_t) st.st_size
+        || prefix_crc(fd, offset) != ntohl(prefix)) {
+        printf("Remote copy of \"%s\" (%" PRIu64 " bytes) is not a prefix "
+               "of the local one: use PUT to upload it again.\n", filename,
+               offset);
+        length = RPUT_ABORT;
+        rdt_send(&length, sizeof(length));
+        if (close(fd) == -1)
+            handle_error("close() - closing RPUT file");
+        if (recv_exact(&outcome, sizeof(outcome)) == -1)
+            puts("The server closed the connection.");
+        else
+            puts("RPUT operation failed.\n");
+        return;
+    }
+
+    /* send only the missing bytes */
+    length = st.st_size - offset;
+    printf("Resuming \"%s\" from byte %" PRIu64 "\n", filename, offset);
+
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        handle_error("lseek() - seeking RPUT file");
+    send_file(fd, &length, length, sizeof(length));
+    if (close(fd) == -1)
+        handle_error("close() - closing RPUT file");
+
+    /* receive and print operation outcome */
+    if (recv_exact(&outcome, sizeof(outcome)) == -1)
+        puts("The server closed the connection.");
+    else if (outcome == PUT_SUCCESS)
+        puts("RPUT operation succeed!\n");
+    else
+        puts("RPUT operation failed.\n");
+}
+
+
+
+/*
+ * Function:	send_literals
+ * ---------------------------------------------------------------
+ * Send a region of the local file that has no match on the server,
+ * split in DELTA_LITERAL operations of at most MAX_BUFSIZE bytes.
+ *
+ * Parameters:
+ * 		p		the address of the region
+ * 		len		the size of the region
+ */
+void send_literals(const uint8_t * p, size_t len)
+{
+    uint8_t buffer[sizeof(uint8_t) + sizeof(uint16_t) + MAX_BUFSIZE];
+    uint16_t n;
+
+    for (; len; p += n, len -= n) {
+        n = len < MAX_BUFSIZE ? len : MAX_BUFSIZE;
+        buffer[0] = DELTA_LITERAL;
+        memcpy(buffer + 1, &n, sizeof(n));
+        memcpy(buffer + 1 + sizeof(n), p, n);
+        rdt_send(buffer, 1 + sizeof(n) + n);
+    }
+}
+
+
+
+/*
+ * Function:	send_copy
+ * ---------------------------------------------------------------
+ * Send a DELTA_COPY operation referencing count consecutive
+ * blocks of the server's copy.
+ */
+void send_copy(uint64_t first, uint32_t count)
+{
+    uint8_t buffer[sizeof(uint8_t) + sizeof(first) + sizeof(count)];
+
+    buffer[0] = DELTA_COPY;
+    memcpy(buffer + 1, &first, sizeof(first));
+    memcpy(buffer + 1 + sizeof(first), &count, sizeof(count));
+    rdt_send(buffer, sizeof(buffer));
+}
+
+
+
+/*
+ * Function:	send_delta
+ * ---------------------------------------------------------------
+ * Scan the local file with the rolling checksum and send it as a
+ * list of literal regions and references to the blocks of the
+ * server's copy. Runs of consecutive blocks are sent as a single
+ * DELTA_COPY operation.
+ *
+ * Parameters:
+ * 		data		the content of the local file
+ * 		size		the size of the local file
+ * 		idx			the index of the server's block signatures
+ * 		block_size	the size of the server's blocks
+ *
+ * Returns:
+ * 		the number of bytes matched on the server
+ */
+uint64_t send_delta(const uint8_t * data, size_t size,
+                    struct sig_index *idx, size_t block_size)
+{
+    size_t pos = 0, literal = 0;
+    uint64_t matched = 0;
+    int64_t block, run_first = -1, hint = -1;
+    uint32_t weak = 0, run_len = 0;
+
+    if (idx->nblocks && size >= block_size)
+        weak = delta_weak(data, block_size);
+
+    while (idx->nblocks && pos + block_size <= size) {
+
+        block = sig_index_find(idx, weak, data + pos, block_size, hint);
+
+        if (block == -1) {
+            /* no match: slide one byte forward */
+            if (pos + block_size < size)
+                weak = delta_roll(weak, data[pos], data[pos + block_size],
+                                  block_size);
+            pos++;
+            continue;
+        }
+
+        /* flush the pending literals */
+        if (pos > literal) {
+            if (run_len)
+                send_copy(run_first, run_len);
+            run_len = 0;
+            send_literals(data + literal, pos - literal);
+        }
+
+        /* extend the current run or start a new one */
+        if (run_len && block == run_first + run_len)
+            run_len++;
+        else {
+            if (run_len)
+                send_copy(run_first, run_len);
+            run_first = block;
+            run_len = 1;
+        }
+
+        hint = block + 1;
+        matched += block_size;
+        pos += block_size;
+        literal = pos;
+        if (pos + block_size <= size)
+            weak = delta_weak(data + pos, block_size);
+    }
+
+    if (run_len)
+        send_copy(run_first, run_len);
+    send_literals(data + literal, size - literal);
+
+    return matched;
+}
+
+
+
+/*
+ * Function:	cli_dput
+ * ---------------------------------------------------------------
+ * Upload a file sending only the differences from the server's
+ * copy: the server sends the signatures of its copy's blocks, and
+ * the client replies with literal data and block references,
+ * followed by the digest of the whole file.
+ *
+ * Parameters:
+ * 		filename	the name of the file to upload
+ */
+void cli_dput(const char *filename)
+{
+    struct stat st;
+    struct sig_index idx;
+    struct block_sig *sigs = NULL;
+    uint8_t *data = NULL;
+    uint8_t outcome, end = DELTA_END;
+    uint32_t block_size, nblocks;
+    uint64_t file_size, digest, matched;
+    int fd;
+
+    size_t name_size = strlen(filename) + sizeof(char);
+    size_t buf_size = sizeof(uint8_t) + name_size;
+    uint8_t buffer[buf_size];
+
+    /* open and map the file */
+    errno = 0;
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {  // The file does not exist
+            printf("The file \"%s\" does not exist\n", filename);
+            return;
+        } else
+            handle_error("open() - opening DPUT file");
+    }
+    if (fstat(fd, &st) == -1)
+        handle_error("fstat() - getting DPUT file stats");
+    file_size = st.st_size;
+    if (file_size) {
+        data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            handle_error("mmap() - mapping DPUT file");
+    }
+
+    /* send request */
+    buffer[0] = DPUT;
+    memcpy(buffer + 1, filename, name_size);
+    rdt_send(buffer, buf_size);
+
+    /* receive the signatures of the server's copy */
+    if (recv_exact(&block_size, sizeof(block_size)) == -1
+        || recv_exact(&nblocks, sizeof(nblocks)) == -1)
+        goto closed;
+    if (block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK) {
+        errno = EPROTO;
+        handle_error("cli_dput() - invalid block size");
+    }
+
+    sigs = malloc(sizeof(struct block_sig) * (nblocks ? nblocks : 1));
+    if (!sigs)
+        handle_error("malloc() - allocating block signatures");
+    if (recv_exact(sigs, sizeof(struct block_sig) * nblocks) == -1)
+        goto closed;
+    if (sig_index_build(&idx, sigs, nblocks) == -1)
+        handle_error("sig_index_build()");
+
+    /* send the delta */
+    rdt_send(&file_size, sizeof(file_size));
+    matched = send_delta(data, file_size, &idx, block_size);
+    digest = delta_digest(data, file_size);
+    rdt_send(&end, sizeof(end));
+    rdt_send(&digest, sizeof(digest));
+
+    /* free resources */
+    sig_index_free(&idx);
+    if (data && munmap(data, file_size) == -1)
+        handle_error("munmap() - unmapping DPUT file");
+    if (close(fd) == -1)
+        handle_error("close() - closing DPUT file");
+
+    /* receive and print operation outcome */
+    if (recv_exact(&outcome, sizeof(outcome)) == -1)
+        puts("The server closed the connection.");
+    else if (outcome == PUT_SUCCESS)
+        printf("DPUT operation succeed! %" PRIu64 " of %" PRIu64
+               " bytes matched on the server\n\n", matched, file_size);
+    else
+        puts("DPUT operation failed.\n");
+    return;
+
+  closed:
+    puts("The server closed the connection.");
+    free(sigs);
+    if (data && munmap(data, file_size) == -1)
+        handle_error("munmap() - unmapping DPUT file");
+    if (close(fd) == -1)
+        handle_error("close() - closing DPUT file");
+}
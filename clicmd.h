@@ -1,9 +1,15 @@
 #ifndef _CLICMD_H
 #define _CLICMD_H
 
+#include <stdint.h>
+
 unsigned short get_cmdcode(const char *input);
 void cli_list(void);
+void cli_listx(uint8_t flags, uint32_t start, uint32_t count);
 void cli_get(const char *filename);
 void cli_put(const char *filename);
+void cli_rget(const char *filename);
+void cli_rput(const char *filename);
+void cli_dput(const char *filename);
 
 #endif /* _CLICMD_H */
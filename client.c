@@ -3,165 +3,304 @@
 #include "rw.h"
 #include "simul_udt.h"
 #include "transport.h"
+#include "dirlist.h"
+#include "cmd_commons.h"
+#include "handshake.h"
+
+
+#include "pool.h"
+
+#include <pthread.h>
 
 
 void client_job(void);
-void create_connection(int sockfd, struct sockaddr_in *addr);
+void *batch_worker(void *p);
+void run_command(char *line);
+int parse_list_args(const char *line, uint8_t * flags, uint32_t * start,
+                    uint32_t * count);
+
+
+/* batch mode: the commands read from stdin, shared by the workers */
+pthread_mutex_t input_mtx = PTHREAD_MUTEX_INITIALIZER;
+struct rdt_pool *pool;
 
 
 int main(int argc, char **argv)
 {
-    int sockfd;
+    int sockfd, opt;
+    unsigned int i, njobs = 0;
+    pthread_t workers[POOL_MAX];
     struct sockaddr_in servaddr;
 
 
     /* input check */
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server IP address>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            njobs = atoi(optarg);
+            if (njobs < 1 || njobs > POOL_MAX) {
+                fprintf(stderr, "-j: between 1 and %d\n", POOL_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            optind = argc;      // print the usage
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-j connections] <server IP address>\n"
+                "With -j the commands are read from stdin and run "
+                "concurrently\non up to that many connections.\n",
+                argv[0]);
         exit(EXIT_FAILURE);
     }
 
 
-    /* create socket */
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd == -1)
-        handle_error("socket()");
-
-
     /* set server address */
     memset((void *) &servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_port = htons(SERVER_PORT);
-    if (inet_aton(argv[1], &servaddr.sin_addr) == 0)
+    if (inet_aton(argv[optind], &servaddr.sin_addr) == 0)
         handle_error("inet_aton()");
 
 
-    /* try to connect */
+    /* batch mode: a pool of connections, one worker each */
+    if (njobs) {
+        cmd_hist_init();
+        pool = pool_create(&servaddr, njobs);
+        for (i = 0; i < njobs; i++)
+            if (pthread_create(&workers[i], NULL, batch_worker, NULL) != 0)
+                handle_error("pthread_create()");
+        for (i = 0; i < njobs; i++)
+            if (pthread_join(workers[i], NULL) != 0)
+                handle_error("pthread_join()");
+        pool_destroy(pool);
+        exit(EXIT_SUCCESS);
+    }
+
+
+    /* create socket */
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1)
+        handle_error("socket()");
+
+
+    /* try to connect (with cached parameters, along the first request) */
     puts("connecting...");
-    create_connection(sockfd, &servaddr);
+    if (!hs_connect(sockfd, &servaddr))
+        exit(EXIT_FAILURE);
+    cmd_hist_init();
+    progress_enable();
     puts("connected!");
 
 
     client_job();
 
 
-    /* NEVER REACHED */
+    /* end of the commands */
+    rdt_close();
     close(sockfd);
     exit(EXIT_SUCCESS);
 }
 
 
 
-void create_connection(int sockfd, struct sockaddr_in *addr)
+void client_job(void)
 {
-    socklen_t addrlen;
-    bool connected = false;
-    struct timeval timeout;
-    static struct proto_params params;
+    char line[MAXLINE];
 
-    addrlen = sizeof(struct sockaddr);
-
-    /* set receiving timeout on the socket */
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    if (setsockopt
-        (sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
-        handle_error("setting socket timeout");
+    for (;;) {
 
+        puts("enter a command \nLIST \nGET <filename> \nPUT <filename>"
+             "\nRGET <filename> (resume download)"
+             "\nRPUT <filename> (resume upload)"
+             "\nDPUT <filename> (delta upload)"
+             "\nLS [-l] [start [count]] (detailed, paged list)");
+        if (!fgets(line, MAXLINE, stdin)) {
+            if (feof(stdin))
+                return;
+            perror("fgets()");
+            continue;
+        }
 
-    while (!connected) {
+        run_command(line);
 
-        /* send SYN */
-        if (udt_sendto
-            (sockfd, NULL, 0, (struct sockaddr *) addr, addrlen,
-             0.3) == -1)
-            handle_error("udt_sendto() - sending SYN");
-        fputs("SYN sent, waiting for SYN ACK\n", stderr);
+        /* the server is gone (or the postponed setup failed) */
+        if (rdt_expired())
+            exit(EXIT_FAILURE);
+    }
+}
 
-        /* get SYN_ACK and server connection address */
-        errno = 0;
-        if (recvfrom
-            (sockfd, &params, sizeof(params), 0, (struct sockaddr *) addr,
-             &addrlen) == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                // timeout expired
-                continue;
-            handle_error("recvfrom()");
-        }
 
-        connected = true;
-    }
 
+/*
+ * Function:	batch_worker
+ * ------------------------------------------
+ * Run the commands read from stdin until its end, each one on a
+ * connection of the pool taken for the duration of the command. A
+ * command that finds no connection (the setup failed) is skipped.
+ */
+void *batch_worker(void *p)
+{
+    struct rdt_conn *conn;
+    char line[MAXLINE];
+    bool got;
 
-    /* turn timeout off */
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    if (setsockopt
-        (sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
-        handle_error("setting socket timeout");
+    (void) p;
 
-    /* set the endpoint */
-    if (connect(sockfd, (struct sockaddr *) addr, addrlen) == -1)
-        handle_error("connect()");
+    for (;;) {
 
-    /* initialize transport layer */
-    init_transport(sockfd, &params);
+        if (pthread_mutex_lock(&input_mtx) != 0)
+            handle_error("pthread_mutex_lock");
+        got = fgets(line, MAXLINE, stdin) != NULL;
+        if (pthread_mutex_unlock(&input_mtx) != 0)
+            handle_error("pthread_mutex_unlock");
+        if (!got)
+            return NULL;
+
+        if (line[strspn(line, " \n")] == 0)
+            continue;           // blank line
+
+        /* no connection: only this command fails */
+        if (!(conn = pool_acquire(pool))) {
+            line[strcspn(line, "\n")] = 0;
+            fprintf(stderr, "%s: not run, no connection\n", line);
+            continue;
+        }
+        run_command(line);
+        pool_release(pool, conn);
+    }
 }
 
 
 
-void client_job(void)
+/*
+ * Function:	run_command
+ * ------------------------------------------
+ * Run a command line on the connection of the calling thread.
+ */
+void run_command(char *line)
 {
     unsigned short cmd_code;
-    char line[MAXLINE], *filename, *cmd;
-
-    for (;;) {
+    char *filename = NULL, *cmd;
+    struct timespec t0;
+    uint32_t start, count;
+    uint8_t flags;
+
+    /* replace '\n' with '\0' */
+    line[strcspn(line, "\n")] = 0;
+
+    cmd = extract_cmd(line);
+    if (!cmd)
+        handle_error("parsing command from input");
+
+    cmd_code = get_cmdcode(cmd);
+    if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+        handle_error("clock_gettime()");
+    switch (cmd_code) {
+
+    case LIST:
+        //puts("LIST");
+        cli_list();
+        break;
+
+    case GET:
+        //puts("case GET");
+        filename = extract_filename(line);
+        if (!filename)
+            handle_error("parsing filename from input()");
+        //fprintf(stderr, "filename: \"%s\"\n", filename);
+        cli_get(filename);
+        break;
+
+    case PUT:
+        //puts("case PUT");
+        if ((filename = extract_filename(line)) == NULL)
+            handle_error("parsing filename from input()");
+        //fprintf(stderr, "filename: \"%s\"\n", filename);
+        cli_put(filename);
+        break;
+
+    case RGET:
+        if ((filename = extract_filename(line)) == NULL)
+            handle_error("parsing filename from input()");
+        cli_rget(filename);
+        break;
+
+    case RPUT:
+        if ((filename = extract_filename(line)) == NULL)
+            handle_error("parsing filename from input()");
+        cli_rput(filename);
+        break;
+
+    case DPUT:
+        if ((filename = extract_filename(line)) == NULL)
+            handle_error("parsing filename from input()");
+        cli_dput(filename);
+        break;
+
+    case LISTX:
+        if (parse_list_args(line, &flags, &start, &count) == -1) {
+            puts("Usage: ls [-l] [start [count]]");
+            break;
+        }
+        cli_listx(flags, start, count);
+        break;
 
-        filename = NULL;
+    default:
+        puts("Command not found.");
+    }
+    cmd_hist_record(cmd_code, &t0);
 
-        puts("enter a command \nLIST \nGET <filename> \nPUT <filename>");
-        if (!fgets(line, MAXLINE, stdin)) {
-            perror("fgets()");
-            continue;
-        }
+    free(filename);
+    free(cmd);
+}
 
-        /* replace '\n' with '\0' */
-        line[strcspn(line, "\n")] = 0;
 
-        cmd = extract_cmd(line);
-        if (!cmd)
-            handle_error("parsing command from input");
 
-        cmd_code = get_cmdcode(cmd);
-        switch (cmd_code) {
+/*
+ * Function:	parse_list_args
+ * ------------------------------------------
+ * Parse the arguments of the ls command: "-l" for the long format,
+ * then the index of the first entry and the number of entries.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on invalid arguments
+ */
+int parse_list_args(const char *line, uint8_t * flags, uint32_t * start,
+                    uint32_t * count)
+{
+    char *copy, *tok, *save, *end;
+    unsigned long v;
+    int n = 0, ret = 0;
 
-        case LIST:
-            //puts("LIST");
-            cli_list();
-            break;
+    *flags = 0;
+    *start = *count = 0;
 
-        case GET:
-            //puts("case GET");
-            filename = extract_filename(line);
-            if (!filename)
-                handle_error("parsing filename from input()");
-            //fprintf(stderr, "filename: \"%s\"\n", filename);
-            cli_get(filename);
-            break;
+    if (!(copy = strdup(line)))
+        handle_error("strdup()");
 
-        case PUT:
-            //puts("case PUT");
-            if ((filename = extract_filename(line)) == NULL)
-                handle_error("parsing filename from input()");
-            //fprintf(stderr, "filename: \"%s\"\n", filename);
-            cli_put(filename);
-            break;
+    strtok_r(copy, " ", &save);     // skip the command
+    while ((tok = strtok_r(NULL, " ", &save))) {
 
-        default:
-            puts("Command not found.");
+        if (strcmp(tok, "-l") == 0) {
+            *flags |= LIST_LONG;
+            continue;
         }
 
-        free(filename);
-        free(cmd);
+        errno = 0;
+        v = strtoul(tok, &end, 10);
+        if (errno || *end || v > UINT32_MAX || n == 2) {
+            ret = -1;
+            break;
+        }
+        if (n++ == 0)
+            *start = v;
+        else
+            *count = v;
     }
+
+    free(copy);
+    return ret;
 }
@@ -1,25 +1,501 @@
+#define _GNU_SOURCE             // fallocate
 #include "cmd_commons.h"
 #include "transport.h"
 #include "rw.h"
+#include "lz.h"
+#include "chunk_cache.h"
+#include "hist.h"
+#include "uring.h"
+#include "timespec_utils.h"
+#include "crc32c.h"
+
+#include <pthread.h>
+
+
+/* stop trying to compress a file after this many incompressible chunks */
+#define LZ_SKIP_LIMIT	8
+
+/* file I/O through io_uring: read ahead and write behind */
+#define FIO_CHUNK		(1024 * 1024)   // file bytes per request (aligned)
+#define FIO_DEPTH		2               // requests in flight
+
+#define PREALLOC_ENV	"RUDP_PREALLOC"         // "1": fallocate downloads
+#define PROGRESS_MS		200     // interval of the progress report
+
+
+/* header of a chunk of a compressed payload */
+struct chunk_header {
+    uint16_t raw_size;          // size of the chunk's data
+    uint16_t coded_size;        // size on the wire (= raw_size if stored)
+};
+
+_Static_assert(MAX_BUFSIZE <= UINT16_MAX,
+               "chunk sizes travel in 16 bits: MAX_BUFSIZE too large");
+
+
+
+/* completion time of the commands, by command code */
+struct hist cmd_hist[MAXCMD + 1];
+const char *cmd_hist_names[MAXCMD + 1] = {
+    "cmd_list", "cmd_get", "cmd_put", "cmd_rget", "cmd_rput", "cmd_dput",
+    "cmd_listx"
+};
+
+
 
 /*
- * Function:	send_file
+ * The io_uring of a thread, with the buffers of its requests (one
+ * chunk per slot, registered if RLIMIT_MEMLOCK allows): the file
+ * chunks are read or written while the network moves the others.
+ */
+struct file_ring {
+    struct uring ring;
+    uint8_t *bufs;              // FIO_DEPTH chunks
+    unsigned int len[FIO_DEPTH];        // size of the request of a slot
+    int res[FIO_DEPTH];         // its result
+    bool busy[FIO_DEPTH];       // in flight
+};
+
+/* the progress of a download, reported by a thread of its own */
+struct progress {
+    size_t done;                // updated with relaxed atomics
+    size_t size;
+    bool on;                    // reported (progress_enable)
+    bool stop;
+    pthread_mutex_t mtx;
+    pthread_cond_t cnd_stop;
+    pthread_t thread;
+};
+
+bool progress_on;               // report the progress of the downloads
+
+pthread_key_t fring_key;
+pthread_once_t fring_once = PTHREAD_ONCE_INIT;
+__thread struct file_ring *fring;
+__thread bool fring_failed;     // no io_uring: blocking I/O
+
+
+/* the data sent by send_file or send_buffer */
+struct file_source {
+    int fd;
+    const uint8_t *mem;         // in-memory payload (NULL for a file)
+    bool cached;                // read through the shared chunk cache
+    struct stat st;
+    off_t offset;
+    /* read ahead through the file ring */
+    struct file_ring *ring;
+    off_t next_read;            // next offset to request
+    off_t end;                  // end of the payload in the file
+    unsigned int head;          // slot being consumed
+    size_t pos;                 // bytes of it consumed
+    bool fill[FIO_DEPTH];       // slot read from the file: cache it
+};
+
+
+
+void fring_free(void *p)
+{
+    struct file_ring *f = p;
+
+    uring_exit(&f->ring);
+    free(f->bufs);
+    free(f);
+}
+
+
+
+void fring_key_init(void)
+{
+    if (pthread_key_create(&fring_key, fring_free) != 0)
+        handle_error("pthread_key_create()");
+}
+
+
+
+/*
+ * Function:	fring_get
+ * --------------------------------------------------
+ * Get the file ring of the calling thread, setting it up on
+ * first use.
+ *
+ * Returns:
+ * 		the ring, NULL if io_uring is not available or disabled
+ */
+struct file_ring *fring_get(void)
+{
+    struct file_ring *f;
+    struct iovec iov;
+
+    if (fring || fring_failed)
+        return fring;
+    fring_failed = true;
+
+    if (!uring_enabled())
+        return NULL;
+    pthread_once(&fring_once, fring_key_init);
+
+    if (!(f = calloc(1, sizeof(*f))))
+        handle_error("calloc() - fring_get");
+    if (posix_memalign((void **) &f->bufs, sysconf(_SC_PAGESIZE),
+                       FIO_DEPTH * FIO_CHUNK) != 0)
+        handle_error("posix_memalign() - fring_get");
+    if (uring_init(&f->ring, FIO_DEPTH) == -1) {
+        free(f->bufs);
+        free(f);
+        return NULL;
+    }
+
+    /* without pinned buffers the requests map them each time */
+    iov.iov_base = f->bufs;
+    iov.iov_len = FIO_DEPTH * FIO_CHUNK;
+    uring_register_buffers(&f->ring, &iov, 1);
+
+    if (pthread_setspecific(fring_key, f) != 0)
+        handle_error("pthread_setspecific()");
+    fring_failed = false;
+    return fring = f;
+}
+
+
+
+/*
+ * Function:	fring_submit
+ * --------------------------------------------------
+ * Start reading or writing a chunk of a file with the buffer
+ * of a free slot.
+ */
+void fring_submit(struct file_ring *f, uint8_t op, int fd,
+                  unsigned int slot, unsigned int len, off_t offset)
+{
+    f->len[slot] = len;
+    f->busy[slot] = true;
+    if (uring_prep_rw(&f->ring, op, fd, f->bufs + slot * FIO_CHUNK, len,
+                      offset, 0, slot) == -1
+        || uring_submit(&f->ring) == -1)
+        handle_error("io_uring - submitting file I/O");
+}
+
+
+
+/*
+ * Function:	fring_wait
+ * --------------------------------------------------
+ * Wait for the request of a slot to complete, which
+ * must have transferred the whole chunk.
+ */
+void fring_wait(struct file_ring *f, unsigned int slot)
+{
+    uint64_t done;
+    int res;
+
+    while (f->busy[slot]) {
+        if (uring_wait(&f->ring, &done, &res) == -1)
+            handle_error("io_uring - waiting for file I/O");
+        f->busy[done] = false;
+        f->res[done] = res;
+    }
+
+    if (f->res[slot] != (int) f->len[slot]) {
+        errno = f->res[slot] < 0 ? -f->res[slot] : EIO;
+        handle_error("io_uring - file I/O");
+    }
+}
+
+
+
+/*
+ * Function:	source_open
+ * --------------------------------------------------
+ * Prepare to read a file from its current position, through the
+ * chunk cache if the process has one.
+ */
+void source_open(struct file_source *src, int fd)
+{
+    src->fd = fd;
+    src->mem = NULL;
+    src->ring = NULL;
+    src->cached = cache_enabled() && fstat(fd, &src->st) == 0
+        && (src->offset = lseek(fd, 0, SEEK_CUR)) != -1;
+}
+
+
+
+/* the next request of a read ahead: up to a FIO_CHUNK boundary */
+unsigned int source_next_len(struct file_source *src)
+{
+    off_t len = FIO_CHUNK - src->next_read % FIO_CHUNK;
+
+    return src->end - src->next_read < len ? src->end - src->next_read
+        : len;
+}
+
+
+
+/*
+ * Function:	source_fetch
+ * --------------------------------------------------
+ * Request the next chunk of a read ahead into a slot: copied from
+ * the chunk cache if it holds all of it, read from the file
+ * otherwise (and then stored into the cache by source_peek).
+ */
+void source_fetch(struct file_source *src, unsigned int slot)
+{
+    struct file_ring *f = src->ring;
+    unsigned int len = source_next_len(src);
+
+    if (src->cached && cache_peek(&src->st, f->bufs + slot * FIO_CHUNK,
+                                  len, src->next_read) == 0) {
+        f->len[slot] = len;
+        f->res[slot] = len;
+        f->busy[slot] = false;
+        src->fill[slot] = false;
+    } else {
+        fring_submit(f, IORING_OP_READ, src->fd, slot, len,
+                     src->next_read);
+        src->fill[slot] = src->cached;
+    }
+    src->next_read += len;
+}
+
+
+
+/*
+ * Function:	source_read_ahead
+ * --------------------------------------------------
+ * Tell the kernel that the file is read sequentially, then read it
+ * through the ring of the thread, keeping FIO_DEPTH chunks of it
+ * in flight until size bytes are requested.
+ */
+void source_read_ahead(struct file_source *src, size_t size)
+{
+    unsigned int slot;
+
+    if (!size || (src->offset = lseek(src->fd, 0, SEEK_CUR)) == -1)
+        return;
+    posix_fadvise(src->fd, src->offset, size, POSIX_FADV_SEQUENTIAL);
+
+    if (!(src->ring = fring_get()))
+        return;
+
+    src->next_read = src->offset;
+    src->end = src->offset + size;
+    src->head = 0;
+    src->pos = 0;
+
+    for (slot = 0; slot < FIO_DEPTH && src->next_read < src->end; slot++)
+        source_fetch(src, slot);
+}
+
+
+
+/*
+ * Function:	source_peek
  * --------------------------------------------------
- * Send a message composed by a header and a file.
- * Split out the file in order to allocate only a restricted
- * amount of memory and send a chunk at time.
+ * Get the data of the chunk being consumed, waiting for it
+ * to be read.
+ *
+ * Returns:
+ * 		the number of bytes at *data
+ */
+size_t source_peek(struct file_source *src, const uint8_t **data)
+{
+    struct file_ring *f = src->ring;
+    unsigned int head = src->head;
+
+    fring_wait(f, head);
+    if (src->fill[head]) {
+        cache_fill(&src->st, f->bufs + head * FIO_CHUNK, f->len[head],
+                   src->offset - src->pos);
+        src->fill[head] = false;
+    }
+    *data = f->bufs + src->head * FIO_CHUNK + src->pos;
+
+    return f->len[src->head] - src->pos;
+}
+
+
+
+/* consume n bytes got with source_peek, asking for the next chunks */
+void source_consume(struct file_source *src, size_t n)
+{
+    struct file_ring *f = src->ring;
+    unsigned int head = src->head;
+
+    src->offset += n;
+    if ((src->pos += n) < f->len[head])
+        return;
+
+    /* chunk consumed: its slot reads the next one */
+    if (src->next_read < src->end)
+        source_fetch(src, head);
+    src->head = (head + 1) % FIO_DEPTH;
+    src->pos = 0;
+
+    /* leave the file where a blocking read would */
+    if (src->offset == src->end && lseek(src->fd, src->end, SEEK_SET) == -1)
+        handle_error("lseek() - reading file to send");
+}
+
+
+
+void source_read_ring(struct file_source *src, uint8_t *buf, size_t len)
+{
+    const uint8_t *data;
+    size_t n;
+
+    while (len) {
+        n = source_peek(src, &data);
+        if (n > len)
+            n = len;
+        memcpy(buf, data, n);
+        source_consume(src, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+
+
+void source_read(struct file_source *src, void *buf, size_t len)
+{
+    if (src->mem) {
+        memcpy(buf, src->mem + src->offset, len);
+        src->offset += len;
+        return;
+    }
+
+    if (src->ring) {
+        source_read_ring(src, buf, len);
+        return;
+    }
+
+    if (!src->cached) {
+        if (readn(src->fd, buf, len) == -1)
+            handle_error("readn() - reading file to send");
+        return;
+    }
+
+    if (cache_read(src->fd, &src->st, buf, len, src->offset) !=
+        (ssize_t) len)
+        handle_error("cache_read() - reading file to send");
+    src->offset += len;
+}
+
+
+
+/*
+ * Function:	send_source_lz
+ * --------------------------------------------------
+ * Send a message composed by a header and a payload, compressing the
+ * payload one chunk at time. Every chunk is preceded by a chunk_header
+ * and is sent stored when it is not compressible. After LZ_SKIP_LIMIT
+ * consecutive stored chunks the compression is skipped for the rest
+ * of the file (e.g. already compressed images).
+ * The message header is sent uncompressed with the first chunk.
  *
  * Parameters:
- * 		fd:				descriptor of the file to send
+ * 		src:			the payload to send
  * 		header:			address of the header buffer
- * 		file_size:		size of the file	
+ * 		file_size:		size of the payload
  * 		header_size:	size of the header
+ *
+ * Returns:
+ * 		the CRC-32C of the uncompressed payload
  */
-void send_file(int fd, void *header, size_t file_size, size_t header_size)
+uint32_t send_source_lz(struct file_source *src, void *header,
+                        size_t file_size, size_t header_size)
+{
+    uint8_t raw[MAX_BUFSIZE];
+    uint8_t buffer[MAX_BUFSIZE + MAX_BUFSIZE];
+    struct chunk_header ch;
+    size_t left = file_size, coded;
+    unsigned int stored = 0;
+    uint32_t crc = 0;
+
+    if (!file_size) {
+        rdt_send(header, header_size);
+        return crc;
+    }
+
+    memcpy(buffer, header, header_size);
+
+    while (left) {
+
+        ch.raw_size = left < MAX_BUFSIZE ? left : MAX_BUFSIZE;
+
+        source_read(src, raw, ch.raw_size);
+        crc = crc32c(crc, raw, ch.raw_size);
+
+        /* try to compress the chunk, it must save at least a byte */
+        coded = 0;
+        if (stored < LZ_SKIP_LIMIT)
+            coded = lz_compress(raw, ch.raw_size,
+                                buffer + header_size + sizeof(ch),
+                                ch.raw_size - 1);
+
+        if (coded) {
+            ch.coded_size = coded;
+            stored = 0;
+        } else {
+            ch.coded_size = ch.raw_size;
+            memcpy(buffer + header_size + sizeof(ch), raw, ch.raw_size);
+            stored++;
+        }
+
+        memcpy(buffer + header_size, &ch, sizeof(ch));
+        rdt_send(buffer, header_size + sizeof(ch) + ch.coded_size);
+
+        header_size = 0;        // consider header only at the first pass
+        left -= ch.raw_size;
+    }
+
+    return crc;
+}
+
+
+
+/*
+ * Function:	send_source
+ * --------------------------------------------------
+ * Send a message composed by a header and a payload.
+ * Split out the payload in order to allocate only a restricted
+ * amount of memory and send a chunk at time. The CRC-32C of the
+ * payload, computed along the way, follows it (see recv_digest).
+ *
+ * Parameters:
+ * 		src:			the payload to send
+ * 		header:			address of the header buffer
+ * 		file_size:		size of the payload
+ * 		header_size:	size of the header
+ */
+void send_source(struct file_source *src, void *header, size_t file_size,
+                 size_t header_size)
 {
     int8_t buffer[MAX_BUFSIZE];
     size_t buf_size, total_size;
     unsigned int i, n;
+    uint32_t crc = 0;
+
+    if (rdt_get_params()->compress) {
+        crc = send_source_lz(src, header, file_size, header_size);
+        goto digest;
+    }
+
+    /* read ahead: the chunks go to the transport without a copy */
+    if (src->ring) {
+        const uint8_t *data;
+        size_t left = file_size, len;
+
+        rdt_send(header, header_size);
+        while (left) {
+            len = source_peek(src, &data);
+            crc = crc32c(crc, data, len);
+            rdt_send(data, len);
+            source_consume(src, len);
+            left -= len;
+        }
+        goto digest;
+    }
 
     total_size = header_size + file_size;
     n = total_size / MAX_BUFSIZE;
@@ -31,50 +507,513 @@ void send_file(int fd, void *header, size_t file_size, size_t header_size)
         if (i == n) {           // calculate last bytes to send
             buf_size = total_size % MAX_BUFSIZE;
             if (!buf_size)
-                break;          // total size is a multiple of MAX_BUFSIZE: send only n-1 chunks 
+                break;          // total size is a multiple of MAX_BUFSIZE: send only n-1 chunks
         } else
             buf_size = MAX_BUFSIZE;
 
-        if (readn(fd, buffer + header_size, buf_size - header_size) == -1)
-            handle_error("readn() - reading file to send");
+        source_read(src, buffer + header_size, buf_size - header_size);
+        crc = crc32c(crc, buffer + header_size, buf_size - header_size);
 
         header_size = 0;        // consider header only at the first pass
 
         rdt_send(buffer, buf_size);
     }
+
+  digest:
+    crc = htonl(crc);
+    rdt_send(&crc, sizeof(crc));
 }
 
 
+
 /*
- * Function:	recv_file
+ * Function:	send_file
  * --------------------------------------------------
- * Store a received file one chunk at time in order to save memory.
+ * Send a message composed by a header and a file,
+ * read from its current position.
  *
  * Parameters:
  * 		fd:				descriptor of the file to send
- * 		file_size:		size of the file	
+ * 		header:			address of the header buffer
+ * 		file_size:		size of the file
+ * 		header_size:	size of the header
  */
-void recv_file(int fd, size_t size)
+void send_file(int fd, void *header, size_t file_size, size_t header_size)
 {
-    unsigned int i, n = size / MAX_BUFSIZE;
-    size_t buf_size;
-    int8_t buffer[MAX_BUFSIZE];
+    struct file_source src;
 
-    for (i = 0; i <= n; i++) {
+    source_open(&src, fd);
+    source_read_ahead(&src, file_size);
+    send_source(&src, header, file_size, header_size);
+}
+
+
+
+/*
+ * Function:	send_buffer
+ * --------------------------------------------------
+ * Send a message composed by a header and an in-memory payload,
+ * framed as send_file does (the peer reads it with recv_buffer).
+ *
+ * Parameters:
+ * 		buf:			address of the payload
+ * 		header:			address of the header buffer
+ * 		size:			size of the payload
+ * 		header_size:	size of the header
+ */
+void send_buffer(const void *buf, void *header, size_t size,
+                 size_t header_size)
+{
+    struct file_source src;
+
+    src.mem = buf;
+    src.ring = NULL;
+    src.offset = 0;
+    send_source(&src, header, size, header_size);
+}
 
-        if (i == n) {           // calculate last bytes to store 
-            buf_size = size % MAX_BUFSIZE;
-            if (!buf_size)
-                break;          // size is a multiple of MAX_BUFSIZE: receive only n-1 chunks
-        } else
-            buf_size = MAX_BUFSIZE;
 
-        rdt_recv(buffer, buf_size);
 
-        if (writen(fd, buffer, buf_size) == -1)
-            handle_error("writen() - writing received file");
-        printf("\rDownloading file: %u%%", i * 100 / n);
-        fflush(stdout);
+/*
+ * Function:	recv_exact
+ * --------------------------------------------------
+ * Receive a field of a fixed size: rdt_recv returns short only if
+ * the peer closed the connection, which fails the command.
+ *
+ * Parameters:
+ * 		buf:	the destination buffer
+ * 		len:	the size of the field
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the connection was closed first, with errno set
+ * 			to ECONNRESET
+ */
+int recv_exact(void *buf, size_t len)
+{
+    if (rdt_recv(buf, len) != len) {
+        errno = ECONNRESET;
+        return -1;
     }
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	recv_chunk
+ * --------------------------------------------------
+ * Receive the next chunk of a payload sent by send_file,
+ * decompressing it if the connection negotiated compression.
+ *
+ * Parameters:
+ * 		buf:	the destination buffer (at least MAX_BUFSIZE bytes)
+ * 		left:	the number of payload bytes still to receive
+ *
+ * Returns:
+ * 		the number of bytes stored into buf
+ * 		0	if the connection was closed first
+ */
+size_t recv_chunk(void *buf, size_t left)
+{
+    uint8_t coded[MAX_BUFSIZE];
+    struct chunk_header ch;
+
+    if (!rdt_get_params()->compress) {
+        ch.raw_size = left < MAX_BUFSIZE ? left : MAX_BUFSIZE;
+        return recv_exact(buf, ch.raw_size) ? 0 : ch.raw_size;
+    }
+
+    if (recv_exact(&ch, sizeof(ch)))
+        return 0;
+    if (ch.raw_size > left || ch.raw_size > MAX_BUFSIZE
+        || ch.coded_size > ch.raw_size) {
+        errno = EPROTO;
+        handle_error("recv_chunk() - invalid chunk header");
+    }
+
+    if (ch.coded_size == ch.raw_size)       // stored chunk
+        return recv_exact(buf, ch.raw_size) ? 0 : ch.raw_size;
+
+    if (recv_exact(coded, ch.coded_size))
+        return 0;
+    if (lz_decompress(coded, ch.coded_size, buf, ch.raw_size) !=
+        ch.raw_size) {
+        errno = EPROTO;
+        handle_error("lz_decompress() - invalid compressed chunk");
+    }
+
+    return ch.raw_size;
+}
+
+
+
+/*
+ * Function:	recv_digest
+ * --------------------------------------------------
+ * Receive the CRC-32C that follows a payload sent by send_file
+ * and compare it with the one of the data received.
+ *
+ * Parameters:
+ * 		crc:	the CRC-32C of the received payload
+ *
+ * Returns:
+ * 		0	if they match
+ * 		-1	otherwise, with errno set to EBADMSG (ECONNRESET if
+ * 			the connection was closed first)
+ */
+int recv_digest(uint32_t crc)
+{
+    uint32_t digest;
+
+    if (recv_exact(&digest, sizeof(digest)))
+        return -1;
+    if (ntohl(digest) != crc) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	recv_buffer
+ * --------------------------------------------------
+ * Store a payload sent by send_file into memory.
+ *
+ * Parameters:
+ * 		buf:	the destination buffer
+ * 		size:	the size of the payload
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the payload does not match its digest (errno set to
+ * 			EBADMSG) or the connection was closed (ECONNRESET)
+ */
+int recv_buffer(void *buf, size_t size)
+{
+    uint8_t chunk[MAX_BUFSIZE];
+    size_t n, done = 0;
+    uint32_t crc = 0;
+
+    while (done < size) {
+        if (!(n = recv_chunk(chunk, size - done))) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        crc = crc32c(crc, chunk, n);
+        memcpy((uint8_t *) buf + done, chunk, n);
+        done += n;
+    }
+
+    return recv_digest(crc);
+}
+
+
+
+void progress_print(struct progress *pr)
+{
+    size_t done = __atomic_load_n(&pr->done, __ATOMIC_RELAXED);
+
+    printf("\rDownloading file: %u%%",
+           (unsigned int) (pr->size ? done * 100 / pr->size : 100));
+    fflush(stdout);
+}
+
+
+
+/*
+ * Function:	progress_service
+ * --------------------------------------------------
+ * Print the progress of a download every PROGRESS_MS, so that
+ * the receiving loop never touches stdio.
+ *
+ * Parameters:
+ * 		p:		the progress
+ */
+void *progress_service(void *p)
+{
+    struct progress *pr = p;
+    struct timespec now, deadline, interval;
+    int ret;
+
+    nsectots(&interval, PROGRESS_MS * 1000000LL);
+
+    if (pthread_mutex_lock(&pr->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    while (!pr->stop) {
+        if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+            handle_error("clock_gettime()");
+        timespec_add(&deadline, &now, &interval);
+        ret = pthread_cond_timedwait(&pr->cnd_stop, &pr->mtx, &deadline);
+        if (ret == ETIMEDOUT)
+            progress_print(pr);
+        else if (ret != 0)
+            handle_error("pthread_cond_timedwait");
+    }
+
+    if (pthread_mutex_unlock(&pr->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    return NULL;
+}
+
+
+
+/*
+ * Function:	progress_enable
+ * --------------------------------------------------
+ * Report the progress of the downloads, if stdout is a terminal. Only
+ * a process running a transfer at a time calls it (not the server, nor
+ * a client with a pool), or the reports would interleave.
+ */
+void progress_enable(void)
+{
+    progress_on = isatty(STDOUT_FILENO);
+}
+
+
+
+void progress_start(struct progress *pr, size_t size)
+{
+    pr->done = 0;
+    pr->size = size;
+    pr->on = progress_on;
+    if (!pr->on)
+        return;
+    pr->stop = false;
+    if (pthread_mutex_init(&pr->mtx, NULL) != 0)
+        handle_error("pthread_mutex_init");
+    if (pthread_cond_init(&pr->cnd_stop, NULL) != 0)
+        handle_error("pthread_cond_init");
+    if (pthread_create(&pr->thread, NULL, progress_service, pr) != 0)
+        handle_error("pthread_create() - progress_service");
+}
+
+
+
+/* stop the reporter and print the final state */
+void progress_stop(struct progress *pr)
+{
+    if (!pr->on)
+        return;
+    if (pthread_mutex_lock(&pr->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    pr->stop = true;
+    if (pthread_cond_signal(&pr->cnd_stop) != 0)
+        handle_error("pthread_cond_signal");
+    if (pthread_mutex_unlock(&pr->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+    if (pthread_join(pr->thread, NULL) != 0)
+        handle_error("pthread_join() - progress_service");
+    pthread_cond_destroy(&pr->cnd_stop);
+    pthread_mutex_destroy(&pr->mtx);
+
+    if (pr->size)
+        progress_print(pr);
     printf("\n");
 }
+
+
+
+/*
+ * Function:	preallocate
+ * --------------------------------------------------
+ * Reserve the blocks of a download if RUDP_PREALLOC=1, so that the
+ * file is laid out contiguously and a full disk shows up before the
+ * transfer. The size of the file is left alone: a partial download
+ * must still be resumed from where it stopped. Best effort, but for
+ * a full disk.
+ *
+ * Returns:
+ * 		0	if reserved, not requested or not supported
+ * 		-1	if there is no room for the file (errno set to ENOSPC)
+ */
+int preallocate(int fd, off_t offset, size_t size)
+{
+    char *env = getenv(PREALLOC_ENV);
+
+    if (!env || strcmp(env, "1") != 0)
+        return 0;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size) == -1
+        && errno == ENOSPC)
+        return -1;
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	recv_file
+ * --------------------------------------------------
+ * Store a received file. The data is gathered in aligned writes of
+ * up to FIO_CHUNK bytes: through the ring of the thread they proceed
+ * while the next data arrives, otherwise they are blocking.
+ *
+ * Parameters:
+ * 		fd:				descriptor of the file to send
+ * 		file_size:		size of the file
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the file does not match its digest (it is stored
+ * 			anyway, errno set to EBADMSG), the connection was
+ * 			closed first (what arrived is stored, ECONNRESET) or
+ * 			there is no room for it (the data is received but
+ * 			nothing is stored, ENOSPC)
+ */
+int recv_file(int fd, size_t size)
+{
+    size_t n, done = 0, fill = 0, room;
+    struct file_ring *f = NULL;
+    struct progress pr;
+    unsigned int slot = 0, i;
+    bool compress = rdt_get_params()->compress, closed = false;
+    bool full = false;
+    uint8_t *buf = NULL;
+    uint32_t crc = 0;
+    off_t offset;
+
+    if (size && (offset = lseek(fd, 0, SEEK_CUR)) != -1) {
+        /* a full disk: drain the stream, keeping it in step */
+        full = preallocate(fd, offset, size) == -1;
+        if (!full)
+            f = fring_get();
+    } else
+        offset = 0;             // not seekable: no alignment
+    if (!f && !(buf = malloc(FIO_CHUNK)))
+        handle_error("malloc() - recv_file");
+
+    progress_start(&pr, size);
+
+    while (done < size) {
+
+        if (!fill && f) {
+            fring_wait(f, slot);
+            buf = f->bufs + slot * FIO_CHUNK;
+        }
+
+        /* receive up to a chunk boundary (whole frames if compressed) */
+        room = FIO_CHUNK - fill;
+        if (compress)
+            n = recv_chunk(buf + fill, size - done);
+        else {
+            room -= offset % FIO_CHUNK;
+            n = rdt_recv(buf + fill, room < size - done ? room
+                         : size - done);
+        }
+        closed = !n;
+        crc = crc32c(crc, buf + fill, n);
+        fill += n;
+        room -= n;
+        done += n;
+        __atomic_store_n(&pr.done, done, __ATOMIC_RELAXED);
+
+        if ((compress ? room < MAX_BUFSIZE : !room) || done == size
+            || (closed && fill)) {
+            if (f) {
+                fring_submit(f, IORING_OP_WRITE, fd, slot, fill, offset);
+                slot = (slot + 1) % FIO_DEPTH;
+            } else if (!full && writen(fd, buf, fill) == -1)
+                handle_error("writen() - writing received file");
+            offset += fill;
+            fill = 0;
+        }
+        if (closed)
+            break;
+    }
+
+    if (f) {
+        for (i = 0; i < FIO_DEPTH; i++)
+            if (f->busy[i])
+                fring_wait(f, i);
+        if (lseek(fd, offset, SEEK_SET) == -1)
+            handle_error("lseek() - writing received file");
+    } else
+        free(buf);
+
+    progress_stop(&pr);
+
+    if (closed) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (recv_digest(crc) == -1)
+        return -1;
+    if (full) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/*
+ * Function:	prefix_crc
+ * --------------------------------------------------
+ * The CRC-32C of the first len bytes of a file, to check that a
+ * copy being resumed is a prefix of the other end's file.
+ *
+ * Parameters:
+ * 		fd:		the file, left at its position
+ * 		len:	the number of bytes (at most the file size)
+ *
+ * Returns:
+ * 		the CRC-32C (0 for no bytes)
+ */
+uint32_t prefix_crc(int fd, uint64_t len)
+{
+    uint8_t buf[16 * MAX_BUFSIZE];
+    uint64_t off = 0;
+    uint32_t crc = 0;
+    ssize_t n;
+
+    while (off < len) {
+        n = preadn(fd, buf, len - off < sizeof(buf) ? len - off
+                   : sizeof(buf), off);
+        if (n == -1)
+            handle_error("preadn() - reading the prefix to resume");
+        if (!n)
+            break;
+        crc = crc32c(crc, buf, n);
+        off += n;
+    }
+
+    return crc;
+}
+
+
+
+void cmd_hist_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i <= MAXCMD; i++)
+        hist_register(cmd_hist_names[i], cmd_hist + i);
+}
+
+
+
+/*
+ * Function:	cmd_hist_record
+ * --------------------------------------------------
+ * Record the completion time of a command.
+ *
+ * Parameters:
+ * 		cmd		the command code (unknown codes are ignored)
+ * 		t0		start time of the command (CLOCK_MONOTONIC)
+ */
+void cmd_hist_record(unsigned int cmd, struct timespec *t0)
+{
+    if (cmd <= MAXCMD)
+        hist_record_since(cmd_hist + cmd, t0);
+}
@@ -3,9 +3,19 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 void send_file(int fd, void *header, size_t file_size, size_t header_size);
-void recv_file(int fd, size_t size);
+void send_buffer(const void *buf, void *header, size_t size,
+                 size_t header_size);
+int recv_exact(void *buf, size_t len);
+int recv_file(int fd, size_t size);
+int recv_buffer(void *buf, size_t size);
+uint32_t prefix_crc(int fd, uint64_t len);
+void progress_enable(void);
+void cmd_hist_init(void);
+void cmd_hist_record(unsigned int cmd, struct timespec *t0);
 
 
 #endif /* _CMD_COMMONS_H */
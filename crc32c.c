@@ -0,0 +1,138 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define CRC32C_POLY		0x82f63b78      // reflected
+
+
+uint32_t crc32c_table[8][256];
+bool crc32c_hw;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * Function:	crc32c_init
+ * --------------------------------------------------
+ * Fill the tables of the software version and check
+ * whether the CPU computes the checksum itself.
+ */
+void crc32c_init(void)
+{
+    uint32_t crc;
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8)
+                ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+
+
+/*
+ * Function:	crc32c_sw
+ * --------------------------------------------------
+ * Slicing-by-8: one lookup in each table per byte of
+ * a word, the eight of them independent of each other.
+ */
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t word;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff]
+            ^ crc32c_table[6][(word >> 8) & 0xff]
+            ^ crc32c_table[5][(word >> 16) & 0xff]
+            ^ crc32c_table[4][(word >> 24) & 0xff]
+            ^ crc32c_table[3][(word >> 32) & 0xff]
+            ^ crc32c_table[2][(word >> 40) & 0xff]
+            ^ crc32c_table[1][(word >> 48) & 0xff]
+            ^ crc32c_table[0][word >> 56];
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+
+
+#if defined(__x86_64__)
+/*
+ * Function:	crc32c_sse42
+ * --------------------------------------------------
+ * The crc32 instruction, eight bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t word, crc64;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+
+    crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = crc64;
+
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+
+    return crc;
+}
+#endif
+
+
+
+/*
+ * Function:	crc32c
+ * --------------------------------------------------
+ * Parameters:
+ * 		crc		the checksum of the data before buf (0 at the start)
+ * 		buf		the data
+ * 		len		its size
+ *
+ * Returns:
+ * 		the checksum of the data up to the end of buf
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw)
+        return ~crc32c_sse42(crc, buf, len);
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
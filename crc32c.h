@@ -0,0 +1,21 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * CRC-32C (Castagnoli), the checksum of iSCSI and SCTP: computed with
+ * the crc32 instruction of SSE4.2 where the CPU has it, eight bytes
+ * at a time from tables otherwise. Start from 0 and feed the data in
+ * as many pieces as needed:
+ *
+ * 		crc = crc32c(0, a, na);
+ * 		crc = crc32c(crc, b, nb);
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+
+#endif /* _CRC32C_H */
@@ -0,0 +1,274 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define PRIME1	0x9E3779B185EBCA87ULL
+#define PRIME2	0xC2B2AE3D27D4EB4FULL
+#define PRIME3	0x165667B19E3779F9ULL
+#define PRIME4	0x85EBCA77C2B2AE63ULL
+
+
+
+/*
+ * Function:	delta_block_size
+ * --------------------------------------------------
+ * Choose the signature block size of a file: the square root of
+ * its size (as rsync does), rounded to a multiple of 64 bytes and
+ * clamped to [DELTA_MIN_BLOCK, DELTA_MAX_BLOCK].
+ *
+ * Parameters:
+ * 		file_size	the size of the file
+ *
+ * Returns:
+ * 		the block size
+ */
+size_t delta_block_size(uint64_t file_size)
+{
+    size_t size;
+
+    for (size = DELTA_MIN_BLOCK;
+         size < DELTA_MAX_BLOCK && (uint64_t) size * size < file_size;
+         size += 64);
+
+    return size;
+}
+
+
+
+/*
+ * Function:	delta_weak
+ * --------------------------------------------------
+ * Calculate the rolling checksum of a block:
+ * a = sum(x[i]), b = sum((len - i) * x[i]), both modulo 2^16.
+ *
+ * Returns:
+ * 		the checksum (b << 16 | a)
+ */
+uint32_t delta_weak(const uint8_t * p, size_t len)
+{
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += (len - i) * p[i];
+    }
+
+    return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+
+
+/*
+ * Function:	delta_roll
+ * --------------------------------------------------
+ * Slide the rolling checksum of a block one byte forward.
+ *
+ * Parameters:
+ * 		weak	the checksum of the current block
+ * 		out		the first byte of the current block
+ * 		in		the byte following the current block
+ * 		len		the size of the block
+ *
+ * Returns:
+ * 		the checksum of the next block
+ */
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len)
+{
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - len * out + a) & 0xffff;
+
+    return b << 16 | a;
+}
+
+
+
+uint64_t rotl64(uint64_t x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+
+/*
+ * Function:	delta_strong
+ * --------------------------------------------------
+ * Calculate a 64 bit hash of a block (XXH64 single lane).
+ * It is not a cryptographic hash: the whole file digest
+ * checked at the end of a delta transfer catches collisions.
+ *
+ * Parameters:
+ * 		p		the address of the block
+ * 		len		the size of the block
+ * 		seed	the initial value (to chain several blocks)
+ *
+ * Returns:
+ * 		the hash value
+ */
+uint64_t delta_strong(const uint8_t * p, size_t len, uint64_t seed)
+{
+    uint64_t h = seed + PRIME3 + len, w;
+    const uint8_t *end = p + len;
+
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&w, p, sizeof(w));
+        h ^= rotl64(w * PRIME2, 31) * PRIME1;
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+    }
+
+    for (; p < end; p++) {
+        h ^= *p * PRIME3;
+        h = rotl64(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+
+/*
+ * Function:	delta_digest
+ * --------------------------------------------------
+ * Calculate the digest of a whole file, chaining the hashes of
+ * its DELTA_DIGEST_CHUNK sized pieces.
+ *
+ * Parameters:
+ * 		p		the address of the file content
+ * 		len		the size of the file
+ *
+ * Returns:
+ * 		the digest
+ */
+uint64_t delta_digest(const uint8_t * p, size_t len)
+{
+    uint64_t digest = 0;
+    size_t n;
+
+    for (; len; p += n, len -= n) {
+        n = len < DELTA_DIGEST_CHUNK ? len : DELTA_DIGEST_CHUNK;
+        digest = delta_strong(p, n, digest);
+    }
+
+    return digest;
+}
+
+
+
+unsigned int sig_bucket(struct sig_index *idx, uint32_t weak)
+{
+    return (weak * 2654435761u) >> (32 - idx->bits);
+}
+
+
+
+/*
+ * Function:	sig_index_build
+ * --------------------------------------------------
+ * Build a chained hash table of the block signatures keyed by
+ * their rolling checksum.
+ *
+ * Parameters:
+ * 		idx		the index to build
+ * 		sigs	the signatures (owned by the index from now on)
+ * 		nblocks	the number of signatures
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on allocation error
+ */
+int sig_index_build(struct sig_index *idx, struct block_sig *sigs,
+                    uint32_t nblocks)
+{
+    uint32_t i;
+    unsigned int b;
+
+    idx->sigs = sigs;
+    idx->nblocks = nblocks;
+
+    for (idx->bits = 4; (1u << idx->bits) < 2 * nblocks
+         && idx->bits < 24; idx->bits++);
+
+    idx->heads = malloc(sizeof(int32_t) << idx->bits);
+    idx->next = malloc(sizeof(int32_t) * (nblocks ? nblocks : 1));
+    if (!idx->heads || !idx->next)
+        return -1;
+
+    memset(idx->heads, -1, sizeof(int32_t) << idx->bits);
+
+    /* insert in reverse order: chains list lower indexes first */
+    for (i = nblocks; i-- > 0;) {
+        b = sig_bucket(idx, sigs[i].weak);
+        idx->next[i] = idx->heads[b];
+        idx->heads[b] = i;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	sig_index_find
+ * --------------------------------------------------
+ * Look for a block of the remote file matching the local block.
+ * The hint block (usually the one following the last match) is
+ * tried first, so that unchanged regions keep consecutive indexes.
+ *
+ * Parameters:
+ * 		idx		the signatures index
+ * 		weak	the rolling checksum of the local block
+ * 		block	the address of the local block
+ * 		len		the block size
+ * 		hint	the preferred block index (or -1)
+ *
+ * Returns:
+ * 		the index of the matching block,
+ * 		-1 if there is no match
+ */
+int64_t sig_index_find(struct sig_index *idx, uint32_t weak,
+                       const uint8_t * block, size_t len, int64_t hint)
+{
+    uint64_t strong = 0;
+    bool strong_done = false;
+    int32_t i;
+
+    if (hint >= 0 && hint < idx->nblocks && idx->sigs[hint].weak == weak) {
+        strong = delta_strong(block, len, 0);
+        strong_done = true;
+        if (idx->sigs[hint].strong == strong)
+            return hint;
+    }
+
+    for (i = idx->heads[sig_bucket(idx, weak)]; i != -1;
+         i = idx->next[i]) {
+        if (idx->sigs[i].weak != weak)
+            continue;
+        if (!strong_done) {
+            strong = delta_strong(block, len, 0);
+            strong_done = true;
+        }
+        if (idx->sigs[i].strong == strong)
+            return i;
+    }
+
+    return -1;
+}
+
+
+
+void sig_index_free(struct sig_index *idx)
+{
+    free(idx->sigs);
+    free(idx->heads);
+    free(idx->next);
+}
@@ -0,0 +1,44 @@
+#ifndef _DELTA_H
+#define _DELTA_H
+
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define DELTA_MIN_BLOCK		1024
+#define DELTA_MAX_BLOCK		(64 * 1024)
+#define DELTA_DIGEST_CHUNK	(64 * 1024)
+
+// delta operations
+#define DELTA_END		0
+#define DELTA_LITERAL	1
+#define DELTA_COPY		2
+
+
+struct block_sig {
+	uint32_t weak;
+	uint64_t strong;
+};
+
+struct sig_index {
+	struct block_sig *sigs;
+	uint32_t nblocks;
+	int32_t *heads;
+	int32_t *next;
+	unsigned int bits;
+};
+
+
+size_t delta_block_size(uint64_t file_size);
+uint32_t delta_weak(const uint8_t *p, size_t len);
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len);
+uint64_t delta_strong(const uint8_t *p, size_t len, uint64_t seed);
+uint64_t delta_digest(const uint8_t *p, size_t len);
+int sig_index_build(struct sig_index *idx, struct block_sig *sigs,
+                    uint32_t nblocks);
+int64_t sig_index_find(struct sig_index *idx, uint32_t weak,
+                       const uint8_t *block, size_t len, int64_t hint);
+void sig_index_free(struct sig_index *idx);
+
+
+#endif /* _DELTA_H */
@@ -0,0 +1,269 @@
+#include "dirlist.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIR_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+					| IN_CLOSE_WRITE | IN_ATTRIB | IN_MODIFY)
+
+
+
+/*
+ * Function:	dir_snapshot_init
+ * --------------------------------------------------
+ * Initialize an empty snapshot of a directory and start watching
+ * the directory, so that the snapshot is rebuilt only after a change.
+ * Without inotify the snapshot is rebuilt at every update.
+ *
+ * Parameters:
+ * 		snap	the snapshot
+ * 		path	the directory
+ */
+void dir_snapshot_init(struct dir_snapshot *snap, const char *path)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->path = path;
+
+    snap->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (snap->ifd != -1 && inotify_add_watch(snap->ifd, path, DIR_EVENTS)
+        == -1) {
+        close(snap->ifd);
+        snap->ifd = -1;
+    }
+}
+
+
+
+void dir_snapshot_clear(struct dir_snapshot *snap)
+{
+    size_t i;
+
+    for (i = 0; i < snap->count; i++)
+        free(snap->entries[i].name);
+    free(snap->entries);
+
+    snap->entries = NULL;
+    snap->count = 0;
+    snap->valid = false;
+    snap->have_stat = false;
+}
+
+
+
+/*
+ * Function:	dir_changed
+ * --------------------------------------------------
+ * Drain the pending inotify events of the directory.
+ *
+ * Returns:
+ * 		true	if the directory changed (or it is not watched)
+ * 		false	otherwise
+ */
+bool dir_changed(struct dir_snapshot *snap)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t r;
+
+    if (snap->ifd == -1)
+        return true;
+
+    while ((r = read(snap->ifd, buf, sizeof(buf))) > 0)
+        changed = true;
+
+    if (r == -1 && errno != EAGAIN && errno != EINTR)
+        return true;
+
+    return changed;
+}
+
+
+
+int dir_entry_cmp(const void *x, const void *y)
+{
+    const struct dir_entry *a = x, *b = y;
+
+    return strcmp(a->name, b->name);
+}
+
+
+
+/*
+ * Function:	dir_snapshot_read
+ * --------------------------------------------------
+ * Read the names of the visible entries of the directory,
+ * sorted like ls does.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error
+ */
+int dir_snapshot_read(struct dir_snapshot *snap)
+{
+    struct dir_entry *tmp;
+    struct dirent *de;
+    size_t cap = 0;
+    DIR *dir;
+
+    if (!(dir = opendir(snap->path)))
+        return -1;
+
+    errno = 0;
+    while ((de = readdir(dir))) {
+
+        if (de->d_name[0] == '.')       // hidden, as ls does
+            continue;
+
+        if (snap->count == cap) {
+            cap = cap ? 2 * cap : 64;
+            tmp = realloc(snap->entries, cap * sizeof(*tmp));
+            if (!tmp)
+                goto fail;
+            snap->entries = tmp;
+        }
+
+        tmp = snap->entries + snap->count;
+        if (!(tmp->name = strdup(de->d_name)))
+            goto fail;
+        snap->count++;
+    }
+    if (errno)
+        goto fail;
+
+    closedir(dir);
+    qsort(snap->entries, snap->count, sizeof(*snap->entries),
+          dir_entry_cmp);
+    snap->valid = true;
+    return 0;
+
+  fail:
+    closedir(dir);
+    dir_snapshot_clear(snap);
+    return -1;
+}
+
+
+
+/*
+ * Function:	dir_snapshot_stat
+ * --------------------------------------------------
+ * Fill in size and modification time of the entries.
+ * An entry removed meanwhile is reported with zero values.
+ */
+int dir_snapshot_stat(struct dir_snapshot *snap)
+{
+    struct stat st;
+    size_t i;
+    int dfd;
+
+    if ((dfd = open(snap->path, O_RDONLY | O_DIRECTORY)) == -1)
+        return -1;
+
+    for (i = 0; i < snap->count; i++) {
+        if (fstatat(dfd, snap->entries[i].name, &st, 0) == -1) {
+            snap->entries[i].size = 0;
+            snap->entries[i].mtime = 0;
+            continue;
+        }
+        snap->entries[i].size = st.st_size;
+        snap->entries[i].mtime = st.st_mtime;
+    }
+
+    close(dfd);
+    snap->have_stat = true;
+    return 0;
+}
+
+
+
+/*
+ * Function:	dir_snapshot_update
+ * --------------------------------------------------
+ * Bring the snapshot up to date, rebuilding it only if the
+ * directory changed since the last update.
+ *
+ * Parameters:
+ * 		snap		the snapshot
+ * 		need_stat	true to get the size and mtime of the entries too
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error
+ */
+int dir_snapshot_update(struct dir_snapshot *snap, bool need_stat)
+{
+    if (dir_changed(snap) || !snap->valid) {
+        dir_snapshot_clear(snap);
+        if (dir_snapshot_read(snap) == -1)
+            return -1;
+    }
+
+    if (need_stat && !snap->have_stat)
+        return dir_snapshot_stat(snap);
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	dir_format
+ * --------------------------------------------------
+ * Print a page of the snapshot, one entry per line.
+ * In long format every line is "size YYYY-MM-DD HH:MM name".
+ *
+ * Parameters:
+ * 		snap	the snapshot
+ * 		start	index of the first entry
+ * 		count	maximum number of entries (0 means all)
+ * 		flags	listing flags
+ * 		len		where to store the length of the text
+ *
+ * Returns:
+ * 		the text (to be freed by the caller),
+ * 		NULL on allocation error
+ */
+char *dir_format(struct dir_snapshot *snap, size_t start, size_t count,
+                 uint8_t flags, size_t *len)
+{
+    char *text, *p;
+    size_t i, end, size = 1;
+    struct tm tm;
+
+    if (start > snap->count)
+        start = snap->count;
+    end = snap->count;
+    if (count && count < end - start)
+        end = start + count;
+
+    /* calculate the text size */
+    for (i = start; i < end; i++)
+        size += strlen(snap->entries[i].name) + 1;
+    if (flags & LIST_LONG)
+        size += (end - start) * (20 + 1 + 16 + 1);
+
+    if (!(text = malloc(size)))
+        return NULL;
+
+    for (p = text, i = start; i < end; i++) {
+        if (flags & LIST_LONG) {
+            localtime_r(&snap->entries[i].mtime, &tm);
+            p += sprintf(p, "%20" PRIu64 " ", snap->entries[i].size);
+            p += strftime(p, 17, "%Y-%m-%d %H:%M", &tm);
+            *p++ = ' ';
+        }
+        p += sprintf(p, "%s\n", snap->entries[i].name);
+    }
+
+    *len = p - text;
+    return text;
+}
@@ -0,0 +1,36 @@
+#ifndef _DIRLIST_H
+#define _DIRLIST_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// listing flags
+#define LIST_LONG	0x01        // size and modification time
+
+
+struct dir_entry {
+	char *name;
+	uint64_t size;
+	time_t mtime;
+};
+
+struct dir_snapshot {
+	const char *path;
+	struct dir_entry *entries;
+	size_t count;
+	bool valid;
+	bool have_stat;             // entries' size and mtime are set
+	int ifd;                    // inotify descriptor (-1 if unavailable)
+};
+
+
+void dir_snapshot_init(struct dir_snapshot *snap, const char *path);
+int dir_snapshot_update(struct dir_snapshot *snap, bool need_stat);
+char *dir_format(struct dir_snapshot *snap, size_t start, size_t count,
+                 uint8_t flags, size_t *len);
+
+
+#endif /* _DIRLIST_H */
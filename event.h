@@ -8,6 +8,7 @@
 #define NO_EVENT	0
 #define PKT_EVENT	1
 #define ACK_EVENT	2
+#define CLOSE_EVENT	3
 
 
 struct event {
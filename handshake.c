@@ -0,0 +1,1100 @@
+#include "handshake.h"
+#include "simul_udt.h"
+#include "netem.h"
+#include "timespec_utils.h"
+#include "siphash.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define HS_RECENT		4096        // remembered connection requests
+#define HS_RECENT_SEC	30
+
+
+/* cursor over a handshake datagram */
+struct hs_buf {
+    uint8_t *p;
+    uint8_t *end;
+    bool err;                   // overflow (writing) or truncated (reading)
+};
+
+
+/* client: a connection being set up */
+struct hs_client {
+    int sockfd;
+    struct sockaddr_in addr;
+    struct proto_params params; // cached configuration
+    bool cached;
+};
+
+/* server: the SYN_ACK to repeat until the client answers */
+uint8_t hs_reply[HS_HEADER_SIZE + 2 + HS_MAX_OPTIONS];
+size_t hs_reply_len;
+double hs_loss;
+int hs_connsd;
+struct rdt_conn *hs_conn;
+struct sockaddr_in hs_cliaddr;
+bool hs_verified;               // the client proved its address: repeat
+
+/*
+ * server: recent connection requests, to drop retransmitted SYNs,
+ * in a table indexed by a keyed hash of the client's address
+ */
+struct {
+    struct sockaddr_in addr;
+    uint32_t nonce;
+    time_t time;
+    bool verified;              // came with a cookie: its SYN_ACK is repeated
+} hs_recent[HS_RECENT];
+
+/* server: the key of the cookies and of the table, and when to ask */
+uint8_t hs_secret[SIPHASH_KEY];
+unsigned long hs_cookie_load;
+pthread_once_t hs_secret_once = PTHREAD_ONCE_INIT;
+
+
+
+bool same_params(struct proto_params *a, struct proto_params *b)
+{
+    return a->T == b->T && a->P == b->P && a->N == b->N
+        && a->adaptive == b->adaptive && a->compress == b->compress
+        && a->mss == b->mss;
+}
+
+
+
+/* the capabilities of this end */
+void local_caps(struct hs_caps *caps)
+{
+    caps->max_window = MAXSEQNUM / 2;   // selective repeat limit
+    caps->buffer = CBUF_SIZE;
+    caps->mss = MSS_MAX;        // the path MTU decides the actual size
+    caps->features = FEAT_SUPPORTED;
+    /* AES-GCM is offered only where it is the faster cipher */
+    if (aead_psk())
+        caps->features |= FEAT_AEAD_CHACHA
+            | (aead_hw_aes() ? FEAT_AEAD_GCM : 0);
+}
+
+
+
+void put_bytes(struct hs_buf *b, const void *v, size_t len)
+{
+    if (b->err || (size_t) (b->end - b->p) < len) {
+        b->err = true;
+        return;
+    }
+    memcpy(b->p, v, len);
+    b->p += len;
+}
+
+
+
+void put_u8(struct hs_buf *b, uint8_t v)
+{
+    put_bytes(b, &v, 1);
+}
+
+
+
+void put_u16(struct hs_buf *b, uint16_t v)
+{
+    v = htons(v);
+    put_bytes(b, &v, 2);
+}
+
+
+
+void put_u32(struct hs_buf *b, uint32_t v)
+{
+    v = htonl(v);
+    put_bytes(b, &v, 4);
+}
+
+
+
+void get_bytes(struct hs_buf *b, void *v, size_t len)
+{
+    if (b->err || (size_t) (b->end - b->p) < len) {
+        b->err = true;
+        memset(v, 0, len);
+        return;
+    }
+    memcpy(v, b->p, len);
+    b->p += len;
+}
+
+
+
+uint8_t get_u8(struct hs_buf *b)
+{
+    uint8_t v;
+
+    get_bytes(b, &v, 1);
+    return v;
+}
+
+
+
+uint16_t get_u16(struct hs_buf *b)
+{
+    uint16_t v;
+
+    get_bytes(b, &v, 2);
+    return ntohs(v);
+}
+
+
+
+uint32_t get_u32(struct hs_buf *b)
+{
+    uint32_t v;
+
+    get_bytes(b, &v, 4);
+    return ntohl(v);
+}
+
+
+
+/*
+ * Function:	put_message
+ * --------------------------------------------------
+ * Encode a handshake message: header, capabilities, configuration
+ * (if any) and, for a SYN, the early data. A retry carries no
+ * capabilities, only its cookie.
+ *
+ * Returns:
+ * 		the size of the datagram
+ */
+size_t put_message(uint8_t * buf, size_t size, struct hs_msg *m,
+                   bool syn)
+{
+    struct hs_buf b = { buf, buf + size, false };
+    uint8_t *optlen;
+    uint32_t features;
+
+    put_u32(&b, HS_MAGIC);
+    put_u8(&b, m->version);
+    put_u8(&b, m->flags);
+    put_u32(&b, m->nonce);
+
+    optlen = b.p;
+    put_u16(&b, 0);             // filled below
+
+    if (!(m->flags & HS_RETRY)) {
+        put_u8(&b, CAP_MAX_WINDOW);
+        put_u8(&b, 2);
+        put_u16(&b, m->caps.max_window);
+        put_u8(&b, CAP_BUFFER);
+        put_u8(&b, 4);
+        put_u32(&b, m->caps.buffer);
+        put_u8(&b, CAP_MSS);
+        put_u8(&b, 2);
+        put_u16(&b, m->caps.mss);
+        put_u8(&b, CAP_FEATURES);
+        put_u8(&b, 4);
+        put_u32(&b, m->caps.features);
+    }
+
+    if (m->has_random) {
+        put_u8(&b, CAP_RANDOM);
+        put_u8(&b, AEAD_RANDOM);
+        put_bytes(&b, m->random, AEAD_RANDOM);
+    }
+    if (m->has_auth) {
+        put_u8(&b, CAP_AUTH);
+        put_u8(&b, AEAD_AUTH);
+        put_bytes(&b, m->auth, AEAD_AUTH);
+    }
+    if (m->has_cookie) {
+        put_u8(&b, CAP_COOKIE);
+        put_u8(&b, HS_COOKIE_SIZE);
+        put_bytes(&b, m->cookie, HS_COOKIE_SIZE);
+    }
+
+    if (m->has_cfg) {
+        features = (m->cfg.adaptive ? FEAT_ADAPTIVE : 0)
+            | (m->cfg.compress ? FEAT_COMPRESS : 0)
+            | (m->cfg.aead == AEAD_AES_GCM ? FEAT_AEAD_GCM : 0)
+            | (m->cfg.aead == AEAD_CHACHA ? FEAT_AEAD_CHACHA : 0);
+        put_u8(&b, CFG_WINDOW);
+        put_u8(&b, 2);
+        put_u16(&b, m->cfg.N);
+        put_u8(&b, CFG_TIMEOUT);
+        put_u8(&b, 2);
+        put_u16(&b, m->cfg.T);
+        put_u8(&b, CFG_LOSS);
+        put_u8(&b, 1);
+        put_u8(&b, m->cfg.P);
+        put_u8(&b, CFG_FEATURES);
+        put_u8(&b, 4);
+        put_u32(&b, features);
+        put_u8(&b, CFG_MSS);
+        put_u8(&b, 2);
+        put_u16(&b, m->cfg.mss);
+        if (m->cfg.cid) {
+            put_u8(&b, CFG_CID);
+            put_u8(&b, 4);
+            put_u32(&b, m->cfg.cid);
+        }
+    }
+
+    if (!b.err) {
+        optlen[0] = (b.p - optlen - 2) >> 8;
+        optlen[1] = (b.p - optlen - 2) & 0xff;
+    }
+
+    if (syn) {
+        put_u16(&b, m->early_len);
+        put_bytes(&b, m->early, m->early_len);
+    }
+
+    if (b.err)
+        handle_error("put_message() - handshake message too long");
+    return b.p - buf;
+}
+
+
+
+/*
+ * Function:	get_message
+ * --------------------------------------------------
+ * Decode a handshake message. Missing capabilities take
+ * the most conservative values.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the datagram is not a handshake message
+ * 			of a version spoken here
+ */
+int get_message(const void *buf, size_t len, struct hs_msg *m, bool syn)
+{
+    struct hs_buf b = { (uint8_t *) buf, (uint8_t *) buf + len, false };
+    struct hs_buf opts;
+    uint8_t type, olen;
+    uint32_t features = 0;
+    uint16_t n;
+
+    if (get_u32(&b) != HS_MAGIC)
+        return -1;
+    m->version = get_u8(&b);
+    m->flags = get_u8(&b);
+    m->nonce = get_u32(&b);
+    if (b.err || m->version < HS_MIN_VERSION)
+        return -1;
+
+    m->caps.max_window = 1;
+    m->caps.buffer = 0;
+    m->caps.mss = 0;
+    m->caps.features = 0;
+    m->has_cfg = false;
+    memset(&m->cfg, 0, sizeof(m->cfg));
+    m->has_random = false;
+    m->has_auth = false;
+    m->has_cookie = false;
+
+    n = get_u16(&b);
+    if (b.err || (size_t) (b.end - b.p) < n)
+        return -1;
+    opts.p = b.p;
+    opts.end = b.p + n;
+    opts.err = false;
+    b.p += n;
+
+    while (opts.p < opts.end) {
+        type = get_u8(&opts);
+        olen = get_u8(&opts);
+        if (opts.err || opts.end - opts.p < olen)
+            return -1;
+
+        switch (type) {
+        case CAP_MAX_WINDOW:
+            m->caps.max_window = get_u16(&opts);
+            break;
+        case CAP_BUFFER:
+            m->caps.buffer = get_u32(&opts);
+            break;
+        case CAP_MSS:
+            m->caps.mss = get_u16(&opts);
+            break;
+        case CAP_FEATURES:
+            m->caps.features = get_u32(&opts);
+            break;
+        case CAP_RANDOM:
+            if (olen != AEAD_RANDOM)
+                return -1;
+            get_bytes(&opts, m->random, AEAD_RANDOM);
+            m->has_random = true;
+            break;
+        case CAP_AUTH:
+            if (olen != AEAD_AUTH)
+                return -1;
+            get_bytes(&opts, m->auth, AEAD_AUTH);
+            m->has_auth = true;
+            break;
+        case CAP_COOKIE:
+            if (olen != HS_COOKIE_SIZE)
+                return -1;
+            get_bytes(&opts, m->cookie, HS_COOKIE_SIZE);
+            m->has_cookie = true;
+            break;
+        case CFG_WINDOW:
+            m->cfg.N = get_u16(&opts);
+            m->has_cfg = true;
+            break;
+        case CFG_TIMEOUT:
+            m->cfg.T = get_u16(&opts);
+            break;
+        case CFG_LOSS:
+            m->cfg.P = get_u8(&opts);
+            break;
+        case CFG_FEATURES:
+            features = get_u32(&opts);
+            break;
+        case CFG_MSS:
+            m->cfg.mss = get_u16(&opts);
+            break;
+        case CFG_CID:
+            m->cfg.cid = get_u32(&opts);
+            break;
+        default:               // unknown option
+            opts.p += olen;
+            continue;
+        }
+        if (opts.err)
+            return -1;
+    }
+    m->cfg.adaptive = !!(features & FEAT_ADAPTIVE);
+    m->cfg.compress = !!(features & FEAT_COMPRESS);
+    m->cfg.aead = features & FEAT_AEAD_GCM ? AEAD_AES_GCM
+        : features & FEAT_AEAD_CHACHA ? AEAD_CHACHA : AEAD_NONE;
+
+    if (!syn) {
+        m->early_len = 0;
+        return 0;
+    }
+
+    m->early_len = get_u16(&b);
+    if (b.err || m->early_len > MSS)
+        return -1;
+    get_bytes(&b, m->early, m->early_len);
+
+    return b.err || b.p != b.end ? -1 : 0;
+}
+
+
+
+/*
+ * Function:	hs_negotiate
+ * --------------------------------------------------
+ * Agree on the configuration of a connection: the server's settings,
+ * restricted to what the client can do. A server with a pre-shared
+ * key seals the segments, with AES-GCM if both ends run it in
+ * hardware, with ChaCha20-Poly1305 otherwise.
+ *
+ * Parameters:
+ * 		server	the settings of the server
+ * 		peer	the capabilities of the client
+ * 		agreed	where to store the configuration
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the ends cannot talk
+ */
+int hs_negotiate(struct proto_params *server, struct hs_caps *peer,
+                 struct proto_params *agreed)
+{
+    struct hs_caps mine;
+
+    local_caps(&mine);
+
+    *agreed = *server;
+    if (!agreed->mss || agreed->mss > mine.mss)
+        agreed->mss = mine.mss;
+    if (agreed->mss > peer->mss)
+        agreed->mss = peer->mss;
+    if (agreed->mss < MSS_MIN)
+        return -1;
+
+    if (agreed->N > peer->max_window)
+        agreed->N = peer->max_window;
+    if (agreed->N > mine.max_window)
+        agreed->N = mine.max_window;
+    if (!agreed->N)
+        return -1;
+
+    agreed->adaptive = server->adaptive && (peer->features & FEAT_ADAPTIVE);
+    agreed->compress = server->compress && (peer->features & FEAT_COMPRESS);
+
+    agreed->aead = AEAD_NONE;
+    if (mine.features & peer->features & FEAT_AEAD_GCM)
+        agreed->aead = AEAD_AES_GCM;
+    else if (mine.features & peer->features & FEAT_AEAD_CHACHA)
+        agreed->aead = AEAD_CHACHA;
+    else if (aead_psk())
+        return -1;
+
+    return 0;
+}
+
+
+
+/* true if the datagram is the SYN_ACK of the connection (a late one) */
+bool hs_is_synack(const void *buf, size_t len, uint32_t cid)
+{
+    struct hs_msg m;
+
+    return get_message(buf, len, &m, false) == 0
+        && !(m.flags & HS_RETRY) && m.has_cfg && m.cfg.cid == cid;
+}
+
+
+
+/*
+ * Function:	cache_path
+ * --------------------------------------------------
+ * The file of the cached parameters: $RUDP_PARAMS_CACHE or
+ * ~/.rudp_params.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if there is no place for the cache
+ */
+int cache_path(char *path, size_t size)
+{
+    char *env = getenv(HS_CACHE_ENV), *home;
+
+    if (env && *env)
+        return snprintf(path, size, "%s", env) < (int) size ? 0 : -1;
+
+    if (!(home = getenv("HOME")) || !*home)
+        return -1;
+    return snprintf(path, size, "%s/%s", home, HS_CACHE_FILE) <
+        (int) size ? 0 : -1;
+}
+
+
+
+void cache_key(struct sockaddr_in *addr, char *key, size_t size)
+{
+    snprintf(key, size, "%s:%u", inet_ntoa(addr->sin_addr),
+             ntohs(addr->sin_port));
+}
+
+
+
+/*
+ * Function:	cache_lookup
+ * --------------------------------------------------
+ * Read the parameters of the last connection to a server.
+ * The cache holds a line "<ip>:<port> N T P adaptive compress mss"
+ * for every server (mss is missing in older caches).
+ *
+ * Returns:
+ * 		true	if the server is in the cache
+ * 		false	otherwise
+ */
+bool cache_lookup(struct sockaddr_in *addr, struct proto_params *params)
+{
+    char path[PATH_MAX], key[32], line[MAXLINE], name[64];
+    unsigned int N, T, P, a, z, mss;
+    bool found = false;
+    FILE *f;
+
+    if (cache_path(path, sizeof(path)) == -1 || !(f = fopen(path, "r")))
+        return false;
+
+    cache_key(addr, key, sizeof(key));
+    while (!found && fgets(line, sizeof(line), f)) {
+        mss = MSS;
+        if (sscanf(line, "%63s %u %u %u %u %u %u", name, &N, &T, &P, &a,
+                   &z, &mss) >= 6 && strcmp(name, key) == 0 && N >= 1
+            && N <= 128 && T <= UINT16_MAX && P <= 100 && mss >= MSS_MIN
+            && mss <= MSS_MAX) {
+            params->N = N;
+            params->T = T;
+            params->P = P;
+            params->adaptive = !!a;
+            params->compress = !!z;
+            params->mss = mss;
+            params->aead = AEAD_NONE;   // agreed anew at every connection
+            params->cid = 0;
+            found = true;
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
+
+
+/*
+ * Function:	cache_store
+ * --------------------------------------------------
+ * Save the parameters of a server, replacing its old line.
+ * The cache is rewritten aside and renamed, so that concurrent
+ * clients never read a partial file. Errors are not fatal.
+ */
+void cache_store(struct sockaddr_in *addr, struct proto_params *params)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 16], key[32], line[MAXLINE];
+    FILE *in, *out;
+    size_t klen;
+
+    if (cache_path(path, sizeof(path)) == -1)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    if (!(out = fopen(tmp, "w")))
+        return;
+
+    cache_key(addr, key, sizeof(key));
+    klen = strlen(key);
+    if ((in = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), in))
+            if (strncmp(line, key, klen) != 0 || line[klen] != ' ')
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %u %u %u %u %u %u\n", key, params->N, params->T,
+            params->P, params->adaptive, params->compress, params->mss);
+
+    if (fclose(out) != 0 || rename(tmp, path) == -1)
+        unlink(tmp);
+}
+
+
+
+/*
+ * Function:	hs_setup
+ * --------------------------------------------------
+ * Send the SYN, carrying the capabilities of the client and the early
+ * data if any, until the SYN_ACK arrives, then start the transport with
+ * the agreed configuration. If the server did not accept the early data
+ * (configuration not cached or stale), it is sent again on the stream.
+ * With a pre-shared key the early data always waits for the keys and
+ * the server must prove that it knows the key.
+ *
+ * Parameters:
+ * 		p		the connection being set up (struct hs_client), freed
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the server did not answer or was refused (reported)
+ */
+int hs_setup(void *p)
+{
+    struct hs_client *hs = p;
+    struct proto_params params;
+    struct hs_msg syn, synack;
+    struct aead_keys keys;
+    uint8_t dgram[HS_MAX_SYN];
+    struct sockaddr_in from;
+    struct timeval tv;
+    const void *early;
+    socklen_t fromlen;
+    size_t len, size;
+    long long ms = HS_SYN_TIMEOUT;
+    double loss;
+    int tries;
+    ssize_t r;
+    bool psk = aead_psk(), retry;
+
+    early = rdt_early_data(&len);
+
+    syn.version = HS_VERSION;
+    syn.flags = (hs->cached ? HS_CACHED : 0) | (len && !psk ? HS_EARLY : 0);
+    if (getrandom(&syn.nonce, sizeof(syn.nonce), 0) !=
+        (ssize_t) sizeof(syn.nonce))
+        handle_error("getrandom() - connection request nonce");
+    local_caps(&syn.caps);
+    syn.has_cfg = hs->cached;
+    syn.cfg = hs->params;
+    syn.has_random = syn.has_auth = psk;
+    if (psk) {
+        aead_random(syn.random, AEAD_RANDOM);
+        aead_auth("rudp client", syn.random, NULL, syn.nonce, syn.auth);
+    }
+    syn.has_cookie = false;
+    syn.early_len = psk ? 0 : len;
+    if (syn.early_len)
+        memcpy(syn.early, early, len);
+
+    /* the loss of the server is known only from the cache */
+    loss = hs->cached ? hs->params.P / 100.0 : 0;
+
+    for (tries = 0;; tries++) {
+
+        if (tries == HS_SYN_RETRIES) {
+            fputs("The server is not responding\n", stderr);
+            free(hs);
+            return -1;
+        }
+
+        /* encoded again: the buffer receives the replies */
+        size = put_message(dgram, sizeof(dgram), &syn, true);
+        if (udt_sendto(hs->sockfd, dgram, size,
+                       (struct sockaddr *) &hs->addr, sizeof(hs->addr),
+                       loss) == -1)
+            handle_error("udt_sendto() - sending SYN");
+        fputs("SYN sent, waiting for SYN ACK\n", stderr);
+
+        tv.tv_sec = ms / 1000;
+        tv.tv_usec = ms % 1000 * 1000;
+        if (setsockopt(hs->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))
+            == -1)
+            handle_error("setting socket timeout");
+
+        /*
+         * skip stray datagrams (e.g. a response overtaking the SYN_ACK);
+         * a busy server answers with a cookie, to be sent back at once
+         */
+        retry = false;
+        while (!retry) {
+            fromlen = sizeof(from);
+            r = recvfrom(hs->sockfd, dgram, sizeof(dgram), 0,
+                         (struct sockaddr *) &from, &fromlen);
+            if (r == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                handle_error("recvfrom()");
+            }
+            if (get_message(dgram, r, &synack, false) == 0
+                && synack.version <= HS_VERSION
+                && synack.nonce == syn.nonce) {
+                if (!(synack.flags & HS_RETRY))
+                    goto connected;
+                if (synack.has_cookie) {
+                    memcpy(syn.cookie, synack.cookie, HS_COOKIE_SIZE);
+                    syn.has_cookie = retry = true;
+                }
+            }
+        }
+
+        if (!retry)
+            ms *= 2;
+    }
+
+  connected:
+    /* the agreed configuration must be within reach */
+    if (!synack.has_cfg || !synack.cfg.cid
+        || !synack.cfg.N || synack.cfg.N > MAXSEQNUM / 2
+        || synack.cfg.mss < MSS_MIN || synack.cfg.mss > MSS_MAX
+        || (synack.cfg.adaptive && !(FEAT_SUPPORTED & FEAT_ADAPTIVE))
+        || (synack.cfg.compress && !(FEAT_SUPPORTED & FEAT_COMPRESS))) {
+        fputs("The server proposed an unsupported configuration\n",
+              stderr);
+        free(hs);
+        return -1;
+    }
+
+    /* with a pre-shared key the server must seal and know the key */
+    if (psk != (synack.cfg.aead != AEAD_NONE)) {
+        fputs(psk ? "The server has no pre-shared key (RUDP_PSK)\n"
+              : "The server requires a pre-shared key (RUDP_PSK)\n",
+              stderr);
+        free(hs);
+        return -1;
+    }
+    if (psk) {
+        if (!synack.has_random || !synack.has_auth
+            || !aead_auth_ok("rudp server", syn.random, synack.random,
+                             syn.nonce, synack.auth)) {
+            fputs("The server failed to authenticate\n", stderr);
+            free(hs);
+            return -1;
+        }
+        aead_derive(syn.random, synack.random, true, &keys);
+    }
+
+    /* turn timeout off */
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (setsockopt(hs->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ==
+        -1)
+        handle_error("setting socket timeout");
+
+    /* the connection continues with the server's process */
+    if (connect(hs->sockfd, (struct sockaddr *) &from, sizeof(from)) == -1)
+        handle_error("connect()");
+
+    params = synack.cfg;
+    if (!hs->cached || !same_params(&params, &hs->params))
+        cache_store(&hs->addr, &params);
+
+    init_transport(hs->sockfd, NULL, &params, psk ? &keys : NULL);
+    rdt_confirm();
+    free(hs);
+
+    if (len && !(synack.flags & HS_EARLY_OK))
+        rdt_send(early, len);
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	hs_connect
+ * --------------------------------------------------
+ * Connect to a server. If the configuration agreed with it last time
+ * is cached the setup is postponed until the first request, which
+ * travels in the SYN and is served without waiting for a round trip
+ * (0-RTT), and a failed setup shows up as an expired connection.
+ * Otherwise the SYN is sent now.
+ *
+ * Parameters:
+ * 		sockfd	the (unconnected) socket
+ * 		addr	the server's address
+ *
+ * Returns:
+ * 		the connection, now the one of the calling thread
+ * 		NULL if the server did not answer or was refused (reported)
+ */
+struct rdt_conn *hs_connect(int sockfd, struct sockaddr_in *addr)
+{
+    struct hs_client *hs;
+
+    if (!(hs = malloc(sizeof(*hs))))
+        handle_error("malloc() - hs_connect");
+    hs->sockfd = sockfd;
+    hs->addr = *addr;
+    hs->cached = cache_lookup(addr, &hs->params);
+
+    if (hs->cached)
+        rdt_defer_connect(hs_setup, hs);
+    else if (hs_setup(hs) == -1)
+        return NULL;
+
+    return rdt_current();
+}
+
+
+
+/*
+ * Function:	hs_secret_init
+ * --------------------------------------------------
+ * Draw the key of the server's cookies, valid until it exits,
+ * and read from RUDP_SYN_COOKIES when to ask for them.
+ */
+void hs_secret_init(void)
+{
+    char *env = getenv(HS_COOKIE_ENV), *end;
+
+    if (getrandom(hs_secret, sizeof(hs_secret), 0) !=
+        (ssize_t) sizeof(hs_secret))
+        handle_error("getrandom() - cookie key");
+
+    hs_cookie_load = HS_COOKIE_LOAD;
+    if (env && *env) {
+        errno = 0;
+        hs_cookie_load = strtoul(env, &end, 10);
+        if (errno || *end) {
+            fprintf(stderr, "%s: invalid number '%s'\n", HS_COOKIE_ENV,
+                    env);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+
+/*
+ * Function:	make_cookie
+ * --------------------------------------------------
+ * The cookie of a connection request: the time it was made and a
+ * MAC of it, of the address of the client and of the nonce. Only
+ * who receives at that address can send it back.
+ */
+void make_cookie(struct sockaddr_in *from, uint32_t nonce, uint32_t t,
+                 uint8_t *cookie)
+{
+    uint8_t in[sizeof(from->sin_addr.s_addr) + sizeof(from->sin_port)
+               + sizeof(nonce) + sizeof(t)], *p = in;
+    uint64_t mac;
+
+    t = htonl(t);
+    memcpy(p, &from->sin_addr.s_addr, sizeof(from->sin_addr.s_addr));
+    p += sizeof(from->sin_addr.s_addr);
+    memcpy(p, &from->sin_port, sizeof(from->sin_port));
+    p += sizeof(from->sin_port);
+    memcpy(p, &nonce, sizeof(nonce));
+    p += sizeof(nonce);
+    memcpy(p, &t, sizeof(t));
+
+    mac = siphash24(hs_secret, in, sizeof(in));
+    memcpy(cookie, &t, sizeof(t));
+    memcpy(cookie + sizeof(t), &mac, sizeof(mac));
+}
+
+
+
+/* true if the request carries a cookie made here, not expired */
+bool cookie_ok(struct hs_msg *syn, struct sockaddr_in *from, time_t now)
+{
+    uint8_t expected[HS_COOKIE_SIZE], diff = 0;
+    uint32_t t;
+    unsigned int i;
+
+    if (!syn->has_cookie)
+        return false;
+    memcpy(&t, syn->cookie, sizeof(t));
+    t = ntohl(t);
+    if ((uint32_t) now - t > HS_COOKIE_SEC)
+        return false;
+
+    make_cookie(from, syn->nonce, t, expected);
+    for (i = 0; i < HS_COOKIE_SIZE; i++)
+        diff |= expected[i] ^ syn->cookie[i];
+
+    return !diff;
+}
+
+
+
+/*
+ * Function:	send_cookie
+ * --------------------------------------------------
+ * Answer a connection request with a cookie, from the listening
+ * socket and keeping nothing: the client will ask again with it.
+ * The answer holds only the cookie, and a request shorter than it
+ * (a client sends its capabilities) is not answered: spoofing one
+ * buys no amplification.
+ *
+ * Parameters:
+ * 		listensd	the listening socket
+ * 		syn			the request
+ * 		len			its size
+ * 		from		its sender
+ * 		now			the time of the cookie
+ */
+void send_cookie(int listensd, struct hs_msg *syn, size_t len,
+                 struct sockaddr_in *from, time_t now)
+{
+    uint8_t dgram[HS_HEADER_SIZE + 2 + HS_MAX_OPTIONS];
+    struct hs_msg reply;
+    size_t size;
+
+    reply.version = syn->version < HS_VERSION ? syn->version : HS_VERSION;
+    reply.flags = HS_RETRY;
+    reply.nonce = syn->nonce;
+    reply.has_cfg = reply.has_random = reply.has_auth = false;
+    reply.has_cookie = true;
+    make_cookie(from, syn->nonce, now, reply.cookie);
+    reply.early_len = 0;
+    size = put_message(dgram, sizeof(dgram), &reply, false);
+    if (size > len)
+        return;
+
+    /* not fatal: the client asks again */
+    sendto(listensd, dgram, size, 0, (struct sockaddr *) from,
+           sizeof(*from));
+}
+
+
+
+/*
+ * Function:	hs_parse_syn
+ * --------------------------------------------------
+ * Decode a connection request received by the server and
+ * drop the retransmissions of the recent ones. When many
+ * connections are alive (RUDP_SYN_COOKIES, 0 for always) a new
+ * request must prove the address of the client first: it is
+ * answered with a cookie and accepted when it comes back with it,
+ * so that spoofed requests cost the server no process. With a
+ * pre-shared key a request that does not prove to know it is
+ * dropped here as well, before it costs a process. Only the
+ * SYN_ACK of a proved address is repeated: the retransmission of
+ * another request is answered with a cookie, as its SYN_ACK may
+ * have been lost.
+ *
+ * Parameters:
+ * 		listensd	the listening socket
+ * 		syn			where to store the request
+ * 		buf			the datagram
+ * 		len			its size
+ * 		from		the sender
+ * 		live		the connections alive
+ *
+ * Returns:
+ * 		0	if it is a new connection request
+ * 		-1	otherwise
+ */
+int hs_parse_syn(int listensd, struct hs_msg *syn, const void *buf,
+                 size_t len, struct sockaddr_in *from, unsigned int live)
+{
+    time_t now = time(NULL);
+    unsigned int i;
+    bool verified, retransmitted = false;
+
+    pthread_once(&hs_secret_once, hs_secret_init);
+
+    if (get_message(buf, len, syn, true) == -1)
+        return -1;
+
+    if (aead_psk()
+        && (!syn->has_random || !syn->has_auth
+            || !aead_auth_ok("rudp client", syn->random, NULL, syn->nonce,
+                             syn->auth))) {
+        fputs("Authentication failed, request dropped\n", stderr);
+        return -1;
+    }
+
+    verified = cookie_ok(syn, from, now);
+    i = siphash24(hs_secret, from, sizeof(*from)) % HS_RECENT;
+    if (hs_recent[i].nonce == syn->nonce
+        && hs_recent[i].addr.sin_addr.s_addr == from->sin_addr.s_addr
+        && hs_recent[i].addr.sin_port == from->sin_port
+        && now - hs_recent[i].time < HS_RECENT_SEC) {
+        if (hs_recent[i].verified)
+            return -1;
+        retransmitted = true;
+    }
+
+    if ((retransmitted || live >= hs_cookie_load) && !verified) {
+        send_cookie(listensd, syn, len, from, now);
+        return -1;
+    }
+
+    hs_recent[i].addr = *from;
+    hs_recent[i].nonce = syn->nonce;
+    hs_recent[i].time = now;
+    hs_recent[i].verified = verified;
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	synack_service
+ * --------------------------------------------------
+ * Repeat the SYN_ACK until the client shows up on the connection,
+ * so that a lost SYN_ACK does not cost a new connection request,
+ * if the client proved its address: a spoofed request must not
+ * turn the server into a reflector. Otherwise the client asks again
+ * and is given a cookie. A client that never shows up (on a sealed
+ * connection: never proves to have derived the keys, as a replayed
+ * request cannot) is given up after one more interval.
+ *
+ * Parameters:
+ * 		p:		the address of the retransmission interval
+ */
+void *synack_service(void *p)
+{
+    struct timespec *interval = p;
+    int i;
+
+    netem_stream(NETEM_STREAM_SYNACK);
+    rdt_use(hs_conn);
+    for (i = 0; i < HS_SYNACK_RTX; i++) {
+        while (nanosleep(interval, NULL) == -1 && errno == EINTR);
+        if (rdt_peer_heard())
+            break;
+        if (hs_verified
+            && udt_sendto(hs_connsd, hs_reply, hs_reply_len,
+                          (struct sockaddr *) &hs_cliaddr,
+                          sizeof(hs_cliaddr), hs_loss) == -1)
+            handle_error("udt_sendto() - sending SYN_ACK");
+    }
+
+    if (i == HS_SYNACK_RTX) {
+        while (nanosleep(interval, NULL) == -1 && errno == EINTR);
+        if (!rdt_peer_heard()) {
+            puts("The client did not show up");
+            rdt_abandon();
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Function:	hs_accept
+ * --------------------------------------------------
+ * Agree on the configuration with the client, answer on the
+ * connection socket and start the transport, which follows the client
+ * if its address changes: the datagrams are told apart by the
+ * connection ID, drawn here. The early data is
+ * served right away if the client proposed the configuration that
+ * would be agreed now, otherwise the client will send it again on
+ * the stream. With a pre-shared key the client proved that it knows
+ * the key (hs_parse_syn), and must prove that it derived the keys of
+ * this connection (its request could be replayed) before it is heard.
+ *
+ * Parameters:
+ * 		connsd	the connection socket, not connected
+ * 		cliaddr	the client's address
+ * 		syn		the connection request
+ * 		params	the settings of the server
+ */
+void hs_accept(int connsd, struct sockaddr_in *cliaddr, struct hs_msg *syn,
+               struct proto_params *params)
+{
+    struct proto_params agreed;
+    static struct timespec interval;
+    struct aead_keys keys;
+    struct hs_msg reply;
+    pthread_t t;
+    bool early;
+
+    if (hs_negotiate(params, &syn->caps, &agreed) == -1) {
+        fputs("Incompatible client, connection refused\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the client's proof was checked by hs_parse_syn */
+    reply.has_random = reply.has_auth = agreed.aead != AEAD_NONE;
+    if (reply.has_random) {
+        aead_random(reply.random, AEAD_RANDOM);
+        aead_auth("rudp server", syn->random, reply.random, syn->nonce,
+                  reply.auth);
+        aead_derive(syn->random, reply.random, false, &keys);
+    }
+
+    /* early data is plaintext: never on a sealed connection */
+    early = (syn->flags & HS_EARLY) && (syn->flags & HS_CACHED)
+        && syn->has_cfg && same_params(&syn->cfg, &agreed)
+        && agreed.aead == AEAD_NONE;
+
+    /* never the magic: a handshake message is not a datagram of it */
+    do
+        if (getrandom(&agreed.cid, sizeof(agreed.cid), 0) !=
+            (ssize_t) sizeof(agreed.cid))
+            handle_error("getrandom() - connection ID");
+    while (!agreed.cid || agreed.cid == HS_MAGIC);
+
+    hs_conn = init_transport(connsd, cliaddr, &agreed,
+                             agreed.aead != AEAD_NONE ? &keys : NULL);
+    if (early)
+        rdt_inject(syn->early, syn->early_len);
+
+    reply.version = syn->version < HS_VERSION ? syn->version : HS_VERSION;
+    reply.flags = early ? HS_EARLY_OK : 0;
+    reply.nonce = syn->nonce;
+    local_caps(&reply.caps);
+    reply.has_cfg = true;
+    reply.cfg = agreed;
+    reply.early_len = 0;
+    hs_reply_len = put_message(hs_reply, sizeof(hs_reply), &reply, false);
+    hs_loss = agreed.P / 100.0;
+    hs_connsd = connsd;
+    hs_cliaddr = *cliaddr;
+    hs_verified = cookie_ok(syn, cliaddr, time(NULL));
+
+    if (udt_sendto(connsd, hs_reply, hs_reply_len,
+                   (struct sockaddr *) cliaddr, sizeof(*cliaddr),
+                   hs_loss) == -1)
+        handle_error("udt_sendto() - sending SYN_ACK");
+
+    nsectots(&interval, (long long) agreed.T * 1000000);
+    if (pthread_create(&t, NULL, synack_service, &interval) != 0)
+        handle_error("creating synack_service");
+    pthread_detach(t);
+}
@@ -0,0 +1,114 @@
+#ifndef _HANDSHAKE_H
+#define _HANDSHAKE_H
+
+
+#include "basic.h"
+#include "transport.h"
+
+#include <stddef.h>
+
+#define HS_MAGIC		0x52554450  // "RUDP"
+#define HS_VERSION		5           // highest version spoken
+#define HS_MIN_VERSION	5           // segment format: upgrade both ends
+#define HS_CACHE_ENV	"RUDP_PARAMS_CACHE"
+#define HS_CACHE_FILE	".rudp_params"  // in $HOME
+#define HS_SYN_TIMEOUT	1000        // ms, doubled at every retry
+#define HS_SYN_RETRIES	6
+#define HS_SYNACK_RTX	8           // SYN_ACK retransmissions
+#define HS_MAX_OPTIONS	128         // room for the options (bytes)
+#define HS_HEADER_SIZE	10          // magic, version, flags, nonce
+#define HS_MAX_SYN		(HS_HEADER_SIZE + 2 + HS_MAX_OPTIONS + 2 + MSS)
+#define HS_COOKIE_ENV	"RUDP_SYN_COOKIES"  // live connections before cookies
+#define HS_COOKIE_LOAD	32          // default of RUDP_SYN_COOKIES
+#define HS_COOKIE_SIZE	12          // u32 time, u64 MAC
+#define HS_COOKIE_SEC	30          // lifetime of a cookie
+
+// handshake flags
+#define HS_CACHED		0x01        // SYN: proposes the cached configuration
+#define HS_EARLY		0x02        // SYN: carries early data
+#define HS_EARLY_OK		0x04        // SYN_ACK: early data accepted
+#define HS_RETRY		0x08        // SYN_ACK: no connection, SYN again
+                                    // with the cookie
+
+// options: what an end can do...
+#define CAP_MAX_WINDOW	1           // u16: widest window (segments)
+#define CAP_BUFFER		2           // u32: receive buffer (bytes)
+#define CAP_MSS			3           // u16: largest payload
+#define CAP_FEATURES	4           // u32: FEAT_* supported
+#define CAP_RANDOM		5           // AEAD_RANDOM bytes: fresh, for the keys
+#define CAP_AUTH		6           // AEAD_AUTH bytes: proof of the key
+#define CAP_COOKIE		7           // HS_COOKIE_SIZE bytes: proof of the
+                                    // client's address
+// ...and the configuration of the connection
+#define CFG_WINDOW		16          // u16
+#define CFG_TIMEOUT		17          // u16: ms
+#define CFG_LOSS		18          // u8: %
+#define CFG_FEATURES	19          // u32: FEAT_* enabled
+#define CFG_MSS			20          // u16: largest payload
+#define CFG_CID			21          // u32: connection ID (SYN_ACK)
+
+// features
+#define FEAT_ADAPTIVE	0x01        // adaptive timeout
+#define FEAT_COMPRESS	0x02        // compressed transfers
+#define FEAT_SACK		0x04        // reserved: selective acks
+#define FEAT_FEC		0x08        // reserved: forward error correction
+#define FEAT_PACING		0x10        // reserved: paced sending
+#define FEAT_AEAD_GCM	0x20        // sealed segments: AES-256-GCM
+#define FEAT_AEAD_CHACHA	0x40    // sealed segments: ChaCha20-Poly1305
+#define FEAT_SUPPORTED	(FEAT_ADAPTIVE | FEAT_COMPRESS)
+
+
+/* what an end can do */
+struct hs_caps {
+	uint16_t max_window;
+	uint32_t buffer;
+	uint16_t mss;
+	uint32_t features;
+};
+
+/*
+ * Handshake datagrams, all integers in network byte order:
+ *
+ * 		SYN:		header, u16 options length, options,
+ * 					u16 early data length, early data
+ * 		SYN_ACK:	header, u16 options length, options
+ *
+ * where the header is u32 magic, u8 version, u8 flags, u32 nonce and the
+ * options are (u8 type, u8 length, value) triplets; unknown options are
+ * skipped, so that new ones can be added without a new version.
+ * The SYN carries the capabilities of the client (and the cached
+ * configuration), the SYN_ACK the agreed configuration and the
+ * capabilities of the server. With a pre-shared key (RUDP_PSK) both
+ * add their random bytes, from which the keys of the connection are
+ * derived, and the proof that they know the key. A busy server may
+ * answer with HS_RETRY and a cookie, to be echoed in a new SYN. The
+ * SYN_ACK gives the connection ID, the first bytes of every datagram
+ * of the connection.
+ */
+struct hs_msg {
+	uint8_t version;
+	uint8_t flags;
+	uint32_t nonce;
+	struct hs_caps caps;
+	bool has_cfg;
+	struct proto_params cfg;
+	bool has_random;
+	uint8_t random[AEAD_RANDOM];
+	bool has_auth;
+	uint8_t auth[AEAD_AUTH];
+	bool has_cookie;
+	uint8_t cookie[HS_COOKIE_SIZE];
+	uint16_t early_len;
+	uint8_t early[MSS];
+};
+
+
+struct rdt_conn *hs_connect(int sockfd, struct sockaddr_in *addr);
+int hs_parse_syn(int listensd, struct hs_msg *syn, const void *buf,
+                 size_t len, struct sockaddr_in *from, unsigned int live);
+void hs_accept(int connsd, struct sockaddr_in *cliaddr, struct hs_msg *syn,
+               struct proto_params *params);
+bool hs_is_synack(const void *buf, size_t len, uint32_t cid);
+
+
+#endif /* _HANDSHAKE_H */
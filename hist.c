@@ -0,0 +1,345 @@
+#include "hist.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* histograms exported at exit, registered by any connection's thread */
+struct {
+    const char *name;
+    struct hist *h;
+} hist_registry[HIST_MAX];
+unsigned int hist_registered;
+pthread_mutex_t hist_mtx = PTHREAD_MUTEX_INITIALIZER;
+char hist_path[PATH_MAX];
+
+
+
+/*
+ * Function:	hist_index
+ * --------------------------------------------------
+ * Map a value to its bucket: the position of the most significant
+ * bit selects the power of two, the next HIST_SUB_BITS bits the
+ * sub-bucket.
+ */
+unsigned int hist_index(uint64_t v)
+{
+    unsigned int e;
+
+    if (v < HIST_SUB)
+        return v;
+
+    e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return HIST_SUB + e * HIST_SUB + ((v >> e) & (HIST_SUB - 1));
+}
+
+
+
+/* lowest value of a bucket */
+uint64_t hist_low(unsigned int i)
+{
+    unsigned int e;
+
+    if (i < HIST_SUB)
+        return i;
+
+    e = (i - HIST_SUB) / HIST_SUB;
+    return (uint64_t) (HIST_SUB + (i - HIST_SUB) % HIST_SUB) << e;
+}
+
+
+
+/* highest value of a bucket */
+uint64_t hist_high(unsigned int i)
+{
+    if (i < HIST_SUB)
+        return i;
+
+    return hist_low(i) + (1ULL << (i - HIST_SUB) / HIST_SUB) - 1;
+}
+
+
+
+void hist_reset(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+
+
+void hist_record(struct hist *h, uint64_t v)
+{
+    uint64_t cur;
+
+    __atomic_fetch_add(&h->buckets[hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (v < cur && !__atomic_compare_exchange_n(&h->min, &cur, v, true,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED));
+
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(&h->max, &cur, v, true,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED));
+}
+
+
+
+/* record the time elapsed since t0 (CLOCK_MONOTONIC) */
+void hist_record_since(struct hist *h, struct timespec *t0)
+{
+    struct timespec now;
+    int64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (int64_t) (now.tv_sec - t0->tv_sec) * 1000000000
+        + (now.tv_nsec - t0->tv_nsec);
+    hist_record(h, ns > 0 ? ns : 0);
+}
+
+
+
+/*
+ * Function:	hist_snapshot
+ * --------------------------------------------------
+ * Copy a histogram that may be updated meanwhile. Every field is read
+ * atomically, so the copy may only miss the samples in flight.
+ */
+void hist_snapshot(struct hist *dst, struct hist *src)
+{
+    uint64_t *d = (uint64_t *) dst, *s = (uint64_t *) src;
+    size_t i;
+
+    for (i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++)
+        d[i] = __atomic_load_n(s + i, __ATOMIC_RELAXED);
+}
+
+
+
+/* add the samples of src to dst (not concurrently updated) */
+void hist_merge(struct hist *dst, struct hist *src)
+{
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+
+
+/*
+ * Function:	hist_percentile
+ * --------------------------------------------------
+ * Returns:
+ * 		the highest value equivalent to the p-th percentile
+ * 		(0 < p <= 100), 0 if the histogram is empty
+ */
+uint64_t hist_percentile(struct hist *h, double p)
+{
+    uint64_t rank, seen = 0, v;
+    unsigned int i;
+
+    if (!h->count)
+        return 0;
+
+    rank = p / 100 * h->count + 0.5;
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i == HIST_BUCKETS)
+        return h->max;
+
+    v = hist_high(i);
+    return v > h->max ? h->max : v;
+}
+
+
+
+/*
+ * Function:	hist_fprint
+ * --------------------------------------------------
+ * Write a histogram as text: a summary line, then a line
+ * "<bucket low> <bucket high> <count>" for every non empty bucket,
+ * then "end". Values in nanoseconds. hist_fscan reads it back.
+ */
+void hist_fprint(FILE * stream, const char *name, struct hist *h)
+{
+    unsigned int i;
+
+    fprintf(stream, "hist %s count=%" PRIu64 " sum=%" PRIu64 " min=%"
+            PRIu64 " max=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+            " p99=%" PRIu64 " p999=%" PRIu64 "\n", name, h->count, h->sum,
+            h->count ? h->min : 0, h->max, hist_percentile(h, 50),
+            hist_percentile(h, 90), hist_percentile(h, 99),
+            hist_percentile(h, 99.9));
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if (h->buckets[i])
+            fprintf(stream, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    hist_low(i), hist_high(i), h->buckets[i]);
+
+    fputs("end\n", stream);
+}
+
+
+
+/*
+ * Function:	hist_fscan
+ * --------------------------------------------------
+ * Read the next histogram written by hist_fprint, skipping
+ * comment lines.
+ *
+ * Parameters:
+ * 		stream	the input
+ * 		name	where to store the name
+ * 		len		size of name
+ * 		h		where to store the histogram
+ *
+ * Returns:
+ * 		1	a histogram was read
+ * 		0	end of file
+ * 		-1	malformed input
+ */
+int hist_fscan(FILE * stream, char *name, size_t len, struct hist *h)
+{
+    char line[512], *p;
+    uint64_t low, high, n;
+
+    hist_reset(h);
+
+    do {
+        if (!fgets(line, sizeof(line), stream))
+            return 0;
+    } while (line[0] == '#' || line[0] == '\n');
+
+    if (strncmp(line, "hist ", 5) != 0 || !(p = strchr(line + 5, ' '))
+        || (size_t) (p - line - 5) >= len)
+        return -1;
+    memcpy(name, line + 5, p - line - 5);
+    name[p - line - 5] = '\0';
+
+    if (sscanf(p, " count=%" SCNu64 " sum=%" SCNu64 " min=%" SCNu64
+               " max=%" SCNu64, &h->count, &h->sum, &h->min,
+               &h->max) != 4)
+        return -1;
+    if (!h->count)
+        h->min = UINT64_MAX;
+
+    while (fgets(line, sizeof(line), stream)) {
+        if (strcmp(line, "end\n") == 0)
+            return 1;
+        if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64, &low, &high,
+                   &n) != 3)
+            return -1;
+        h->buckets[hist_index(low)] += n;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Function:	hist_register
+ * --------------------------------------------------
+ * Empty a histogram and add it to the ones exported at exit.
+ * A histogram registered again (by a later connection of the same
+ * process) keeps its samples.
+ */
+void hist_register(const char *name, struct hist *h)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&hist_mtx);
+
+    for (i = 0; i < hist_registered; i++)
+        if (hist_registry[i].h == h)
+            break;
+
+    if (i == hist_registered) {
+        hist_reset(h);
+        if (i < HIST_MAX) {
+            hist_registry[i].name = name;
+            hist_registry[i].h = h;
+            hist_registered++;
+        }
+    }
+
+    pthread_mutex_unlock(&hist_mtx);
+}
+
+
+
+/* write the registered histograms to <prefix>.<pid> */
+void hist_export(void)
+{
+    struct hist *snap;
+    unsigned int i;
+    FILE *f;
+
+    if (!hist_path[0])
+        return;
+
+    if (!(snap = malloc(sizeof(*snap))) || !(f = fopen(hist_path, "w"))) {
+        perror(hist_path);
+        free(snap);
+        return;
+    }
+
+    fprintf(f, "# %s pid=%d (ns)\n", HIST_ENV, (int) getpid());
+    pthread_mutex_lock(&hist_mtx);
+    for (i = 0; i < hist_registered; i++) {
+        hist_snapshot(snap, hist_registry[i].h);
+        hist_fprint(f, hist_registry[i].name, snap);
+    }
+    pthread_mutex_unlock(&hist_mtx);
+
+    fclose(f);
+    free(snap);
+}
+
+
+
+/*
+ * Function:	hist_init
+ * --------------------------------------------------
+ * Export the histograms at exit if the RUDP_HIST environment
+ * variable holds a file prefix.
+ */
+void hist_init(void)
+{
+    char *prefix = getenv(HIST_ENV);
+
+    if (!prefix || !*prefix || hist_path[0])
+        return;
+
+    if (snprintf(hist_path, sizeof(hist_path), "%s.%d", prefix,
+                 (int) getpid()) >= (int) sizeof(hist_path)) {
+        fprintf(stderr, "%s: prefix too long\n", HIST_ENV);
+        exit(EXIT_FAILURE);
+    }
+
+    if (atexit(hist_export) != 0) {
+        fputs("atexit(): cannot register the histograms export\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HIST_ENV		"RUDP_HIST"
+#define HIST_SUB_BITS	4           // 16 sub-buckets: ~6% relative error
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB)
+#define HIST_MAX		32          // registered histograms
+
+
+/*
+ * Log-linear histogram of nanosecond values: every power of two
+ * is split in HIST_SUB linear sub-buckets, values below HIST_SUB
+ * are exact. Updated with relaxed atomics, so that any thread can
+ * record while another one takes a snapshot.
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+
+void hist_record(struct hist *h, uint64_t v);
+void hist_record_since(struct hist *h, struct timespec *t0);
+void hist_snapshot(struct hist *dst, struct hist *src);
+void hist_merge(struct hist *dst, struct hist *src);
+uint64_t hist_percentile(struct hist *h, double p);
+void hist_fprint(FILE * stream, const char *name, struct hist *h);
+int hist_fscan(FILE * stream, char *name, size_t len, struct hist *h);
+void hist_register(const char *name, struct hist *h);
+void hist_init(void);
+void hist_export(void);
+
+
+#endif /* _HIST_H */
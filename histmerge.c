@@ -0,0 +1,85 @@
+#include "hist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/* a merged histogram */
+struct merged {
+    char name[64];
+    struct hist h;
+};
+
+
+struct merged *merged;
+size_t nmerged;
+
+
+
+/* find the histogram with the given name, adding it if missing */
+struct hist *lookup(const char *name, struct hist *first)
+{
+    struct merged *tmp;
+    size_t i;
+
+    for (i = 0; i < nmerged; i++)
+        if (strcmp(merged[i].name, name) == 0)
+            return &merged[i].h;
+
+    if (!(tmp = realloc(merged, (nmerged + 1) * sizeof(*tmp)))) {
+        perror("realloc()");
+        exit(EXIT_FAILURE);
+    }
+    merged = tmp;
+    strcpy(merged[nmerged].name, name);
+    merged[nmerged].h = *first;
+    nmerged++;
+
+    return NULL;
+}
+
+
+
+int main(int argc, char **argv)
+{
+    struct hist *h, *dst;
+    char name[64];
+    size_t i;
+    FILE *f;
+    int k, r;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <%s file>...\n"
+                "Merge the histograms with the same name.\n", argv[0],
+                HIST_ENV);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(h = malloc(sizeof(*h)))) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (k = 1; k < argc; k++) {
+        if (!(f = fopen(argv[k], "r"))) {
+            perror(argv[k]);
+            exit(EXIT_FAILURE);
+        }
+        while ((r = hist_fscan(f, name, sizeof(name), h)) == 1)
+            if ((dst = lookup(name, h)))
+                hist_merge(dst, h);
+        if (r == -1) {
+            fprintf(stderr, "%s: malformed histogram\n", argv[k]);
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+    }
+
+    printf("# %s merged from %d files (ns)\n", HIST_ENV, argc - 1);
+    for (i = 0; i < nmerged; i++)
+        hist_fprint(stdout, merged[i].name, &merged[i].h);
+
+    free(h);
+    free(merged);
+    return 0;
+}
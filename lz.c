@@ -0,0 +1,263 @@
+#include "lz.h"
+
+#include <string.h>
+
+
+/*
+ * Block format (LZ4 style)
+ * --------------------------------------------------------------
+ * A block is a list of sequences. Each sequence starts with a token
+ * byte: the high nibble is the literals length, the low nibble is the
+ * match length minus LZ_MIN_MATCH. A nibble equal to 15 is followed by
+ * extension bytes, added to the length until a byte lower than 255.
+ * The token is followed by the literals, then by the 2 bytes (little
+ * endian) offset of the match.
+ * The last sequence has only literals and ends the block.
+ */
+
+
+
+uint32_t lz_read32(const uint8_t * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+
+unsigned int lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+
+/*
+ * Function:	lz_put_length
+ * --------------------------------------------------
+ * Write the extension bytes of a length greater than 14.
+ *
+ * Returns:
+ * 		the address after the last written byte,
+ * 		NULL if the destination buffer is full
+ */
+uint8_t *lz_put_length(uint8_t * op, uint8_t * oend, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+
+
+/*
+ * Function:	lz_put_sequence
+ * --------------------------------------------------
+ * Write a sequence made by literals and an optional match.
+ *
+ * Parameters:
+ * 		op			the destination address
+ * 		oend		the end of the destination buffer
+ * 		lit			the address of the literals
+ * 		lit_len		the number of literals
+ * 		offset		the backward distance of the match
+ * 		match_len	the match length (0 for the last sequence)
+ *
+ * Returns:
+ * 		the address after the sequence,
+ * 		NULL if the destination buffer is full
+ */
+uint8_t *lz_put_sequence(uint8_t * op, uint8_t * oend,
+                         const uint8_t * lit, size_t lit_len,
+                         size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (token >= oend)
+        return NULL;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+
+    if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len)))
+        return NULL;
+
+    if (lit_len > (size_t) (oend - op))
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (!match_len)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (ml >= 15 && !(op = lz_put_length(op, oend, ml)))
+        return NULL;
+
+    return op;
+}
+
+
+
+/*
+ * Function:	lz_compress
+ * --------------------------------------------------
+ * Compress a block with a greedy single-probe hash matcher.
+ *
+ * Parameters:
+ * 		src		the data to compress
+ * 		n		the size of the data
+ * 		dst		the destination buffer
+ * 		cap		the size of the destination buffer
+ *
+ * Returns:
+ * 		the size of the compressed block,
+ * 		0 if it does not fit in cap bytes
+ */
+size_t lz_compress(const uint8_t * src, size_t n, uint8_t * dst,
+                   size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];  // positions + 1 (0 = empty)
+    size_t ip = 0, anchor = 0, ref, len;
+    uint8_t *op = dst, *oend = dst + cap;
+    unsigned int h;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= n) {
+
+        h = lz_hash(lz_read32(src + ip));
+        ref = table[h];
+        table[h] = ip + 1;
+
+        if (!ref || ip + 1 - ref > LZ_MAX_OFFSET
+            || lz_read32(src + ref - 1) != lz_read32(src + ip)) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        /* extend the match */
+        len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            len++;
+
+        op = lz_put_sequence(op, oend, src + anchor, ip - anchor,
+                             ip - ref, len);
+        if (!op)
+            return 0;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    /* last literals */
+    op = lz_put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+    if (!op)
+        return 0;
+
+    return op - dst;
+}
+
+
+
+/*
+ * Function:	lz_get_length
+ * --------------------------------------------------
+ * Read the extension bytes of a length nibble equal to 15.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the block is truncated
+ */
+int lz_get_length(const uint8_t ** ip, const uint8_t * iend, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	lz_decompress
+ * --------------------------------------------------
+ * Decompress a block, checking every length and offset
+ * against the buffers' bounds.
+ *
+ * Parameters:
+ * 		src		the compressed block
+ * 		n		the size of the block
+ * 		dst		the destination buffer
+ * 		cap		the size of the destination buffer
+ *
+ * Returns:
+ * 		the size of the decompressed data,
+ * 		-1 if the block is malformed
+ */
+ssize_t lz_decompress(const uint8_t * src, size_t n, uint8_t * dst,
+                      size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    size_t lit_len, match_len, offset;
+    uint8_t token;
+
+    while (ip < iend) {
+
+        token = *ip++;
+
+        /* literals */
+        lit_len = token >> 4;
+        if (lit_len == 15 && lz_get_length(&ip, iend, &lit_len) == -1)
+            return -1;
+        if (lit_len > (size_t) (iend - ip)
+            || lit_len > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend)         // last sequence
+            break;
+
+        /* match */
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (size_t) (op - dst))
+            return -1;
+
+        match_len = token & 15;
+        if (match_len == 15
+            && lz_get_length(&ip, iend, &match_len) == -1)
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t) (oend - op))
+            return -1;
+
+        /* byte by byte: the match can overlap the output */
+        for (; match_len; match_len--, op++)
+            *op = *(op - offset);
+    }
+
+    return op - dst;
+}
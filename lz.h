@@ -0,0 +1,18 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+#define LZ_MAX_OFFSET	65535
+
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+ssize_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                      size_t cap);
+
+
+#endif /* _LZ_H */
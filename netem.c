@@ -0,0 +1,429 @@
+#include "netem.h"
+#include "queue.h"
+#include "timespec_utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* a datagram waiting in the delay queue */
+struct netem_pkt {
+    struct timespec due;        // departure time (CLOCK_MONOTONIC)
+    int sockfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    uint8_t data[];
+};
+
+
+struct netem_config netem;
+pthread_once_t netem_once = PTHREAD_ONCE_INIT;
+
+/* emulator state, owned by the process that started the thread */
+pthread_mutex_t netem_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t netem_cnd;
+struct queue_t netem_queue;
+pid_t netem_pid;
+struct timespec netem_link_free;        // end of the last serialization
+
+/* random generator of the calling thread (0: not seeded yet) */
+__thread uint64_t netem_state;
+__thread bool netem_bad;        // Gilbert-Elliott state
+
+
+
+void netem_parse_error(const char *item)
+{
+    fprintf(stderr, "%s: invalid item '%s'\n", NETEM_ENV, item);
+    exit(EXIT_FAILURE);
+}
+
+
+
+double netem_percent(const char *item, const char *value)
+{
+    char *end;
+    double v;
+
+    errno = 0;
+    v = strtod(value, &end);
+    if (errno || *end || v < 0 || v > 100)
+        netem_parse_error(item);
+
+    return v / 100;
+}
+
+
+
+long long netem_msec(const char *item, const char *value)
+{
+    char *end;
+    double v;
+
+    errno = 0;
+    v = strtod(value, &end);
+    if (errno || *end || v < 0 || v > 60000)
+        netem_parse_error(item);
+
+    return v * 1000000;
+}
+
+
+
+/*
+ * Function:	netem_init
+ * --------------------------------------------------
+ * Read the emulator configuration from the environment.
+ * Without RUDP_NETEM only the loss of the protocol parameters
+ * is applied, as before.
+ */
+void netem_init(void)
+{
+    char *env, *conf, *item, *save, *value, *end;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    netem.seed = now.tv_sec ^ (uint64_t) getpid() << 32;
+    netem.ge_bad = 1;
+
+    env = getenv(NETEM_ENV);
+    if (env && *env) {
+        netem.enabled = true;
+
+        if (!(conf = strdup(env))) {
+            perror("strdup()");
+            exit(EXIT_FAILURE);
+        }
+
+        for (item = strtok_r(conf, ",", &save); item;
+             item = strtok_r(NULL, ",", &save)) {
+
+            if (!(value = strchr(item, '=')))
+                netem_parse_error(item);
+            *value++ = '\0';
+
+            if (strcmp(item, "seed") == 0) {
+                errno = 0;
+                netem.seed = strtoull(value, &end, 0);
+                if (errno || *end)
+                    netem_parse_error(item);
+            } else if (strcmp(item, "delay") == 0)
+                netem.delay = netem_msec(item, value);
+            else if (strcmp(item, "jitter") == 0)
+                netem.jitter = netem_msec(item, value);
+            else if (strcmp(item, "rate") == 0) {
+                errno = 0;
+                netem.rate = strtoull(value, &end, 0) * 1000;
+                if (errno || *end)
+                    netem_parse_error(item);
+            } else if (strcmp(item, "ge_p") == 0)
+                netem.ge_p = netem_percent(item, value);
+            else if (strcmp(item, "ge_r") == 0)
+                netem.ge_r = netem_percent(item, value);
+            else if (strcmp(item, "ge_good") == 0)
+                netem.ge_good = netem_percent(item, value);
+            else if (strcmp(item, "ge_bad") == 0)
+                netem.ge_bad = netem_percent(item, value);
+            else if (strcmp(item, "dup") == 0)
+                netem.dup = netem_percent(item, value);
+            else if (strcmp(item, "reorder") == 0)
+                netem.reorder = netem_percent(item, value);
+            else if (strcmp(item, "rxloss") == 0)
+                netem.rxloss = netem_percent(item, value);
+            else
+                netem_parse_error(item);
+        }
+
+        free(conf);
+        netem.delayed = netem.delay || netem.jitter || netem.rate;
+    }
+}
+
+
+
+/*
+ * Function:	netem_stream
+ * --------------------------------------------------
+ * Seed the generator of the calling thread for a stream (a
+ * NETEM_STREAM_ role): the seed and the stream are mixed by a
+ * splitmix64 step, so that the streams are unrelated. A thread that
+ * never chose draws from NETEM_STREAM_APP.
+ *
+ * Parameters:
+ * 		stream	the stream
+ */
+void netem_stream(unsigned int stream)
+{
+    uint64_t z;
+
+    pthread_once(&netem_once, netem_init);
+
+    z = netem.seed + (stream + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    /* avoid the all zero state of the generator */
+    netem_state = z ? z : 0x9E3779B97F4A7C15ULL;
+    netem_bad = false;
+}
+
+
+
+/*
+ * Function:	netem_next
+ * --------------------------------------------------
+ * Advance the xorshift64* generator of the calling thread.
+ *
+ * Returns:
+ * 		a random value in [0, 1)
+ */
+double netem_next(void)
+{
+    if (!netem_state)
+        netem_stream(NETEM_STREAM_APP);
+
+    netem_state ^= netem_state >> 12;
+    netem_state ^= netem_state << 25;
+    netem_state ^= netem_state >> 27;
+
+    return ((netem_state * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+
+
+double netem_rand(void)
+{
+    pthread_once(&netem_once, netem_init);
+
+    return netem_next();
+}
+
+
+
+/*
+ * Function:	netem_lost
+ * --------------------------------------------------
+ * Decide whether an outgoing datagram is lost by the
+ * Gilbert-Elliott channel of the calling thread, then move the
+ * channel to its next state.
+ *
+ * Returns:
+ * 		true	if the datagram must be dropped
+ */
+bool netem_lost(void)
+{
+    bool lost;
+
+    pthread_once(&netem_once, netem_init);
+    if (!netem.enabled || (!netem.ge_p && !netem.ge_good))
+        return false;
+
+    lost = netem_next() < (netem_bad ? netem.ge_bad : netem.ge_good);
+    if (netem_next() < (netem_bad ? netem.ge_r : netem.ge_p))
+        netem_bad = !netem_bad;
+
+    return lost;
+}
+
+
+
+bool netem_rx_lost(void)
+{
+    pthread_once(&netem_once, netem_init);
+
+    return netem.enabled && netem.rxloss && netem_rand() < netem.rxloss;
+}
+
+
+
+int netem_due_cmp(void *x, void *y)
+{
+    struct netem_pkt *a = x, *b = y;
+
+    return timespec_cmp(&a->due, &b->due);
+}
+
+
+
+/*
+ * Function:	netem_service
+ * --------------------------------------------------
+ * Send the queued datagrams at their departure time.
+ */
+void *netem_service(void *p)
+{
+    struct netem_pkt *pkt;
+    struct timespec now;
+
+    (void) p;
+
+    pthread_mutex_lock(&netem_mtx);
+
+    for (;;) {
+
+        if (!netem_queue.head) {
+            pthread_cond_wait(&netem_cnd, &netem_mtx);
+            continue;
+        }
+
+        pkt = netem_queue.head->value;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_cmp(&now, &pkt->due) < 0) {
+            pthread_cond_timedwait(&netem_cnd, &netem_mtx, &pkt->due);
+            continue;
+        }
+
+        dequeue(&netem_queue);
+        pthread_mutex_unlock(&netem_mtx);
+
+        /* errors are losses of the emulated link */
+        sendto(pkt->sockfd, pkt->data, pkt->len, 0,
+               pkt->addrlen ? (struct sockaddr *) &pkt->addr : NULL,
+               pkt->addrlen);
+        free(pkt);
+
+        pthread_mutex_lock(&netem_mtx);
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Function:	netem_start
+ * --------------------------------------------------
+ * Start the sending thread in the current process. A forked child
+ * does not inherit the thread of its parent, so it gets a new one
+ * (and an empty queue). Called with the lock held.
+ */
+void netem_start(void)
+{
+    pthread_condattr_t attr;
+    pthread_t t;
+
+    if (netem_pid == getpid())
+        return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&netem_cnd, &attr) != 0) {
+        perror("pthread_cond_init()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_condattr_destroy(&attr);
+
+    netem_queue.head = netem_queue.tail = NULL;
+    netem_link_free.tv_sec = netem_link_free.tv_nsec = 0;
+
+    if (pthread_create(&t, NULL, netem_service, NULL) != 0) {
+        perror("creating netem_service");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(t);
+    netem_pid = getpid();
+}
+
+
+
+/*
+ * Function:	netem_enqueue
+ * --------------------------------------------------
+ * Schedule a copy of a datagram. Called with the lock held.
+ */
+int netem_enqueue(int sockfd, const void *buf, size_t len,
+                  const struct sockaddr *addr, socklen_t addrlen,
+                  struct timespec *now)
+{
+    struct netem_pkt *pkt;
+    struct timespec wire;
+    long long delay;
+
+    if (!(pkt = malloc(sizeof(*pkt) + len)))
+        return -1;
+
+    pkt->sockfd = sockfd;
+    pkt->len = len;
+    memcpy(pkt->data, buf, len);
+    pkt->addrlen = addr ? addrlen : 0;
+    if (addr)
+        memcpy(&pkt->addr, addr, addrlen);
+
+    /* serialization on the capped link */
+    if (timespec_cmp(&netem_link_free, now) < 0)
+        netem_link_free = *now;
+    if (netem.rate) {
+        nsectots(&wire, len * 8 * 1000000000ULL / netem.rate);
+        timespec_add(&netem_link_free, &netem_link_free, &wire);
+    }
+
+    /* propagation, unless the datagram overtakes the queue */
+    delay = 0;
+    if (!(netem.reorder && netem_next() < netem.reorder)) {
+        delay = netem.delay;
+        if (netem.jitter)
+            delay += (netem_next() * 2 - 1) * netem.jitter;
+        if (delay < 0)
+            delay = 0;
+    }
+    nsectots(&wire, delay);
+    timespec_add(&pkt->due, &netem_link_free, &wire);
+
+    if (prio_enqueue(pkt, &netem_queue, netem_due_cmp) == -1) {
+        free(pkt);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	netem_sendto
+ * --------------------------------------------------
+ * Send a datagram through the emulated link: immediately if no
+ * delay is configured, otherwise through the delay queue.
+ * The datagram may be duplicated.
+ *
+ * Returns:
+ * 		the number of bytes sent (or queued) on success
+ * 		-1 on error
+ */
+ssize_t netem_sendto(int sockfd, const void *buf, size_t len,
+                     const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct timespec now;
+    int copies = 1, i;
+    ssize_t r = len;
+
+    pthread_once(&netem_once, netem_init);
+
+    if (netem.enabled && netem.dup && netem_rand() < netem.dup)
+        copies = 2;
+
+    if (!netem.delayed) {
+        for (i = 0; i < copies && r != -1; i++)
+            r = sendto(sockfd, buf, len, 0, addr, addrlen);
+        return r;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&netem_mtx);
+    netem_start();
+    for (i = 0; i < copies && r != -1; i++)
+        if (netem_enqueue(sockfd, buf, len, addr, addrlen, &now) == -1)
+            r = -1;
+    pthread_cond_signal(&netem_cnd);
+    pthread_mutex_unlock(&netem_mtx);
+
+    return r;
+}
@@ -0,0 +1,60 @@
+#ifndef _NETEM_H
+#define _NETEM_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define NETEM_ENV	"RUDP_NETEM"
+
+/* the random streams, by role of the drawing thread */
+#define NETEM_STREAM_APP	0       // application (and handshake) threads
+#define NETEM_STREAM_SEND	1       // segments
+#define NETEM_STREAM_RECV	2       // acks and received datagrams
+#define NETEM_STREAM_TIMER	3       // retransmissions and keepalives
+#define NETEM_STREAM_SYNACK	4       // SYN_ACK retransmissions
+
+
+/*
+ * Link emulator configuration, read from the RUDP_NETEM environment
+ * variable as a comma separated list of key=value pairs:
+ *
+ * 		seed=<n>		seed of the random generators (default: time and pid)
+ * 		delay=<ms>		one-way delay
+ * 		jitter=<ms>		uniform delay variation in [-jitter, +jitter]
+ * 		rate=<kbit/s>	bandwidth cap (serialization delay)
+ * 		ge_p=<%>		Gilbert-Elliott: good -> bad transition probability
+ * 		ge_r=<%>		Gilbert-Elliott: bad -> good transition probability
+ * 		ge_good=<%>		loss probability in the good state
+ * 		ge_bad=<%>		loss probability in the bad state (default 100)
+ * 		dup=<%>			duplication probability
+ * 		reorder=<%>		probability to skip the delay (overtaking others)
+ * 		rxloss=<%>		loss probability on receive
+ *
+ * Every thread draws from a generator (and a Gilbert-Elliott channel)
+ * of its own, seeded from the seed and the stream of its role: the
+ * draws of a thread do not depend on the scheduling of the others.
+ */
+struct netem_config {
+	uint64_t seed;
+	long long delay;            // ns
+	long long jitter;           // ns
+	uint64_t rate;              // bit/s (0 = unlimited)
+	double ge_p, ge_r, ge_good, ge_bad;
+	double dup, reorder, rxloss;
+	bool enabled;
+	bool delayed;               // packets go through the delay queue
+};
+
+
+void netem_stream(unsigned int stream);
+double netem_rand(void);
+bool netem_lost(void);
+bool netem_rx_lost(void);
+ssize_t netem_sendto(int sockfd, const void *buf, size_t len,
+                     const struct sockaddr *addr, socklen_t addrlen);
+
+
+#endif /* _NETEM_H */
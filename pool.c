@@ -0,0 +1,177 @@
+#include "pool.h"
+#include "handshake.h"
+
+
+
+
+/*
+ * Function:	pool_create
+ * --------------------------------------------------
+ * Create a pool of connections to a server. No connection
+ * is opened until it is needed.
+ *
+ * Parameters:
+ * 		addr	the server's address
+ * 		size	the maximum number of connections (up to POOL_MAX)
+ *
+ * Returns:
+ * 		the pool
+ */
+struct rdt_pool *pool_create(struct sockaddr_in *addr, unsigned int size)
+{
+    struct rdt_pool *pool;
+    unsigned int i;
+
+    if (size == 0 || size > POOL_MAX) {
+        errno = EINVAL;
+        handle_error("pool_create()");
+    }
+
+    if (!(pool = calloc(1, sizeof(*pool))))
+        handle_error("calloc() - pool_create");
+    pool->addr = *addr;
+    pool->size = size;
+    for (i = 0; i < size; i++)
+        pool->slots[i].sockfd = -1;
+
+    if (pthread_mutex_init(&pool->mtx, NULL) != 0)
+        handle_error("pthread_mutex_init");
+    if (pthread_cond_init(&pool->cnd_free, NULL) != 0)
+        handle_error("pthread_cond_init");
+
+    return pool;
+}
+
+
+
+/*
+ * Function:	pool_acquire
+ * --------------------------------------------------
+ * Take a free connection, waiting for one if they are all busy, and
+ * make it the one of the calling thread. Open connections are
+ * preferred; a new one is set up (outside the lock) otherwise, or
+ * in place of one that expired.
+ *
+ * Parameters:
+ * 		pool	the pool
+ *
+ * Returns:
+ * 		the connection, to be given back with pool_release
+ * 		NULL if the setup failed (reported): the slot is free again
+ */
+struct rdt_conn *pool_acquire(struct rdt_pool *pool)
+{
+    struct pool_slot *slot = NULL;
+    unsigned int i;
+
+    if (pthread_mutex_lock(&pool->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    while (!slot) {
+        for (i = 0; i < pool->size; i++) {
+            if (pool->slots[i].busy)
+                continue;
+            if (pool->slots[i].conn || !slot)
+                slot = &pool->slots[i];
+            if (slot->conn)
+                break;
+        }
+        if (!slot && pthread_cond_wait(&pool->cnd_free, &pool->mtx) != 0)
+            handle_error("pthread_cond_wait");
+    }
+    slot->busy = true;
+
+    if (pthread_mutex_unlock(&pool->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    /* the server dropped an expired connection: replace it */
+    if (slot->conn) {
+        rdt_use(slot->conn);
+        if (rdt_expired()) {
+            rdt_close();
+            close(slot->sockfd);
+            slot->conn = NULL;
+        }
+    }
+
+    if (!slot->conn) {
+        if ((slot->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+            handle_error("socket()");
+        slot->conn = hs_connect(slot->sockfd, &pool->addr);
+    }
+
+    if (!slot->conn) {
+        close(slot->sockfd);
+        slot->sockfd = -1;
+        if (pthread_mutex_lock(&pool->mtx) != 0)
+            handle_error("pthread_mutex_lock");
+        slot->busy = false;
+        if (pthread_cond_signal(&pool->cnd_free) != 0)
+            handle_error("pthread_cond_signal");
+        if (pthread_mutex_unlock(&pool->mtx) != 0)
+            handle_error("pthread_mutex_unlock");
+        return NULL;
+    }
+
+    rdt_use(slot->conn);
+    return slot->conn;
+}
+
+
+
+/*
+ * Function:	pool_release
+ * --------------------------------------------------
+ * Give back a connection taken with pool_acquire, which stays open
+ * for the next request.
+ *
+ * Parameters:
+ * 		pool	the pool
+ * 		conn	the connection
+ */
+void pool_release(struct rdt_pool *pool, struct rdt_conn *conn)
+{
+    unsigned int i;
+
+    rdt_use(NULL);
+
+    if (pthread_mutex_lock(&pool->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    for (i = 0; i < pool->size; i++)
+        if (pool->slots[i].conn == conn)
+            pool->slots[i].busy = false;
+
+    if (pthread_cond_signal(&pool->cnd_free) != 0)
+        handle_error("pthread_cond_signal");
+    if (pthread_mutex_unlock(&pool->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+}
+
+
+
+/*
+ * Function:	pool_destroy
+ * --------------------------------------------------
+ * Close the connections of the pool and free it. No connection
+ * must be in use.
+ *
+ * Parameters:
+ * 		pool	the pool
+ */
+void pool_destroy(struct rdt_pool *pool)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool->size; i++) {
+        if (!pool->slots[i].conn)
+            continue;
+        rdt_use(pool->slots[i].conn);
+        rdt_close();
+        close(pool->slots[i].sockfd);
+    }
+
+    pthread_cond_destroy(&pool->cnd_free);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool);
+}
@@ -0,0 +1,40 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+
+#include "basic.h"
+#include "transport.h"
+
+#include <pthread.h>
+
+#define POOL_MAX		16          // connections to the same server
+
+
+/* a connection of the pool, opened on first use */
+struct pool_slot {
+	int sockfd;
+	struct rdt_conn *conn;
+	bool busy;
+};
+
+/*
+ * Connections to a server shared by the threads of a client: a
+ * request takes a free one for its whole duration, so that the
+ * replies are told apart by the connection they come from.
+ */
+struct rdt_pool {
+	struct sockaddr_in addr;
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd_free;
+	unsigned int size;
+	struct pool_slot slots[POOL_MAX];
+};
+
+
+struct rdt_pool *pool_create(struct sockaddr_in *addr, unsigned int size);
+struct rdt_conn *pool_acquire(struct rdt_pool *pool);
+void pool_release(struct rdt_pool *pool, struct rdt_conn *conn);
+void pool_destroy(struct rdt_pool *pool);
+
+
+#endif /* _POOL_H */
@@ -74,7 +74,7 @@ int enqueue(void *pval, struct queue_t *q)
 
 int dequeue(struct queue_t *q)
 {
-    struct node_t *d = NULL;
+    struct node_t *d = q->head;       // dequeue_node() removes the head
 
     if (dequeue_node(q, d) == -1) {
         errno = EINVAL;
@@ -37,10 +37,14 @@ char *extract_cmd(const char *line)
     begin = 0;
     while (line[begin] == ' ')
         begin++;
+    if (line[begin] == '\0') {
+        errno = EINVAL;
+        return NULL;
+    }
 
     /* calculate end index */
     end = begin + 1;
-    while (line[end] != ' ')
+    while (line[end] != ' ' && line[end] != '\0')
         end++;
 
     cmd_len = end - begin;
@@ -139,7 +143,7 @@ char *extract_filename(const char *line)
     }
 
     /* skip command */
-    while (line[i] != ' ')
+    while (line[i] != ' ' && line[i] != '\0')
         i++;
     if (i == line_len) {
         errno = EINVAL;
@@ -203,12 +207,43 @@ ssize_t readn(int fd, void *buf, size_t count)
             else
                 return -1;      // error
         }
-        if (r == 0) {           //EOF 
-            continue;
-            fputs("EOF read\n", stderr);
+        if (r == 0)             // EOF
+            break;
+        left -= r;
+        buf += r;
+    }
+    return count - left;
+}
+
+
+
+/*
+ * Function:	preadn
+ * ------------------------
+ * Read exactly count bytes from the given file offset, without
+ * changing the file position.
+ *
+ * Returns:
+ * 		the number of read bytes (less than count at end of file)
+ * 		-1 on error
+ */
+ssize_t preadn(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t r;
+    size_t left = count;
+
+    while (left > 0) {
+        r = pread(fd, buf, left, offset);
+        if (r == -1) {
+            if (errno == EINTR) // signal interruption
+                continue;
+            return -1;          // error
         }
+        if (r == 0)             // EOF
+            break;
         left -= r;
         buf += r;
+        offset += r;
     }
     return count - left;
 }
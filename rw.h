@@ -3,11 +3,13 @@
 
 
 #include <stdlib.h>
+#include <sys/types.h>
 
 char *extract_cmd(const char *);
 char *extract_filename(const char *);
 ssize_t writen(int, const void *, size_t);
 ssize_t readn(int, void *, size_t);
+ssize_t preadn(int, void *, size_t, off_t);
 ssize_t read_string(int, void *, size_t);
 
 
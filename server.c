@@ -3,18 +3,25 @@
 #include "transport.h"
 #include "srvcmd.h"
 #include "strto.h"
+#include "chunk_cache.h"
+#include "cmd_commons.h"
+#include "handshake.h"
 
 
 
 void parse_args(int argc, char **argv, struct proto_params *params,
-                uint16_t * port);
+                uint16_t * port, size_t *cache_size);
 void server_job(void);
 void create_connection(struct proto_params *params,
-                       struct sockaddr_in *cliaddr, socklen_t clilen);
+                       struct sockaddr_in *cliaddr, struct hs_msg *syn);
 void register_zombie_handler(void);
 void sig_zombie_handler(int sig);
 
 
+/* the connections being served, one child process each */
+volatile sig_atomic_t children;
+
+
 
 int main(int argc, char **argv)
 {
@@ -22,8 +29,12 @@ int main(int argc, char **argv)
     struct sockaddr_in servaddr, cliaddr;
     struct proto_params params;
     socklen_t clilen;
-    char *buf[MAXLINE];
+    uint8_t request[HS_MAX_SYN];
+    struct hs_msg syn;
+    sigset_t chld, old;
+    ssize_t r;
     uint16_t server_port;
+    size_t cache_size;
 
 
     /* init configuration parameters with default values */
@@ -31,12 +42,21 @@ int main(int argc, char **argv)
     params.T = 1000;            // milliseconds
     params.P = 10;              // decimal part
     params.adaptive = 0;        // boolean value
+    params.compress = 0;        // boolean value
+    params.mss = MSS_MAX;       // bytes, lowered by the client and the path
+    params.aead = AEAD_NONE;    // agreed by the handshake (RUDP_PSK)
     server_port = SERVER_PORT;
+    cache_size = 16 << 20;      // bytes
 
 
     /* parse arguments */
     if (argc > 1)
-        parse_args(argc, argv, &params, &server_port);
+        parse_args(argc, argv, &params, &server_port, &cache_size);
+
+
+    /* create the chunk cache shared by the connection processes */
+    if (cache_init(cache_size) == -1)
+        handle_error("cache_init()");
 
 
     /* create listen socket */
@@ -71,6 +91,8 @@ int main(int argc, char **argv)
 
     /* register SIGCHLD signal handler */
     register_zombie_handler();
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
 
 
     for (;;) {
@@ -81,9 +103,9 @@ int main(int argc, char **argv)
 
         /* wait for connection requests */
         errno = 0;
-        if (recvfrom
-            (sockfd, buf, MAXLINE, 0, (struct sockaddr *) &cliaddr,
-             &clilen) == -1) {
+        if ((r = recvfrom
+             (sockfd, request, sizeof(request), 0,
+              (struct sockaddr *) &cliaddr, &clilen)) == -1) {
 
             if (errno == EINTR)
                 // signal interruption
@@ -91,9 +113,18 @@ int main(int argc, char **argv)
 
             handle_error("waiting for connection requests");
         }
+
+        /*
+         * ignore stray datagrams, retransmitted requests and, when busy,
+         * the ones whose sender has not proved its address yet
+         */
+        if (hs_parse_syn(sockfd, &syn, request, r, &cliaddr, children) == -1)
+            continue;
         puts("got connection request");
 
         /* create a new proccess to handle the client requests */
+        if (sigprocmask(SIG_BLOCK, &chld, &old) == -1)
+            handle_error("sigprocmask()");
         pid = fork();
 
         if (pid == -1)
@@ -101,12 +132,20 @@ int main(int argc, char **argv)
 
         if (!pid) {             // child process
 
+            if (sigprocmask(SIG_SETMASK, &old, NULL) == -1)
+                handle_error("sigprocmask()");
+
             /* close duplicated listen socket */
             if (close(sockfd) == -1)
                 handle_error("close()");
 
-            create_connection(&params, &cliaddr, clilen);
+            create_connection(&params, &cliaddr, &syn);
         }
+
+        /* counted with SIGCHLD blocked: the handler counts them down */
+        children++;
+        if (sigprocmask(SIG_SETMASK, &old, NULL) == -1)
+            handle_error("sigprocmask()");
     }
 
     /* NEVER REACHED */
@@ -119,11 +158,11 @@ int main(int argc, char **argv)
 
 
 void parse_args(int argc, char **argv, struct proto_params *params,
-                uint16_t * port)
+                uint16_t * port, size_t *cache_size)
 {
     int c;
 
-    while ((c = getopt(argc, argv, "P:N:T:a")) != -1) {
+    while ((c = getopt(argc, argv, "P:N:T:azc:")) != -1) {
         switch (c) {
         case 'P':
             params->P = strtoloss(optarg);
@@ -137,9 +176,15 @@ void parse_args(int argc, char **argv, struct proto_params *params,
         case 'a':
             params->adaptive = 1;
             break;
+        case 'z':
+            params->compress = 1;
+            break;
+        case 'c':
+            *cache_size = strtocache(optarg);
+            break;
         case '?':              // option not recognized or missing required arg
             fprintf(stderr,
-                    "Usage: %s [port] [-P loss] [-N width] [-T timeout] [-a]\n",
+                    "Usage: %s [port] [-P loss] [-N width] [-T timeout] [-a] [-z] [-c cache_MiB]\n",
                     argv[0]);
             exit(EXIT_FAILURE);
         }
@@ -153,39 +198,53 @@ void parse_args(int argc, char **argv, struct proto_params *params,
 
 
 void create_connection(struct proto_params *params,
-                       struct sockaddr_in *cliaddr, socklen_t clilen)
+                       struct sockaddr_in *cliaddr, struct hs_msg *syn)
 {
+    struct sockaddr_in addr;
     int connsd;
 
     /* create a connection socket */
     if ((connsd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
         handle_error("socket()");
 
-    /* set the end point */
-    if (connect(connsd, (struct sockaddr *) cliaddr, clilen) == -1)
-        handle_error("socket()");
-
-    /* send SYN_ACK with protocol parameters */
-    if (udt_send
-        (connsd, params, sizeof(struct proto_params),
-         params->P / 100.0) == -1)
-        handle_error("udt_send() - sending SYN_ACK");
+    /*
+     * a port of its own, not connected: the client may come from
+     * another address (NAT), recognized by the connection ID
+     */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(connsd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        handle_error("bind()");
 
-    init_transport(connsd, params);
+    /* send SYN_ACK with protocol parameters, serve the early request */
+    hs_accept(connsd, cliaddr, syn, params);
+    cmd_hist_init();
 
     server_job();
+
+    /* the client closed: end the connection at once */
+    rdt_close();
+    close(connsd);
+    exit(EXIT_SUCCESS);
 }
 
 
 
 void server_job(void)
 {
-    uint8_t cmd;
+    struct timespec t0;
+    int cmd;
 
     for (;;) {
 
         puts("Waiting for requests");
-        cmd = recvcmd();
+        if ((cmd = recvcmd()) == -1) {
+            puts("Connection closed by the client");
+            return;
+        }
+        if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+            handle_error("clock_gettime()");
 
         switch (cmd) {
 
@@ -204,9 +263,30 @@ void server_job(void)
             srv_put();
             break;
 
+        case RGET:
+            puts("RGET request received");
+            srv_rget();
+            break;
+
+        case RPUT:
+            puts("RPUT request received");
+            srv_rput();
+            break;
+
+        case DPUT:
+            puts("DPUT request received");
+            srv_dput();
+            break;
+
+        case LISTX:
+            puts("LISTX request received");
+            srv_listx();
+            break;
+
         default:
             puts("Unknown command received");
         }
+        cmd_hist_record(cmd, &t0);
     }
 }
 
@@ -218,8 +298,10 @@ void sig_zombie_handler(int sig)
 
     (void) sig;
 
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
         printf("Buried zombie %d\n", pid);  // UNSAFE: non-reentrant function
+        children--;
+    }
 
     return;
 }
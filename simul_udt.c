@@ -1,4 +1,5 @@
 #include "simul_udt.h"
+#include "netem.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,21 +12,15 @@
 /*
  * Function:	randgen
  * -------------------------------------
- * Generate a random value between 0 and 1.
- * The seed is set only at the first call of the function
- * in order to avoid same values extractions.
+ * Generate a random value between 0 and 1, from the link
+ * emulator's generator (seeded by RUDP_NETEM "seed" if given).
  *
  * Returns:
  * 		the random generated value.
  */
 double randgen(void)
 {
-    static bool seed = false;
-    if (!seed) {
-        srand48(time(NULL));
-        seed = true;
-    }
-    return drand48();
+    return netem_rand();
 }
 
 
@@ -34,7 +29,8 @@ double randgen(void)
  * Function:	udt_sendto
  * --------------------------------------------
  * Send data to destination address if the random generated number is
- * greater than the loss probability.
+ * greater than the loss probability and the emulated link does not
+ * lose it (see netem.h).
  *
  * Parameters:
  * 		sockfd:		socket file descriptor
@@ -58,8 +54,8 @@ ssize_t udt_sendto(int sockfd, const void *buf, size_t len,
     if (loss < 0.1)
         usleep(50);
 
-    if (randgen() > loss) {
-        retval = sendto(sockfd, buf, len, 0, addr, addrlen);
+    if (randgen() > loss && !netem_lost()) {
+        retval = netem_sendto(sockfd, buf, len, addr, addrlen);
         //fputs("frame sent\n", stderr);
     } else {
         //fputs("frame lost\n", stderr);
@@ -92,3 +88,65 @@ ssize_t udt_send(int sockfd, void *buf, size_t size, double loss)
 {
     return udt_sendto(sockfd, buf, size, NULL, 0, loss);
 }
+
+
+
+
+/*
+ * Function:	udt_recv
+ * --------------------------------------
+ * Read a datagram from the socket, discarding the ones
+ * the emulated link loses on receive.
+ *
+ * Parameters:
+ * 		sockfd		socket file descriptor
+ * 		buf			pointer to the receive buffer
+ * 		size		size in bytes of the buffer
+ *
+ * Returns:
+ * 		the number of bytes read on success
+ * 		-1 on error
+ */
+ssize_t udt_recv(int sockfd, void *buf, size_t size)
+{
+    ssize_t r;
+
+    do
+        r = read(sockfd, buf, size);
+    while (r >= 0 && netem_rx_lost());
+
+    return r;
+}
+
+
+
+
+/*
+ * Function:	udt_recvfrom
+ * --------------------------------------
+ * Like udt_recv, also telling the sender.
+ *
+ * Parameters:
+ * 		sockfd		socket file descriptor
+ * 		buf			pointer to the receive buffer
+ * 		size		size in bytes of the buffer
+ * 		addr		where to store the sender's address
+ * 		addrlen		its size, updated
+ *
+ * Returns:
+ * 		the number of bytes read on success
+ * 		-1 on error
+ */
+ssize_t udt_recvfrom(int sockfd, void *buf, size_t size,
+                     struct sockaddr *addr, socklen_t *addrlen)
+{
+    socklen_t len = *addrlen;
+    ssize_t r;
+
+    do {
+        *addrlen = len;
+        r = recvfrom(sockfd, buf, size, 0, addr, addrlen);
+    } while (r >= 0 && netem_rx_lost());
+
+    return r;
+}
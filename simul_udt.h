@@ -10,6 +10,9 @@ ssize_t udt_sendto(int sockfd, const void *buf, size_t len,
 				 const struct sockaddr *addr, socklen_t addrlen,
                  double loss);
 ssize_t udt_send(int sockfd, void *buf, size_t size, double loss);
+ssize_t udt_recv(int sockfd, void *buf, size_t size);
+ssize_t udt_recvfrom(int sockfd, void *buf, size_t size,
+                     struct sockaddr *addr, socklen_t *addrlen);
 
 
 #endif /* SIMUL_UDT_H */
@@ -0,0 +1,78 @@
+#include "siphash.h"
+
+#include <string.h>
+
+
+#define ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+
+
+/* a little endian 64 bit word */
+uint64_t load_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+
+
+/*
+ * Function:	siphash24
+ * --------------------------------------------------
+ * Parameters:
+ * 		key		the key (SIPHASH_KEY bytes)
+ * 		data	the input
+ * 		len		its size
+ *
+ * Returns:
+ * 		the 64 bit hash
+ */
+uint64_t siphash24(const uint8_t *key, const void *data, size_t len)
+{
+    const uint8_t *p = data, *end = p + (len & ~(size_t) 7);
+    uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m, b = (uint64_t) len << 56;
+    uint8_t last[8];
+
+    for (; p != end; p += 8) {
+        m = load_le64(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    /* the last bytes, padded with zeros, and the length */
+    memset(last, 0, sizeof(last));
+    memcpy(last, p, len & 7);
+    b |= load_le64(last);
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
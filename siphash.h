@@ -0,0 +1,20 @@
+#ifndef _SIPHASH_H
+#define _SIPHASH_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY		16
+
+
+/*
+ * SipHash-2-4: a keyed hash, fast on short inputs. Without the key
+ * its values cannot be predicted, nor collisions chosen, so that it
+ * can authenticate what the server hands out (cookies) and index
+ * tables filled by the network.
+ */
+uint64_t siphash24(const uint8_t *key, const void *data, size_t len);
+
+
+#endif /* _SIPHASH_H */
@@ -2,77 +2,132 @@
 #include "rw.h"
 #include "transport.h"
 #include "cmd_commons.h"
+#include "delta.h"
+#include "chunk_cache.h"
+#include "dirlist.h"
 
 
-uint8_t recvcmd(void)
+/* the next command code, -1 if the client closed the connection */
+int recvcmd(void)
 {
     uint8_t cmd;
 
-    rdt_recv(&cmd, sizeof(uint8_t));
+    if (rdt_recv(&cmd, sizeof(uint8_t)) == 0)
+        return -1;
 
     return cmd;
 }
 
 
 
-void srv_list(void)
-{
-    struct stat st;
+/* snapshot of the served directory, shared by the listing commands */
+struct dir_snapshot served_dir;
+bool served_dir_init = false;
 
-    int fd;
-    uint64_t file_size;
-    char *filename = "file_list.txt";
-    uint8_t *header;
 
-    /* execute ls command */
-    char *cmd = "ls > file_list.txt";
-    if (system(cmd) == -1)
-        handle_error("system() - executing ls command");
 
-    /* open the destination file of the list command */
-    fd = open(filename, O_RDONLY);
-    if (fd == -1)
-        handle_error("open() - opening LIST file");
+/*
+ * Function:	send_listing
+ * ---------------------------------------------------------------
+ * Send a page of the served directory listing, preceded by its size
+ * and, if requested, by the total number of entries.
+ *
+ * Parameters:
+ * 		flags		listing flags
+ * 		start		index of the first entry
+ * 		count		maximum number of entries (0 means all)
+ * 		with_total	true to send the total number of entries
+ */
+void send_listing(uint8_t flags, uint32_t start, uint32_t count,
+                  bool with_total)
+{
+    uint8_t header[sizeof(uint64_t) + sizeof(uint32_t)];
+    uint64_t list_size;
+    uint32_t total;
+    size_t len;
+    char *text;
+
+    if (!served_dir_init) {
+        dir_snapshot_init(&served_dir, ".");
+        served_dir_init = true;
+    }
 
-    /* calculate file size */
-    if (fstat(fd, &st) == -1)
-        handle_error("fstat() - getting LIST file stats");
-    file_size = st.st_size;
+    if (dir_snapshot_update(&served_dir, flags & LIST_LONG) == -1)
+        handle_error("dir_snapshot_update() - reading served directory");
 
-    /* allocate header buffer */
-    header = malloc(sizeof(file_size));
-    if (!header)
-        handle_error("malloc() - allocating LIST header");
+    text = dir_format(&served_dir, start, count, flags, &len);
+    if (!text)
+        handle_error("dir_format() - allocating LIST text");
 
     /* set the header */
-    memcpy(header, &file_size, sizeof(file_size));
+    list_size = len;
+    total = served_dir.count;
+    memcpy(header, &list_size, sizeof(list_size));
+    memcpy(header + sizeof(list_size), &total, sizeof(total));
+
+    send_buffer(text, header, len, sizeof(list_size)
+                + (with_total ? sizeof(total) : 0));
+    free(text);
+}
 
-    /* send file and free resources */
-    send_file(fd, header, file_size, sizeof(file_size));
-    free(header);
-    if (close(fd) == -1)
-        handle_error("close() - closing file list");
+
+
+void srv_list(void)
+{
+    send_listing(0, 0, 0, false);
 }
 
 
 
-void srv_get(void)
+void srv_listx(void)
+{
+    uint8_t flags;
+    uint32_t start, count;
+
+    /* read flags and page */
+    if (recv_exact(&flags, sizeof(flags)) == -1
+        || recv_exact(&start, sizeof(start)) == -1
+        || recv_exact(&count, sizeof(count)) == -1) {
+        fputs("LISTX: connection closed\n", stderr);
+        return;
+    }
+    fprintf(stderr, "flags: %u, start: %u, count: %u\n", flags, start,
+            count);
+
+    send_listing(flags, start, count, true);
+}
+
+
+
+/*
+ * Function:	send_range
+ * ---------------------------------------------------------------
+ * Open the requested file and send the GET response followed by
+ * length bytes of the file starting from offset.
+ * The range is clamped to the end of the file, a zero length
+ * meaning until the end of the file. A range starting past the
+ * end, or after bytes that differ from the requester's (their
+ * CRC-32C does not match), is refused with GET_RANGE and the size
+ * of the file.
+ *
+ * Parameters:
+ * 		filename	the name of the requested file
+ * 		offset		the first byte to send
+ * 		length		the number of bytes to send
+ * 		prefix		the CRC-32C of the requester's first offset bytes
+ */
+void send_range(const char *filename, uint64_t offset, uint64_t length,
+                uint32_t prefix)
 {
     struct stat st;
     int fd;
     size_t header_size;
 
-    char filename[MAXLINE];
     uint8_t *header;
     uint8_t response_code;
-    uint64_t file_size;
+    uint64_t file_size, hits, misses;
 
 
-    /* Read filename */
-    if (rdt_read_string(filename, MAXLINE) <= 0)
-        handle_error("rdt_read_string() - reading requested filename");
-    fprintf(stderr, "filename: %s\n", filename);
-
     /* Open the file */
     errno = 0;
     fd = open(filename, O_RDONLY);
@@ -91,21 +146,82 @@ void srv_get(void)
         handle_error("fstat() - getting requested file stats");
     file_size = st.st_size;
 
+    /* the requester's copy is not a prefix of the file */
+    if (offset > file_size || prefix_crc(fd, offset) != prefix) {
+        response_code = GET_RANGE;
+        rdt_send(&response_code, sizeof(response_code));
+        rdt_send(&file_size, sizeof(file_size));
+        if (close(fd) == -1)
+            handle_error("close() - closing requested file");
+        return;
+    }
+
+    /* clamp the range to the file size */
+    if (!length || length > file_size - offset)
+        length = file_size - offset;
+
+    /* move to the beginning of the range */
+    if (offset && lseek(fd, offset, SEEK_SET) == -1)
+        handle_error("lseek() - seeking requested file");
+
     /* allocate the header buffer */
-    header_size = sizeof(response_code) + sizeof(file_size);
+    header_size = sizeof(response_code) + sizeof(length);
     header = malloc(header_size);
     if (!header)
         handle_error("malloc() - allocating GET header");
 
     /* set the header */
     header[0] = GET_OK;
-    memcpy(header + 1, &file_size, sizeof(file_size));
+    memcpy(header + 1, &length, sizeof(length));
 
     /* send file and free resources */
-    send_file(fd, header, file_size, header_size);
+    send_file(fd, header, length, header_size);
     free(header);
     if (close(fd) == -1)
         handle_error("close() - closing requested file");
+
+    if (cache_enabled()) {
+        cache_stats(&hits, &misses);
+        printf("Chunk cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+               hits, misses);
+    }
+}
+
+
+
+void srv_get(void)
+{
+    char filename[MAXLINE];
+
+    /* Read filename */
+    if (rdt_read_string(filename, MAXLINE) <= 0)
+        handle_error("rdt_read_string() - reading requested filename");
+    fprintf(stderr, "filename: %s\n", filename);
+
+    send_range(filename, 0, 0, 0);
+}
+
+
+
+void srv_rget(void)
+{
+    char filename[MAXLINE];
+    uint64_t offset, length;
+    uint32_t prefix;
+
+    /* Read filename, range and the digest of the bytes before it */
+    if (rdt_read_string(filename, MAXLINE) <= 0)
+        handle_error("rdt_read_string() - reading requested filename");
+    if (recv_exact(&offset, sizeof(offset)) == -1
+        || recv_exact(&length, sizeof(length)) == -1
+        || recv_exact(&prefix, sizeof(prefix)) == -1) {
+        fputs("RGET: connection closed\n", stderr);
+        return;
+    }
+    fprintf(stderr, "filename: %s, offset: %" PRIu64 ", length: %" PRIu64
+            "\n", filename, offset, length);
+
+    send_range(filename, offset, length, ntohl(prefix));
 }
 
 
@@ -121,7 +237,7 @@ void report_error(const char *msg)
 
 void srv_put(void)
 {
-    int fd;
+    int fd, err;
     char filename[MAXLINE];
     uint8_t outcome;
     uint64_t file_size;
@@ -135,20 +251,343 @@ void srv_put(void)
     fprintf(stderr, "filename: %s\n", filename);
 
     /* read file size */
-    rdt_recv(&file_size, sizeof(file_size));
+    if (recv_exact(&file_size, sizeof(file_size)) == -1) {
+        fputs("PUT: connection closed\n", stderr);
+        return;
+    }
     fprintf(stderr, "file size: %lu\n", file_size);
 
-    /* open the file */
-    fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    /* open the file, discarding any previous content */
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
         report_error("open() - opening PUT file on writing");
         return;
     }
 
-    /* receive and store the file */
-    recv_file(fd, file_size);
+    /* receive and store the file, dropping a damaged copy */
+    err = recv_file(fd, file_size) == -1 ? errno : 0;
+    if (close(fd) == -1)
+        handle_error("close() - closing PUT file");
+    if (err == ECONNRESET) {    // what arrived is left for RPUT
+        fputs("PUT: connection closed\n", stderr);
+        return;
+    }
+    if (err) {
+        if (unlink(filename) == -1)
+            handle_error("unlink() - removing PUT file");
+        report_error(err == ENOSPC ? "no room for the file"
+                     : "file digest mismatch");
+        return;
+    }
 
     /* send positive outcome */
     outcome = PUT_SUCCESS;
     rdt_send(&outcome, sizeof(outcome));
 }
+
+
+
+void srv_rput(void)
+{
+    struct stat st;
+    int fd, err;
+    char filename[MAXLINE];
+    uint8_t code;
+    uint64_t offset, length;
+    uint32_t prefix;
+
+
+    /* read filename */
+    if (rdt_read_string(filename, MAXLINE) <= 0) {
+        report_error("rdt_read_string() - reading RPUT filename");
+        return;
+    }
+    fprintf(stderr, "filename: %s\n", filename);
+
+    /* open the partial copy, keeping its content */
+    if ((fd = open(filename, O_RDWR | O_CREAT, 0644)) == -1) {
+        report_error("opening RPUT file on writing");
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        report_error("getting RPUT file stats");
+        return;
+    }
+    offset = st.st_size;
+
+    /* reply with the size of the partial copy and its digest */
+    code = PUT_RESUME;
+    prefix = htonl(prefix_crc(fd, offset));
+    rdt_send(&code, sizeof(code));
+    rdt_send(&offset, sizeof(offset));
+    rdt_send(&prefix, sizeof(prefix));
+
+    /* read the size of the missing part */
+    if (recv_exact(&length, sizeof(length)) == -1) {
+        if (close(fd) == -1)
+            handle_error("close() - closing RPUT file");
+        fputs("RPUT: connection closed\n", stderr);
+        return;
+    }
+    fprintf(stderr, "offset: %" PRIu64 ", length: %" PRIu64 "\n", offset,
+            length);
+
+    /* not a prefix of the client's file: not the file being resumed */
+    if (length == RPUT_ABORT) {
+        if (close(fd) == -1)
+            handle_error("close() - closing RPUT file");
+        report_error("partial copy not a prefix of the client's file");
+        return;
+    }
+
+    /* append the missing part to the partial copy */
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        handle_error("lseek() - seeking RPUT file");
+    err = recv_file(fd, length) == -1 ? errno : 0;
+    if (close(fd) == -1)
+        handle_error("close() - closing RPUT file");
+    if (err == ECONNRESET) {    // what arrived is left for RPUT
+        fputs("RPUT: connection closed\n", stderr);
+        return;
+    }
+    if (err) {
+        /* the bytes before the resume were complete: keep them */
+        if (truncate(filename, offset) == -1)
+            handle_error("truncate() - dropping the damaged RPUT part");
+        report_error(err == ENOSPC ? "no room for the file"
+                     : "file digest mismatch");
+        return;
+    }
+
+    /* send positive outcome */
+    code = PUT_SUCCESS;
+    rdt_send(&code, sizeof(code));
+}
+
+
+
+
+/*
+ * Function:	send_signatures
+ * ---------------------------------------------------------------
+ * Send the block size and the signatures of the full blocks of the
+ * server's copy of a file, a group of them at time.
+ *
+ * Parameters:
+ * 		fd			the descriptor of the server's copy (-1 if none)
+ * 		block_size	the size of the blocks
+ * 		nblocks		the number of full blocks
+ */
+void send_signatures(int fd, uint32_t block_size, uint32_t nblocks)
+{
+    struct block_sig sigs[256];
+    uint8_t *block;
+    uint32_t i, n = 0;
+
+    rdt_send(&block_size, sizeof(block_size));
+    rdt_send(&nblocks, sizeof(nblocks));
+
+    block = malloc(block_size);
+    if (!block)
+        handle_error("malloc() - allocating DPUT block");
+
+    for (i = 0; i < nblocks; i++) {
+        if (readn(fd, block, block_size) == -1)
+            handle_error("readn() - reading DPUT blocks");
+        sigs[n].weak = delta_weak(block, block_size);
+        sigs[n].strong = delta_strong(block, block_size, 0);
+        if (++n == sizeof(sigs) / sizeof(sigs[0])) {
+            rdt_send(sigs, sizeof(sigs));
+            n = 0;
+        }
+    }
+    if (n)
+        rdt_send(sigs, n * sizeof(sigs[0]));
+
+    free(block);
+}
+
+
+
+/*
+ * Function:	file_digest
+ * ---------------------------------------------------------------
+ * Calculate the delta_digest of a file reading it from the
+ * beginning.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error
+ */
+int file_digest(int fd, uint64_t size, uint64_t * digest)
+{
+    uint8_t *chunk;
+    uint64_t offset;
+    ssize_t n;
+
+    chunk = malloc(DELTA_DIGEST_CHUNK);
+    if (!chunk)
+        return -1;
+
+    *digest = 0;
+    for (offset = 0; offset < size; offset += n) {
+        n = preadn(fd, chunk, DELTA_DIGEST_CHUNK, offset);
+        if (n <= 0) {
+            free(chunk);
+            return -1;
+        }
+        *digest = delta_strong(chunk, n, *digest);
+    }
+
+    free(chunk);
+    return 0;
+}
+
+
+
+/*
+ * Function:	srv_dput
+ * ---------------------------------------------------------------
+ * Receive a file as a delta from the server's copy: send the block
+ * signatures of the copy, rebuild the new file into a temporary file
+ * from the literal data and the referenced blocks, check the digest
+ * of the whole file and replace the copy.
+ * On local errors the delta is still consumed to keep the stream
+ * aligned, and the failure is reported at the end.
+ */
+void srv_dput(void)
+{
+    struct stat st;
+    char filename[MAXLINE];
+    char tmpname[MAXLINE + 8];
+    uint8_t buffer[MAX_BUFSIZE];
+    uint8_t *block;
+    uint8_t op, outcome;
+    uint16_t len;
+    uint32_t block_size, nblocks, count, i;
+    uint64_t file_size, first, written = 0, digest, local_digest;
+    int oldfd, fd;
+    bool failed = false, closed = false;
+
+
+    /* read filename */
+    if (rdt_read_string(filename, MAXLINE) <= 0)
+        handle_error("rdt_read_string() - reading DPUT filename");
+    fprintf(stderr, "filename: %s\n", filename);
+
+    /* open the server's copy, if any */
+    oldfd = open(filename, O_RDONLY);
+    if (oldfd == -1 || fstat(oldfd, &st) == -1) {
+        st.st_size = 0;
+        st.st_mode = 0644;
+    }
+    block_size = delta_block_size(st.st_size);
+    nblocks = st.st_size / block_size;
+
+    send_signatures(oldfd, block_size, nblocks);
+
+    /* create the temporary file in the same directory */
+    if (recv_exact(&file_size, sizeof(file_size)) == -1) {
+        if (oldfd != -1 && close(oldfd) == -1)
+            handle_error("close() - closing DPUT file");
+        fputs("DPUT: connection closed\n", stderr);
+        return;
+    }
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+    fd = mkstemp(tmpname);
+    if (fd == -1 || fchmod(fd, st.st_mode & 0777) == -1) {
+        perror("mkstemp() - creating DPUT temporary file");
+        failed = true;
+    }
+
+    block = malloc(block_size);
+    if (!block)
+        handle_error("malloc() - allocating DPUT block");
+
+    /* apply the delta operations */
+    for (;;) {
+
+        if (recv_exact(&op, sizeof(op)) == -1) {
+            closed = true;
+            break;
+        }
+
+        if (op == DELTA_END)
+            break;
+
+        if (op == DELTA_LITERAL) {
+            if (recv_exact(&len, sizeof(len)) == -1) {
+                closed = true;
+                break;
+            }
+            if (len > MAX_BUFSIZE) {
+                errno = EPROTO;
+                handle_error("srv_dput() - invalid literal length");
+            }
+            if (recv_exact(buffer, len) == -1) {
+                closed = true;
+                break;
+            }
+            if (!failed && writen(fd, buffer, len) == -1)
+                failed = true;
+            written += len;
+            continue;
+        }
+
+        if (op == DELTA_COPY) {
+            if (recv_exact(&first, sizeof(first)) == -1
+                || recv_exact(&count, sizeof(count)) == -1) {
+                closed = true;
+                break;
+            }
+            if (first > nblocks || count > nblocks - first) {
+                errno = EPROTO;
+                handle_error("srv_dput() - invalid block reference");
+            }
+            for (i = 0; i < count && !failed; i++)
+                if (preadn(oldfd, block, block_size,
+                           (first + i) * block_size) != block_size
+                    || writen(fd, block, block_size) == -1)
+                    failed = true;
+            written += (uint64_t) count * block_size;
+            continue;
+        }
+
+        errno = EPROTO;
+        handle_error("srv_dput() - invalid delta operation");
+    }
+    if (!closed && recv_exact(&digest, sizeof(digest)) == -1)
+        closed = true;
+    free(block);
+    failed |= closed;
+
+    /* check the rebuilt file */
+    if (!failed && (written != file_size
+                    || file_digest(fd, file_size, &local_digest) == -1
+                    || local_digest != digest)) {
+        fputs("DPUT: rebuilt file does not match\n", stderr);
+        failed = true;
+    }
+
+    if (!failed && rename(tmpname, filename) == -1) {
+        perror("rename() - replacing DPUT file");
+        failed = true;
+    }
+    if (failed && fd != -1)
+        unlink(tmpname);
+
+    if (fd != -1 && close(fd) == -1)
+        handle_error("close() - closing DPUT temporary file");
+    if (oldfd != -1 && close(oldfd) == -1)
+        handle_error("close() - closing DPUT file");
+
+    if (closed) {
+        fputs("DPUT: connection closed\n", stderr);
+        return;
+    }
+
+    fprintf(stderr, "file size: %" PRIu64 "\n", file_size);
+    outcome = failed ? PUT_FAILURE : PUT_SUCCESS;
+    rdt_send(&outcome, sizeof(outcome));
+}
@@ -3,10 +3,14 @@
 
 #include "basic.h"
 
-uint8_t recvcmd(void);
+int recvcmd(void);
 void srv_list(void);
+void srv_listx(void);
 void srv_get(void);
 void srv_put(void);
+void srv_rget(void);
+void srv_rput(void);
+void srv_dput(void);
 
 
 #endif /* _SRVCMD_H */
@@ -84,3 +84,18 @@ uint8_t strtoloss(const char *arg)
     /* loss <= 100 < 2^8 : no loss of data after the cast */
     return (uint8_t) loss;
 }
+
+
+
+size_t strtocache(const char *arg)
+{
+    unsigned long mib = argtoul(arg);
+
+    if (mib > MAX_CACHE) {
+        fprintf(stderr,
+                "Cache size (MiB) '%lu' out of range [0, %d]\n",
+                mib, MAX_CACHE);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t) mib << 20;
+}
@@ -3,6 +3,7 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
 
 
 #define MIN_PORT 	49152
@@ -12,12 +13,15 @@
 #define MAX_WIDTH	127
 #define MIN_TIMEOUT	250
 #define MAX_TIMEOUT	3000
+#define MAX_CACHE	4096
 
 
+unsigned long argtoul(const char *arg);
 uint16_t strtoport(const char *arg);
 uint16_t strtotimeout(const char *arg);
 uint8_t strtowidth(const char *arg);
 uint8_t strtoloss(const char *arg);
+size_t strtocache(const char *arg);
 
 
 #endif /* _STRTO_H */
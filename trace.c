@@ -0,0 +1,272 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* a thread's ring, written only by its owner */
+struct trace_ring {
+    struct trace_ring *next;    // registry link
+    uint32_t tid;
+    uint32_t idle;              // owner exited: free for a new thread
+    uint64_t head;              // events recorded so far
+    struct trace_event ev[TRACE_EVENTS];
+};
+
+
+bool trace_on;
+
+struct trace_ring *trace_rings;         // registry of the process' rings
+__thread struct trace_ring *trace_mine;
+pthread_key_t trace_key;                // retires the ring at thread exit
+char trace_path[PATH_MAX];
+
+
+
+/*
+ * Function:	trace_ring_retire
+ * --------------------------------------------------
+ * Destructor of trace_key: hand the ring of an exiting thread over
+ * to the next thread that starts tracing. It stays in the registry,
+ * so that its events are dumped until then.
+ */
+void trace_ring_retire(void *p)
+{
+    struct trace_ring *ring = p;
+
+    __atomic_store_n(&ring->idle, 1, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ * Function:	trace_ring_new
+ * --------------------------------------------------
+ * Get the ring of the calling thread: the ring of an exited thread
+ * if there is one, otherwise a new ring published in the registry
+ * (lock free push). The registry never shrinks, as a dump may walk
+ * it from a signal handler: it holds as many rings as the threads
+ * that ever ran at the same time.
+ */
+struct trace_ring *trace_ring_new(void)
+{
+    struct trace_ring *ring;
+    uint32_t idle;
+
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring;
+         ring = ring->next) {
+        idle = 1;
+        if (__atomic_compare_exchange_n(&ring->idle, &idle, 0, false,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ring) {
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+        ring->tid = syscall(SYS_gettid);
+    } else {
+        if (!(ring = calloc(1, sizeof(*ring))))
+            return NULL;
+        ring->tid = syscall(SYS_gettid);
+
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next,
+                                            ring, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+
+    if (pthread_setspecific(trace_key, ring) != 0) {
+        __atomic_store_n(&ring->idle, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    return ring;
+}
+
+
+
+/*
+ * Function:	trace_record
+ * --------------------------------------------------
+ * Append an event to the ring of the calling thread, overwriting
+ * the oldest one when the ring is full. No locks, no syscalls
+ * (the clock is read through the vDSO).
+ */
+void trace_record(uint8_t type, uint8_t seqnum, uint16_t size,
+                  uint32_t arg)
+{
+    struct trace_ring *ring = trace_mine;
+    struct trace_event *ev;
+    struct timespec now;
+    uint64_t head;
+
+    if (!ring && !(ring = trace_mine = trace_ring_new()))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    head = ring->head;
+    ev = ring->ev + (head & (TRACE_EVENTS - 1));
+    ev->ts = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    ev->type = type;
+    ev->seqnum = seqnum;
+    ev->size = size;
+    ev->arg = arg;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+
+int trace_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t w;
+
+    while (len > 0) {
+        if ((w = write(fd, p, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	trace_dump
+ * --------------------------------------------------
+ * Write the content of all the rings to the dump file.
+ * Async-signal-safe. Events recorded while dumping may be
+ * torn: the dump of a live process is a best effort.
+ */
+void trace_dump(void)
+{
+    struct trace_ring *ring;
+    struct trace_block blk;
+    uint64_t head, first, n;
+    int fd, saved = errno;
+
+    if (!trace_on)
+        return;
+
+    fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        goto out;
+
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring;
+         ring = ring->next) {
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        blk.count = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+        blk.dropped = head - blk.count;
+        blk.magic = TRACE_MAGIC;
+        blk.version = TRACE_VERSION;
+        blk.event_size = sizeof(struct trace_event);
+        blk.pid = getpid();
+        blk.tid = ring->tid;
+
+        if (trace_write(fd, &blk, sizeof(blk)) == -1)
+            break;
+
+        /* oldest events first, the ring may wrap */
+        first = blk.dropped & (TRACE_EVENTS - 1);
+        n = TRACE_EVENTS - first < blk.count ? TRACE_EVENTS - first
+            : blk.count;
+        if (trace_write(fd, ring->ev + first, n * sizeof(*ring->ev)) == -1
+            || trace_write(fd, ring->ev,
+                           (blk.count - n) * sizeof(*ring->ev)) == -1)
+            break;
+    }
+
+    close(fd);
+  out:
+    errno = saved;
+}
+
+
+
+void trace_sig_handler(int sig)
+{
+    trace_dump();
+
+    /* terminating signal: die as it would have done */
+    if (sig != SIGUSR2) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+
+
+/*
+ * Function:	trace_init
+ * --------------------------------------------------
+ * Enable the tracer if the RUDP_TRACE environment variable holds
+ * a file prefix. The rings are dumped to <prefix>.<pid> on SIGUSR2,
+ * at exit and when SIGINT or SIGTERM (if not handled) kill the process.
+ */
+void trace_init(void)
+{
+    int fatal[] = { SIGINT, SIGTERM }, i;
+    char *prefix = getenv(TRACE_ENV);
+    struct sigaction sa, old;
+
+    if (!prefix || !*prefix || trace_on)
+        return;
+
+    if (snprintf(trace_path, sizeof(trace_path), "%s.%d", prefix,
+                 (int) getpid()) >= (int) sizeof(trace_path)) {
+        fprintf(stderr, "%s: prefix too long\n", TRACE_ENV);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_sig_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < (int) (sizeof(fatal) / sizeof(*fatal)); i++) {
+        if (sigaction(fatal[i], NULL, &old) == -1) {
+            perror("sigaction()");
+            exit(EXIT_FAILURE);
+        }
+        if (old.sa_handler == SIG_DFL
+            && sigaction(fatal[i], &sa, NULL) == -1) {
+            perror("sigaction()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pthread_key_create(&trace_key, trace_ring_retire) != 0) {
+        fputs("pthread_key_create(): cannot retire the trace rings\n",
+              stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (atexit(trace_dump) != 0) {
+        fputs("atexit(): cannot register the trace dump\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    trace_on = true;
+}
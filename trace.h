@@ -0,0 +1,65 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_ENV		"RUDP_TRACE"
+#define TRACE_MAGIC		0x43525452  // "RTRC"
+#define TRACE_VERSION	1
+#define TRACE_EVENTS	(1 << 16)   // events kept per thread (power of 2)
+
+
+// event types
+enum trace_type {
+	TR_SEND = 1,                // first transmission of a segment
+	TR_RTX,                     // retransmission (arg: timeout in us)
+	TR_ACK,                     // ack received (arg: 1 if it acked a pending segment)
+	TR_TIMEOUT,                 // retransmission timer fired
+	TR_SLIDE,                   // window moved (seqnum: new base, arg: shift)
+	TR_RECV,                    // segment received (arg: 0 new, 1 duplicate, 2 out of window)
+	TR_DELIVER,                 // segment passed to the application
+	TR_ACK_SENT,                // ack sent by the receiver
+	TR_MAX_TYPE
+};
+
+struct trace_event {
+	uint64_t ts;                // CLOCK_MONOTONIC, ns
+	uint8_t type;
+	uint8_t seqnum;
+	uint16_t size;
+	uint32_t arg;
+};
+
+/*
+ * Dump file layout: a block for every traced thread,
+ * the header followed by count events in time order.
+ */
+struct trace_block {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t event_size;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t count;             // events in the block
+	uint64_t dropped;           // older events overwritten by the ring
+};
+
+
+extern bool trace_on;
+
+/* the disabled tracer costs a predictable branch */
+#define TRACE(type, seqnum, size, arg) \
+	do { \
+		if (__builtin_expect(trace_on, 0)) \
+			trace_record((type), (seqnum), (size), (arg)); \
+	} while (0)
+
+void trace_init(void);
+void trace_record(uint8_t type, uint8_t seqnum, uint16_t size,
+                  uint32_t arg);
+void trace_dump(void);
+
+
+#endif /* _TRACE_H */
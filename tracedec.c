@@ -0,0 +1,167 @@
+#include "trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* a decoded event */
+struct record {
+    uint64_t ts;
+    uint32_t pid;
+    uint32_t tid;
+    int64_t seq;                // sequence number unwrapped across wraps
+    struct trace_event ev;
+};
+
+
+const char *type_names[TR_MAX_TYPE] = {
+    [TR_SEND] = "send",
+    [TR_RTX] = "rtx",
+    [TR_ACK] = "ack",
+    [TR_TIMEOUT] = "timeout",
+    [TR_SLIDE] = "slide",
+    [TR_RECV] = "recv",
+    [TR_DELIVER] = "deliver",
+    [TR_ACK_SENT] = "ack_sent",
+};
+
+
+struct record *records;
+size_t nrecords, cap;
+
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s <dump file>...\n"
+            "Merge " TRACE_ENV " dumps into a time ordered table\n"
+            "(time in ms, unwrapped sequence numbers) for plotting.\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+
+void add_record(struct record *r)
+{
+    struct record *tmp;
+
+    if (nrecords == cap) {
+        cap = cap ? 2 * cap : 4096;
+        if (!(tmp = realloc(records, cap * sizeof(*tmp)))) {
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        records = tmp;
+    }
+    records[nrecords++] = *r;
+}
+
+
+
+/*
+ * Function:	read_dump
+ * --------------------------------------------------
+ * Read the blocks of a dump file. Every block holds the events
+ * of a single thread, whose sequence numbers move by less than
+ * half the sequence space between events: unwrap them there.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on a malformed file
+ */
+int read_dump(const char *path)
+{
+    struct trace_block blk;
+    struct record r;
+    uint64_t i;
+    int8_t step;
+    FILE *f;
+
+    if (!(f = fopen(path, "rb"))) {
+        perror(path);
+        return -1;
+    }
+
+    while (fread(&blk, sizeof(blk), 1, f) == 1) {
+
+        if (blk.magic != TRACE_MAGIC || blk.version != TRACE_VERSION
+            || blk.event_size != sizeof(struct trace_event)) {
+            fprintf(stderr, "%s: not a trace dump\n", path);
+            fclose(f);
+            return -1;
+        }
+        if (blk.dropped)
+            fprintf(stderr, "%s: thread %" PRIu32 ": %" PRIu64
+                    " older events overwritten\n", path, blk.tid,
+                    blk.dropped);
+
+        r.pid = blk.pid;
+        r.tid = blk.tid;
+        r.seq = -1;
+        for (i = 0; i < blk.count; i++) {
+            if (fread(&r.ev, sizeof(r.ev), 1, f) != 1) {
+                fprintf(stderr, "%s: truncated\n", path);
+                fclose(f);
+                return -1;
+            }
+            if (r.seq == -1)
+                r.seq = r.ev.seqnum;
+            else {
+                step = (uint8_t) (r.ev.seqnum - (uint8_t) r.seq);
+                r.seq += step;
+            }
+            r.ts = r.ev.ts;
+            add_record(&r);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+
+
+int record_cmp(const void *x, const void *y)
+{
+    const struct record *a = x, *b = y;
+
+    return (a->ts > b->ts) - (a->ts < b->ts);
+}
+
+
+
+int main(int argc, char **argv)
+{
+    const char *name;
+    uint64_t t0;
+    size_t i;
+    int k;
+
+    if (argc < 2)
+        usage(argv[0]);
+
+    for (k = 1; k < argc; k++)
+        if (read_dump(argv[k]) == -1)
+            exit(EXIT_FAILURE);
+
+    qsort(records, nrecords, sizeof(*records), record_cmp);
+    t0 = nrecords ? records[0].ts : 0;
+
+    puts("# t_ms pid tid event seq seqnum size arg");
+    for (i = 0; i < nrecords; i++) {
+        name = records[i].ev.type < TR_MAX_TYPE
+            && type_names[records[i].ev.type] ?
+            type_names[records[i].ev.type] : "unknown";
+        printf("%.6f %" PRIu32 " %" PRIu32 " %s %" PRId64 " %u %u %"
+               PRIu32 "\n", (records[i].ts - t0) / 1e6, records[i].pid,
+               records[i].tid, name, records[i].seq,
+               records[i].ev.seqnum, records[i].ev.size,
+               records[i].ev.arg);
+    }
+
+    free(records);
+    return 0;
+}
@@ -1,23 +1,56 @@
 #include "transport.h"
 #include "simul_udt.h"
+#include "netem.h"
 #include "window.h"
 #include "queue.h"
 #include "adaptive.h"
 #include "cb_utils.h"
 #include "timespec_utils.h"
+#include "trace.h"
+#include "hist.h"
+#include "handshake.h"
+#include "affinity.h"
+#include "crc32c.h"
+
+#include <sys/random.h>
 
 
 //#define EMPTY_LIMIT   20
 //#define SEND_LIMIT    10
 
 
-/* shared structures */
-struct circular_buffer recv_cb;
-struct circular_buffer send_cb;
-struct event e;
+/* the connection of the calling thread */
+__thread struct rdt_conn *rdt_cur;
+
+/* live connections, for the stats dump */
+struct rdt_conn *conns;
+pthread_mutex_t conns_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* connection counters, updated with relaxed atomics */
+#define STAT_ADD(c, field, v) \
+    __atomic_fetch_add(&(c)->stats.field, (v), __ATOMIC_RELAXED)
+#define STAT_SUB(c, field, v) \
+    __atomic_fetch_sub(&(c)->stats.field, (v), __ATOMIC_RELAXED)
+#define STAT_SET(c, field, v) \
+    __atomic_store_n(&(c)->stats.field, (v), __ATOMIC_RELAXED)
+#define STAT_GET(c, field) \
+    __atomic_load_n(&(c)->stats.field, __ATOMIC_RELAXED)
+
+/* switched by the application while the threads run */
+#define BUSY_POLL_US(c) __atomic_load_n(&(c)->busy_poll, __ATOMIC_RELAXED)
 
-/* threads args to keep alive */
-struct shared_tools recv_tools, send_tools;
+/* bytes after the payload of a segment */
+#define SGT_TAG(c)		((c)->tx_aead ? AEAD_TAG : 0)
+
+#define STATS_ENV	"RUDP_STATS"
+#define IDLE_ENV	"RUDP_IDLE"
+
+/* latency histograms, of all the connections */
+struct hist ack_hist;           // first transmission to ack
+struct hist send_hist;          // time blocked in a rdt_send call
+
+/* setup shared by the connections of the process */
+pthread_once_t transport_once = PTHREAD_ONCE_INIT;
 
 
 
@@ -31,13 +64,481 @@ void fprint_status(FILE * stream, struct window *w)
 
 
 
+/* select the connection of the calling thread */
+void rdt_use(struct rdt_conn *conn)
+{
+    rdt_cur = conn;
+}
+
+
+
+struct rdt_conn *rdt_current(void)
+{
+    return rdt_cur;
+}
+
+
+
+/* the busy poll budget of new connections, from the environment */
+unsigned int busy_poll_default(void)
+{
+    char *env = getenv(BUSY_POLL_ENV), *end;
+    unsigned long usec;
+
+    if (!env || !*env)
+        return 0;
+
+    errno = 0;
+    usec = strtoul(env, &end, 10);
+    if (errno || *end || usec > BUSY_POLL_MAX) {
+        fprintf(stderr, "%s: invalid budget '%s' (0-%d us)\n",
+                BUSY_POLL_ENV, env, BUSY_POLL_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    return usec;
+}
+
+
+
+struct rdt_conn *conn_new(void)
+{
+    struct rdt_conn *c;
+
+    if (!(c = calloc(1, sizeof(*c))))
+        handle_error("calloc() - new connection");
+    c->busy_poll = busy_poll_default();
+
+    return c;
+}
+
+
+
+/*
+ * Function:	rdt_defer_connect
+ * --------------------------------------------------------
+ * Postpone the connection setup: a new connection becomes the one of
+ * the calling thread, the data passed to rdt_send is kept aside
+ * (up to a segment) and the connect function is called by the first
+ * operation that cannot proceed without the peer, so that the setup
+ * can carry the first request. The connect function must start the
+ * transport, then it can get the data with rdt_early_data; it returns
+ * -1 if it could not, and the connection behaves as an expired one.
+ *
+ * Parameters:
+ * 		connect		the setup function
+ * 		arg			its argument
+ */
+void rdt_defer_connect(int (*connect)(void *), void *arg)
+{
+    struct rdt_conn *c = conn_new();
+
+    c->pending_connect = connect;
+    c->connect_arg = arg;
+    rdt_cur = c;
+}
+
+
+
+/* run the postponed setup: a failure expires the connection */
+void connect_now(struct rdt_conn *c)
+{
+    int (*connect)(void *) = c->pending_connect;
+
+    c->pending_connect = NULL;
+    c->connecting = true;
+    rdt_cur = c;
+    if (connect(c->connect_arg) == -1) {
+        c->connecting = false;
+        c->connect_failed = c->expired = c->peer_closed = true;
+    }
+}
+
+
+
+/*
+ * Function:	rdt_early_data
+ * --------------------------------------------------------
+ * Returns:
+ * 		the data sent before the connection setup (NULL if none)
+ */
+const void *rdt_early_data(size_t *len)
+{
+    struct rdt_conn *c = rdt_cur;
+
+    if (!c) {
+        *len = 0;
+        return NULL;
+    }
+    *len = c->early_len;
+    return c->early_len ? c->early_buf : NULL;
+}
+
+
+
+/*
+ * Function:	rdt_inject
+ * --------------------------------------------------------
+ * Hand to the application data received out of the stream, ahead of
+ * the first segment (the request carried by the connection setup).
+ *
+ * Parameters:
+ * 		buf		the data
+ * 		len		its size (at most MSS)
+ */
+void rdt_inject(const void *buf, size_t len)
+{
+    struct rdt_conn *c = rdt_cur;
+
+    if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    memcpy_tocb(c->recv_cb.buf, buf, len, c->recv_cb.E, CBUF_SIZE);
+    c->recv_cb.E = (c->recv_cb.E + len) % CBUF_SIZE;
+
+    if (pthread_cond_signal(&c->recv_cb.cnd_not_empty) != 0)
+        handle_error("pthread_cond_signal");
+    if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+}
+
+
+
+/* true once a datagram arrived from the peer */
+bool rdt_peer_heard(void)
+{
+    struct rdt_conn *c = rdt_cur;
+
+    return __atomic_load_n(&c->peer_heard, __ATOMIC_RELAXED);
+}
+
+
+
+/* true if the peer went silent for the idle timeout: only rdt_close helps */
+bool rdt_expired(void)
+{
+    struct rdt_conn *c = rdt_cur;
+
+    return __atomic_load_n(&c->expired, __ATOMIC_RELAXED);
+}
+
+
+
+/* the current address of the peer of a roaming connection */
+void peer_addr(struct rdt_conn *c, struct sockaddr_in *addr)
+{
+    uint64_t peer = __atomic_load_n(&c->peer, __ATOMIC_RELAXED);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t) (peer >> 16);
+    addr->sin_port = (uint16_t) peer;
+}
+
+
+
+uint64_t pack_peer(struct sockaddr_in *addr)
+{
+    return (uint64_t) addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+
+
+/*
+ * Function:	conn_send_to
+ * --------------------------------------------------------
+ * Send a datagram of the connection: to the connected address,
+ * or, if the connection roams, to the given one (NULL: the last
+ * address of the peer that was validated).
+ */
+ssize_t conn_send_to(struct rdt_conn *c, const void *buf, size_t len,
+                     struct sockaddr_in *to, double loss)
+{
+    struct sockaddr_in addr;
+
+    if (!c->roaming)
+        return udt_sendto(c->sockfd, buf, len, NULL, 0, loss);
+
+    if (!to) {
+        peer_addr(c, &addr);
+        to = &addr;
+    }
+    return udt_sendto(c->sockfd, buf, len, (struct sockaddr *) to,
+                      sizeof(*to), loss);
+}
+
+
+
+ssize_t conn_send(struct rdt_conn *c, const void *buf, size_t len,
+                  double loss)
+{
+    return conn_send_to(c, buf, len, NULL, loss);
+}
+
+
+
+/*
+ * Function:	conn_send_ctl
+ * --------------------------------------------------------
+ * Send an ack, a control datagram or a path probe (to, as in
+ * conn_send_to). A sealed connection appends the next counter and
+ * a tag over both: the counter picks a nonce outside the ones of
+ * the segments, and lets the peer drop replays.
+ */
+ssize_t conn_send_ctl(struct rdt_conn *c, const void *buf, size_t len,
+                      struct sockaddr_in *to, double loss)
+{
+    uint8_t sealed[sizeof(struct probe) + CTL_CTR_SIZE + AEAD_TAG];
+    uint32_t ctr;
+
+    if (!c->ctl_aead)
+        return conn_send_to(c, buf, len, to, loss);
+
+    if (pthread_mutex_lock(&c->ctl_mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    if ((ctr = ++c->ctl_tx_ctr) == 0) {
+        errno = EOVERFLOW;
+        handle_error("conn_send_ctl() - control nonces exhausted");
+    }
+    memcpy(sealed, buf, len);
+    ctr = htonl(ctr);
+    memcpy(sealed + len, &ctr, CTL_CTR_SIZE);
+    aead_seal(c->ctl_aead, CTL_NONCE | ntohl(ctr), sealed,
+              len + CTL_CTR_SIZE, sealed + len + CTL_CTR_SIZE, 0);
+    if (pthread_mutex_unlock(&c->ctl_mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    return conn_send_to(c, sealed, len + CTL_CTR_SIZE + AEAD_TAG, to, loss);
+}
+
+
+
+/*
+ * Function:	send_control
+ * --------------------------------------------------
+ * Send a control datagram (FIN, FIN_ACK or keepalive), to the
+ * given address as in conn_send_to.
+ */
+void send_control(struct rdt_conn *c, uint8_t type, uint8_t arg,
+                  struct sockaddr_in *to, double loss)
+{
+    struct control ctl;
+
+    memcpy(ctl.cid, &c->cid, CID_SIZE);
+    ctl.type = type;
+    ctl.arg = arg;
+    if (conn_send_ctl(c, &ctl, sizeof(ctl), to, loss) == -1)
+        handle_error("conn_send() - sending control datagram");
+}
+
+
+
+/*
+ * Function:	send_probe
+ * --------------------------------------------------
+ * Send a path challenge or its response to the given address.
+ */
+void send_probe(struct rdt_conn *c, uint8_t type, const uint8_t *data,
+                struct sockaddr_in *to, double loss)
+{
+    struct probe probe;
+
+    memcpy(probe.cid, &c->cid, CID_SIZE);
+    probe.type = type;
+    memcpy(probe.data, data, PROBE_SIZE);
+    if (conn_send_ctl(c, &probe, sizeof(probe), to, loss) == -1)
+        handle_error("conn_send() - sending path probe");
+}
+
+
+/*
+ * Function:	rdt_confirm
+ * --------------------------------------------------------
+ * Tell the peer that the connection is up, with a datagram holding
+ * only the connection ID (it stops the retransmissions of the
+ * SYN_ACK). A sealed connection sends a keepalive instead, whose tag
+ * proves that the keys were derived.
+ */
+void conn_confirm(struct rdt_conn *c)
+{
+    if (c->ctl_aead) {
+        send_control(c, CTL_KEEPALIVE, 0, NULL, c->params.P / 100.0);
+        return;
+    }
+    if (conn_send(c, &c->cid, CID_SIZE, c->params.P / 100.0) == -1)
+        handle_error("conn_send() - confirming the connection");
+}
+
+
+
+void rdt_confirm(void)
+{
+    conn_confirm(rdt_cur);
+}
+
+
+
+
+void stat_clock(struct timespec *ts)
+{
+    if (clock_gettime(CLOCK_MONOTONIC, ts) == -1)
+        handle_error("clock_gettime()");
+}
+
+
+
+/* nanoseconds elapsed since t0 */
+uint64_t stat_elapsed(struct timespec *t0)
+{
+    struct timespec now, elapsed;
+
+    stat_clock(&now);
+    timespec_sub(&elapsed, &now, t0);
+    return tstonsec(&elapsed);
+}
+
+
+
+
+/* the socket side of the busy poll mode; best effort */
+void set_busy_poll(struct rdt_conn *c)
+{
+    int usec = c->busy_poll;
+
+    if (setsockopt(c->sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+                   sizeof(usec)) == -1 && usec)
+        fprintf(stderr, "SO_BUSY_POLL: %s, spinning only\n",
+                strerror(errno));
+}
+
+
+
+/*
+ * Function:	spin_while
+ * --------------------------------------------------------
+ * Busy poll mode: spin while a word shared with another thread keeps
+ * its value, up to the connection's budget. The pause between two
+ * reads doubles up to a bound, to spare the sibling hyperthread and
+ * the cache line without adding much latency; past the bound the
+ * CPU is yielded at every round, in case the writer is waiting for
+ * it.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		word	the word, read without its lock
+ * 		value	the value to wait a change of
+ *
+ * Returns:
+ * 		true	if the word changed
+ * 		false	if the budget ran out
+ */
+bool spin_while(struct rdt_conn *c, unsigned int *word, unsigned int value)
+{
+    struct timespec t0;
+    unsigned int i, pause = 1;
+
+    stat_clock(&t0);
+    for (;;) {
+        for (i = 0; i < pause; i++) {
+            if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value)
+                return true;
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        if (pause < 64)
+            pause *= 2;
+        else
+            sched_yield();      // the writer may need this CPU
+        if (stat_elapsed(&t0) >= BUSY_POLL_US(c) * 1000ULL)
+            return false;
+    }
+}
+
+
+
+/*
+ * Function:	wait_not_empty
+ * --------------------------------------------------------
+ * Wait for data in the receive buffer (or the end of the stream),
+ * spinning first in busy poll mode. Called with the lock of the
+ * buffer held. A client starved for twice the initial timeout sends
+ * a keepalive: after a NAT rebinding it tells the server the new
+ * address, which the acks of the missing segments never would.
+ */
+void wait_not_empty(struct rdt_conn *c)
+{
+    struct circular_buffer *cb = &c->recv_cb;
+    unsigned int E = cb->E;
+    struct timespec now, stall, deadline;
+    int ret;
+
+    if (BUSY_POLL_US(c)) {
+        if (pthread_mutex_unlock(&cb->mtx) != 0)
+            handle_error("pthread_mutex_unlock");
+        spin_while(c, &cb->E, E);
+        if (pthread_mutex_lock(&cb->mtx) != 0)
+            handle_error("pthread_mutex_lock");
+        if (cb->E != E || c->peer_closed)
+            return;
+    }
+
+    /* the server (roaming) waits for the commands as long as needed */
+    if (c->roaming) {
+        if (pthread_cond_wait(&cb->cnd_not_empty, &cb->mtx) != 0)
+            handle_error("pthread_cond_wait");
+        return;
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+        handle_error("clock_gettime()");
+    nsectots(&stall, (long long) c->params.T * 2000000);
+    timespec_add(&deadline, &now, &stall);
+
+    ret = pthread_cond_timedwait(&cb->cnd_not_empty, &cb->mtx, &deadline);
+    if (ret == ETIMEDOUT)
+        send_control(c, CTL_KEEPALIVE, 0, NULL, c->params.P / 100.0);
+    else if (ret != 0)
+        handle_error("pthread_cond_timedwait");
+}
+
+
+
+/*
+ * Function:	rdt_busy_poll
+ * --------------------------------------------------------
+ * Trade CPU for latency on the connection of the calling thread:
+ * the socket is busy polled by the kernel (SO_BUSY_POLL, where the
+ * NIC driver and the net.core.busy_read limit allow it) and the
+ * threads waiting for data or acks spin before blocking. New
+ * connections take the budget from RUDP_BUSY_POLL.
+ *
+ * Parameters:
+ * 		usec	the spin budget in microseconds (0 turns it off)
+ */
+void rdt_busy_poll(unsigned int usec)
+{
+    struct rdt_conn *c = rdt_cur;
+
+    if (usec > BUSY_POLL_MAX)
+        usec = BUSY_POLL_MAX;
+    __atomic_store_n(&c->busy_poll, usec, __ATOMIC_RELAXED);
+
+    /* a postponed connection gets the socket option when it starts */
+    if (!c->pending_connect && !c->connect_failed)
+        set_busy_poll(c);
+}
+
+
+
 /*
  * Function:	rdt_send
  * ----------------------------------------------------------
  * Put data into the shared sending circular buffer, checking how
- * much space is available, and put MSS multiples each time, in order
- * to let the sender service to create as full as possible packets.
- * If at least MSS bytes are not available, wait until there is enough
+ * much space is available, and put multiples of the current segment
+ * size each time, in order to let the sender service to create as full
+ * as possible packets.
+ * If at least a segment is not available, wait until there is enough
  * free space.
  *
  * Parameters:
@@ -46,36 +547,71 @@ void fprint_status(FILE * stream, struct window *w)
  */
 void rdt_send(const void *buf, size_t len)
 {
-    size_t free, tosend, left = len;
+    struct rdt_conn *c = rdt_cur;
+    size_t free, tosend, left = len, mss;
+    struct timespec t0;
+    uint64_t blocked_ns = 0;
+    bool blocked;
+
+    if (c->pending_connect) {
+        if (c->early_len + len <= sizeof(c->early_buf)) {
+            memcpy(c->early_buf + c->early_len, buf, len);
+            c->early_len += len;
+            return;
+        }
+        connect_now(c);
+    }
+    if (c->connect_failed)
+        return;
 
     while (left) {
 
-        if (pthread_mutex_lock(&send_cb.mtx) != 0)
+        if (pthread_mutex_lock(&c->send_cb.mtx) != 0)
             handle_error("pthread_mutex_lock");
 
         /* check available space */
-        while ((free =
-                space_available(send_cb.S, send_cb.E, CBUF_SIZE)) <= MSS)
-            if (pthread_cond_wait(&send_cb.cnd_not_full, &send_cb.mtx) !=
-                0)
+        mss = __atomic_load_n(&c->mss, __ATOMIC_RELAXED);
+        blocked = false;
+        while ((free = space_available(c->send_cb.S, c->send_cb.E,
+                                       CBUF_SIZE)) <= mss
+               && !__atomic_load_n(&c->expired, __ATOMIC_RELAXED)) {
+            if (!blocked) {
+                stat_clock(&t0);
+                blocked = true;
+            }
+            if (pthread_cond_wait(&c->send_cb.cnd_not_full, &c->send_cb.mtx)
+                != 0)
                 handle_error("pthread_cond_wait");
+        }
+        if (blocked)
+            blocked_ns += stat_elapsed(&t0);
+
+        /* nobody to send it to */
+        if (__atomic_load_n(&c->expired, __ATOMIC_RELAXED)) {
+            if (pthread_mutex_unlock(&c->send_cb.mtx) != 0)
+                handle_error("pthread_mutex_unlock");
+            break;
+        }
 
-        /* calculate how much data to send */
-        tosend = free > left ? left : (free / MSS) * MSS;
+        /* calculate how much data to send (a full buffer looks empty) */
+        tosend = free > left ? left : ((free - 1) / mss) * mss;
 
-        memcpy_tocb(send_cb.buf, buf + len - left, tosend, send_cb.E,
-                    CBUF_SIZE);
+        memcpy_tocb(c->send_cb.buf, buf + len - left, tosend,
+                    c->send_cb.E, CBUF_SIZE);
 
-        send_cb.E = (send_cb.E + tosend) % CBUF_SIZE;
+        c->send_cb.E = (c->send_cb.E + tosend) % CBUF_SIZE;
 
-        if (pthread_mutex_unlock(&send_cb.mtx) != 0)
+        if (pthread_mutex_unlock(&c->send_cb.mtx) != 0)
             handle_error("pthread_mutex_unlock");
 
-        if (cond_event_signal(&e, PKT_EVENT) == -1)
+        if (cond_event_signal(&c->e, PKT_EVENT) == -1)
             handle_error("cond_event_signal()");
 
         left -= tosend;
     }
+
+    STAT_ADD(c, send_blocked_ns, blocked_ns);
+    hist_record(&send_hist, blocked_ns);
 }
 
 
@@ -91,37 +627,54 @@ void rdt_send(const void *buf, size_t len)
  * Parameters:
  * 		buf:	the address of the buffer wherein put data
  * 		len:	the number of bytes to draw from the buffer
+ *
+ * Returns:
+ * 		len, less if the peer closed the connection (0 at the end
+ * 		of the stream)
  */
-void rdt_recv(void *buf, size_t len)
+size_t rdt_recv(void *buf, size_t len)
 {
+    struct rdt_conn *c = rdt_cur;
     size_t data, toread, left = len;
 
+    if (c->pending_connect)
+        connect_now(c);
+    if (c->connect_failed)
+        return 0;
+
     while (left) {
 
-        if (pthread_mutex_lock(&recv_cb.mtx) != 0)
+        if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
             handle_error("pthread_mutex_lock");
 
-        while (recv_cb.S == recv_cb.E)
+        while (c->recv_cb.S == c->recv_cb.E && !c->peer_closed)
             /* circular buffer is empty */
-            if (pthread_cond_wait(&recv_cb.cnd_not_empty, &recv_cb.mtx) !=
-                0)
-                handle_error("pthread_cond_wait");
+            wait_not_empty(c);
+
+        if (c->recv_cb.S == c->recv_cb.E) {
+            /* end of the stream */
+            if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+                handle_error("pthread_mutex_unlock");
+            break;
+        }
 
         /* circular buffer not empty */
-        data = data_available(recv_cb.S, recv_cb.E, CBUF_SIZE);
+        data = data_available(c->recv_cb.S, c->recv_cb.E, CBUF_SIZE);
         toread = data < left ? data : left;
-        memcpy_fromcb(buf + len - left, recv_cb.buf, toread, recv_cb.S,
+        memcpy_fromcb(buf + len - left, c->recv_cb.buf, toread, c->recv_cb.S,
                       CBUF_SIZE);
-        recv_cb.S = (recv_cb.S + toread) % CBUF_SIZE;
+        c->recv_cb.S = (c->recv_cb.S + toread) % CBUF_SIZE;
 
-        if (pthread_cond_signal(&recv_cb.cnd_not_full) != 0)
+        if (pthread_cond_signal(&c->recv_cb.cnd_not_full) != 0)
             handle_error("pthread_cond_signal");
 
-        if (pthread_mutex_unlock(&recv_cb.mtx) != 0)
+        if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
             handle_error("pthread_mutex_unlock");
 
         left -= toread;
     }
+
+    return len - left;
 }
 
 
@@ -139,32 +692,43 @@ void rdt_recv(void *buf, size_t len)
  *
  * Returns:
  * 		the number of read characters
- * 		0 if nothing was read
+ * 		0 if nothing was read (the peer closed the connection)
  * 		-1 on error
  */
 ssize_t rdt_read_string(char *buf, size_t maxlen)
 {
+    struct rdt_conn *c = rdt_cur;
     unsigned int i;
     char *p = buf;
 
+    if (c->pending_connect)
+        connect_now(c);
+    if (c->connect_failed)
+        return 0;
+
     for (i = 0; i < maxlen; i++) {
 
-        if (pthread_mutex_lock(&recv_cb.mtx) != 0)
+        if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
             handle_error("pthread_mutex_lock");
 
-        while (recv_cb.S == recv_cb.E)
+        while (c->recv_cb.S == c->recv_cb.E && !c->peer_closed)
             /* circular buffer empty */
-            if (pthread_cond_wait(&recv_cb.cnd_not_empty, &recv_cb.mtx) !=
-                0)
-                handle_error("pthread_cond_wait");
+            wait_not_empty(c);
+
+        if (c->recv_cb.S == c->recv_cb.E) {
+            /* end of the stream */
+            if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+                handle_error("pthread_mutex_unlock");
+            break;
+        }
 
-        *p = recv_cb.buf[recv_cb.S];
-        recv_cb.S = (recv_cb.S + 1) % CBUF_SIZE;
+        *p = c->recv_cb.buf[c->recv_cb.S];
+        c->recv_cb.S = (c->recv_cb.S + 1) % CBUF_SIZE;
 
-        if (pthread_cond_signal(&recv_cb.cnd_not_full) != 0)
+        if (pthread_cond_signal(&c->recv_cb.cnd_not_full) != 0)
             handle_error("pthread_cond_signal");
 
-        if (pthread_mutex_unlock(&recv_cb.mtx) != 0)
+        if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
             handle_error("pthread_mutex_unlock");
 
         if (*p == '\0')
@@ -179,13 +743,272 @@ ssize_t rdt_read_string(char *buf, size_t maxlen)
 
 
 
+/*
+ * Function:	rdt_get_params
+ * --------------------------------------------------------
+ * Get the parameters the connection was initialized with.
+ *
+ * Returns:
+ * 		the address of the protocol's parameters
+ */
+struct proto_params *rdt_get_params(void)
+{
+    return &rdt_cur->params;
+}
+
+
+
+
+/*
+ * Function:	conn_get_stats
+ * --------------------------------------------------------
+ * Take a snapshot of the counters of a connection.
+ * Each counter is read atomically, but the snapshot as a whole
+ * is not taken at a single instant.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		stats	where to store the snapshot
+ */
+void conn_get_stats(struct rdt_conn *c, struct rdt_stats *stats)
+{
+    uint64_t *dst = (uint64_t *) stats, *src = (uint64_t *) & c->stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+
+    /* buffers' occupancy */
+    if (pthread_mutex_lock(&c->send_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    stats->send_cb_bytes =
+        data_available(c->send_cb.S, c->send_cb.E, CBUF_SIZE);
+    if (pthread_mutex_unlock(&c->send_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    stats->recv_cb_bytes =
+        data_available(c->recv_cb.S, c->recv_cb.E, CBUF_SIZE);
+    if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    stats->mss = __atomic_load_n(&c->mss, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Function:	rdt_get_stats
+ * --------------------------------------------------------
+ * Take a snapshot of the counters of the current connection.
+ *
+ * Parameters:
+ * 		stats	where to store the snapshot
+ */
+void rdt_get_stats(struct rdt_stats *stats)
+{
+    conn_get_stats(rdt_cur, stats);
+}
+
+
+
+
+/*
+ * Function:	rdt_fprint_stats
+ * --------------------------------------------------------
+ * Print a snapshot of the counters on a single line of
+ * key=value pairs (times in microseconds).
+ */
+void rdt_fprint_stats(FILE * stream, struct rdt_stats *st)
+{
+    fprintf(stream,
+            "rdt_stats pid=%d conn=%" PRIu64 " sent=%" PRIu64 " rtx=%"
+            PRIu64 " acked=%" PRIu64 " acks_rcvd=%" PRIu64 " bytes_sent=%"
+            PRIu64 " timer_queue=%" PRIu64 " send_cb=%" PRIu64
+            " send_blocked_us=%" PRIu64 " rtt_min_us=%" PRIu64 " srtt_us=%"
+            PRIu64 " rttvar_us=%" PRIu64 " rto_us=%" PRIu64 " segs_rcvd=%"
+            PRIu64 " dup_segs=%" PRIu64 " bad_segs=%" PRIu64
+            " bytes_delivered=%" PRIu64 " recv_cb=%" PRIu64
+            " deliver_blocked_us=%" PRIu64 " mss=%" PRIu64 " moves=%"
+            PRIu64 "\n",
+            (int) getpid(), st->conn, st->sent, st->rtx, st->acked,
+            st->acks_rcvd, st->bytes_sent, st->timer_queue,
+            st->send_cb_bytes, st->send_blocked_ns / 1000,
+            st->rtt_min / 1000, st->srtt / 1000, st->rttvar / 1000,
+            st->rto / 1000, st->segs_rcvd, st->dup_segs, st->bad_segs,
+            st->bytes_delivered, st->recv_cb_bytes,
+            st->deliver_blocked_ns / 1000, st->mss, st->moves);
+}
+
+
+
+
+/*
+ * Function:	stats_service
+ * --------------------------------------------------------
+ * Dump the counters of the live connections on stderr every interval.
+ *
+ * Parameters:
+ * 		p:		the address of the interval
+ */
+void *stats_service(void *p)
+{
+    struct timespec *interval = p;
+    struct rdt_stats st;
+    struct rdt_conn *c;
+
+    for (;;) {
+        while (nanosleep(interval, NULL) == -1 && errno == EINTR);
+
+        if (pthread_mutex_lock(&conns_mtx) != 0)
+            handle_error("pthread_mutex_lock");
+        for (c = conns; c; c = c->next) {
+            conn_get_stats(c, &st);
+            rdt_fprint_stats(stderr, &st);
+        }
+        if (pthread_mutex_unlock(&conns_mtx) != 0)
+            handle_error("pthread_mutex_unlock");
+    }
+
+    return NULL;
+}
+
+
+
+
+/*
+ * Function:	update_mss
+ * --------------------------------------------------------
+ * Size the new segments after the path MTU known by the kernel
+ * (from the route and from ICMP "fragmentation needed" messages),
+ * within the limit agreed with the peer. Segments already made
+ * keep their size: the kernel fragments them if needed.
+ * IP_MTU needs a connected socket: a roaming connection keeps a
+ * scratch one (made by init_mss), connected again only when the
+ * peer moved, so that a retransmission timeout costs one query.
+ *
+ * Parameters:
+ * 		c		the connection
+ */
+void update_mss(struct rdt_conn *c)
+{
+    socklen_t len = sizeof(int);
+    struct sockaddr_in addr;
+    uint64_t peer;
+    size_t mss;
+    int mtu, sd = c->sockfd;
+
+    if (c->roaming) {
+        sd = c->mtu_sd;
+        peer = __atomic_load_n(&c->peer, __ATOMIC_RELAXED);
+        if (sd != -1
+            && peer != __atomic_load_n(&c->mtu_peer, __ATOMIC_RELAXED)) {
+            peer_addr(c, &addr);
+            if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+                __atomic_store_n(&c->mtu_peer, peer, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (sd == -1 || getsockopt(sd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1
+        || mtu <= UDPIP_HEADER + SR_HEADER + MSS_MIN)
+        mss = MSS_MIN;
+    else
+        mss = mtu - UDPIP_HEADER - SR_HEADER;
+
+    if (mss > c->mss_limit)
+        mss = c->mss_limit;
+
+    /* the tag of a sealed segment takes room from the payload */
+    __atomic_store_n(&c->mss, mss - SGT_TAG(c), __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Function:	init_mss
+ * --------------------------------------------------------
+ * Enable path MTU discovery on the connection (don't fragment bit
+ * set, local fragmentation only for segments made before the MTU
+ * shrinks) and size the segments.
+ */
+void init_mss(struct rdt_conn *c)
+{
+    int pmtud = IP_PMTUDISC_WANT;
+
+    c->mss_limit = c->params.mss ? c->params.mss : MSS;
+    if (c->mss_limit > MSS_MAX)
+        c->mss_limit = MSS_MAX;
+
+    if (setsockopt(c->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud,
+                   sizeof(pmtud)) == -1)
+        perror("setsockopt() - IP_MTU_DISCOVER");
+
+    /* connected by update_mss (0 is no address) */
+    c->mtu_sd = c->roaming ? socket(AF_INET, SOCK_DGRAM, 0) : -1;
+    c->mtu_peer = 0;
+
+    update_mss(c);
+}
+
+
+
+
+/*
+ * Function:	stats_rtt_sample
+ * --------------------------------------------------------
+ * Account a round trip time sample (RFC 6298 estimators)
+ * and record it in the ack latency histogram.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		pkt		the packet just acked, for the first time
+ */
+void stats_rtt_sample(struct rdt_conn *c, struct packet *pkt)
+{
+    struct timespec now, elapsed;
+    uint64_t rtt, srtt, rttvar, min, delta;
+
+    if (pkt->rtx)               // ambiguous sample (Karn's algorithm)
+        return;
+
+    if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+        handle_error("clock_gettime()");
+    if (timespec_sub(&elapsed, &now, &pkt->sendtime) == -1)
+        return;
+    rtt = tstonsec(&elapsed);
+    hist_record(&ack_hist, rtt);
+
+    srtt = STAT_GET(c, srtt);
+    rttvar = STAT_GET(c, rttvar);
+    min = STAT_GET(c, rtt_min);
+
+    if (!srtt) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    } else {
+        delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar = rttvar - rttvar / 4 + delta / 4;
+        srtt = srtt - srtt / 8 + rtt / 8;
+    }
+
+    STAT_SET(c, srtt, srtt);
+    STAT_SET(c, rttvar, rttvar);
+    if (!min || rtt < min)
+        STAT_SET(c, rtt_min, rtt);
+}
+
+
+
+
 /*
  * Function:	store_pkt
  * ------------------------------------------------------------
  * Store segment and all the related info into the 
  * send_service's local buffer.
  * Take the segment from the first position of the shared 
- * circular buffer.
+ * circular buffer. The segment is sealed (see seal_segment)
+ * just before its first transmission.
  *
  * Parameters
  * 		base	the address of the local buffer
@@ -200,7 +1023,9 @@ void store_pkt(struct packet *base, uint8_t seqnum, size_t size,
     struct segment *sgt = &(pkt->sgt);
 
     sgt->seqnum = seqnum;
+    sgt->unused = 0;
     sgt->size = size;
+    sgt->crc = 0;
     memcpy_fromcb(sgt->payload, cb->buf, size, cb->S, CBUF_SIZE);
 
     pkt->rtx = false;
@@ -218,15 +1043,20 @@ void store_pkt(struct packet *base, uint8_t seqnum, size_t size,
  * local buffer has enough free space to store packets.
  *
  * Parameters:
- * 		cb				buffer containing application data
+ * 		c				the connection (its buffer holds application data)
  * 		pkts			local buffer containing stored packets
  * 		w				window taking track of in-flight packets
  * 		last_seqnum		index of the next packet to store
+ *
+ * Returns:
+ * 		true if the circular buffer was emptied
  */
-void empty_buffer(struct circular_buffer *cb, struct packet *pkts,
+bool empty_buffer(struct rdt_conn *c, struct packet *pkts,
                   struct window *w, unsigned int *last_seqnum)
 {
-    size_t data, size;
+    struct circular_buffer *cb = &c->send_cb;
+    size_t data, size, mss = __atomic_load_n(&c->mss, __ATOMIC_RELAXED);
+    bool empty;
     //unsigned int limit = 0;
 
     if (pthread_mutex_lock(&cb->mtx) != 0)
@@ -238,7 +1068,7 @@ void empty_buffer(struct circular_buffer *cb, struct packet *pkts,
         // shared buffer not empty and local buffer has free slots
 
         data = data_available(cb->S, cb->E, CBUF_SIZE);
-        size = data < MSS ? data : MSS;
+        size = data < mss ? data : mss;
 
         /* store a new packet */
         store_pkt(pkts, *last_seqnum, size, cb);
@@ -249,9 +1079,12 @@ void empty_buffer(struct circular_buffer *cb, struct packet *pkts,
         if (pthread_cond_signal(&cb->cnd_not_full) != 0)
             handle_error("pthread_cond_signal");
     }
+    empty = cb->S == cb->E;
 
     if (pthread_mutex_unlock(&cb->mtx) != 0)
         handle_error("pthread_mutex_unlock");
+
+    return empty;
 }
 
 
@@ -399,15 +1232,16 @@ struct packet *get_head_packet(struct queue_t *queue)
  * Extract the segment from the packet and send it.
  *
  * Parameters:
- * 		sockfd	the socket file descriptor
+ * 		c		the connection
  * 		pkt		the address of the packet
  * 		loss	the loss probability
  */
-void send_packet(int sockfd, struct packet *pkt, double loss)
+void send_packet(struct rdt_conn *c, struct packet *pkt, double loss)
 {
     struct segment *sgt = &pkt->sgt;
-    if (udt_send(sockfd, sgt, sizeof(struct segment), loss) == -1)
-        handle_error("udt_send() - sending packet");
+    if (conn_send(c, sgt, SR_HEADER + sgt->size + SGT_TAG(c), loss) == -1)
+        handle_error("conn_send() - sending packet");
+    STAT_ADD(c, sent, 1);
 }
 
 
@@ -417,21 +1251,24 @@ void send_packet(int sockfd, struct packet *pkt, double loss)
  * -----------------------------------------------------------------------
  * Send the expired segments, checking all the timestamps that are older
  * than current time until the queue is empty or a segment is not expired.
+ * Called with the timer's lock held.
  *
  * Parameters:
- * 		sockfd:			the socket file descriptor
- * 		loss:			loss probability
- * 		time_queue:		packets' timestamps queue
- * 		timeout:		timeout value
- * 		w:				packets' active seqnum window
+ * 		t:		the retransmission timer
  */
-void resend_expired(int sockfd, double loss, struct queue_t *time_queue,
-                    struct timespec *timeout, struct window *w)
+void resend_expired(struct rtx_timer *t)
 {
+    struct rdt_conn *c = t->conn;
+    struct queue_t *time_queue = &t->queue;
+    struct timespec *timeout = &t->timeout;
     struct packet *pkt;
     //unsigned int limit = 0;
 
-    (void) w;                   // relax warning 
+    if (time_queue->head)
+        TRACE(TR_TIMEOUT, get_head_packet(time_queue)->sgt.seqnum, 0, 0);
+
+    /* losses may come from a smaller path MTU */
+    update_mss(c);
 
     while (time_queue->head != NULL /*&& limit < SEND_LIMIT */ ) {
 
@@ -454,8 +1291,11 @@ void resend_expired(int sockfd, double loss, struct queue_t *time_queue,
          */
 
         //fprintf(stderr, "try to resend packet %u\n", pkt->sgt.seqnum);
-        send_packet(sockfd, pkt, loss);
+        send_packet(c, pkt, t->loss);
         pkt->rtx = true;
+        STAT_ADD(c, rtx, 1);
+        TRACE(TR_RTX, pkt->sgt.seqnum, pkt->sgt.size,
+              tstonsec(timeout) / 1000);
         //limit++;
         //fprint_status(stdout, w);
 
@@ -490,8 +1330,34 @@ bool more_packets(unsigned int next, unsigned int base, unsigned int last)
 {
     if (base <= last)
         return next < last;
+    else                        // stored packets: [base, MAXSEQNUM) + [0, last)
+        return next >= base || next < last;
+}
+
+
+
+
+/*
+ * Function:	seal_segment
+ * -------------------------------------------------------------------------------
+ * Protect a new segment before its first transmission (the
+ * retransmissions send the same bytes): encrypt its payload and
+ * append the tag, numbered with its extended sequence number, if
+ * the connection seals its segments; otherwise compute its checksum.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		pkt		the packet holding the segment
+ */
+void seal_segment(struct rdt_conn *c, struct packet *pkt)
+{
+    struct segment *sgt = &pkt->sgt;
+
+    if (c->tx_aead)
+        aead_seal(c->tx_aead, c->tx_xseq++, sgt, SR_HEADER, sgt->payload,
+                  sgt->size);
     else
-        return !(next < base && next > last);
+        sgt->crc = htonl(crc32c(0, sgt, SR_HEADER + sgt->size));
 }
 
 
@@ -501,48 +1367,72 @@ bool more_packets(unsigned int next, unsigned int base, unsigned int last)
  * Function		send_packets
  * -------------------------------------------------------------------------------
  * Send the segments stored in the local buffer, register their 
- * send and expiration time and add them to the timeout queue.
+ * send and expiration time and hand them to the retransmission timer.
  * Do this as long as the index of the next segment to send is 
  * inside the window and there are segments to send.
  *
  * Parameters:
- * 		sockfd		the socket file descriptor
- * 		loss		the segment's loss probability
+ * 		t			the retransmission timer
  * 		pkts		the address of the local buffer containing the packets to send
+ * 		nextseqnum	the index of the next segment to send
  * 		lastseqnum	the index of the last segment passed by application
  * 		w			the address of the send window
- * 		timequeue	the queue of the segments' expiration times 
- * 		timeout		the timeout value
  */
-void send_packets(int sockfd, double loss, struct packet *pkts,
-                  unsigned int lastseqnum, struct window *w,
-                  struct queue_t *time_queue, struct timespec *timeout)
+void send_packets(struct rtx_timer *t, struct packet *pkts,
+                  unsigned int *nextseqnum, unsigned int lastseqnum,
+                  struct window *w)
 {
-    static unsigned int nextseqnum = 0;
     //unsigned int limit = 0;
+    struct rdt_conn *c = t->conn;
+    struct queue_t *time_queue = &t->queue;
+    struct node_t *head;
     struct packet *pkt;         // packet pointer
+    unsigned int first = *nextseqnum, i;
 
-    while (in_window(w, nextseqnum) &&
-           more_packets(nextseqnum, w->base,
+    /* seal the whole burst, then send it */
+    for (i = first; in_window(w, i) && more_packets(i, w->base, lastseqnum);
+         i = (i + 1) % MAXSEQNUM)
+        seal_segment(c, pkts + i);
+
+    /* the timeout is only written by this thread: no lock to read it */
+    while (in_window(w, *nextseqnum) &&
+           more_packets(*nextseqnum, w->base,
                         lastseqnum) /*&& limit < SEND_LIMIT */ ) {
         // nextseqnum is inside the window and
         // there are packets not sent yet
 
-        pkt = pkts + nextseqnum;
+        pkt = pkts + *nextseqnum;
 
-        //fprintf(stderr, "try to send packet %u\n", nextseqnum);
-        send_packet(sockfd, pkt, loss);
+        //fprintf(stderr, "try to send packet %u\n", *nextseqnum);
+        send_packet(c, pkt, t->loss);
+        TRACE(TR_SEND, pkt->sgt.seqnum, pkt->sgt.size, 0);
         //fprint_status(stdout, w);
 
         /* set packet sendtime and exptime */
-        pkt_settime(pkt, timeout);
+        pkt_settime(pkt, &t->timeout);
 
-        prio_enqueue(pkt, time_queue, exptime_cmp);
-        //fprint_queue(stderr, time_queue, fprint_pkt);
+        STAT_ADD(c, timer_queue, 1);
+        STAT_ADD(c, bytes_sent, pkt->sgt.size);
 
-        nextseqnum = (nextseqnum + 1) % MAXSEQNUM;
+        *nextseqnum = (*nextseqnum + 1) % MAXSEQNUM;
         //limit++;
     }
+    if (first == *nextseqnum)
+        return;
+
+    /* hand the burst to the timer, which sleeps until the head expires */
+    if (pthread_mutex_lock(&t->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    head = time_queue->head;
+    for (; first != *nextseqnum; first = (first + 1) % MAXSEQNUM)
+        if (prio_enqueue(pkts + first, time_queue, exptime_cmp) == -1)
+            handle_error("prio_enqueue()");
+    //fprint_queue(stderr, time_queue, fprint_pkt);
+    if (time_queue->head != head
+        && pthread_cond_signal(&t->cnd_changed) != 0)
+        handle_error("pthread_cond_signal");
+    if (pthread_mutex_unlock(&t->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
 
     //fprintf(stderr, "base = %u, nextseqnum = %u, lastseqnum = %u\n",
     //        w->base, nextseqnum, lastseqnum);
@@ -557,6 +1447,7 @@ void send_packets(int sockfd, double loss, struct packet *pkts,
  * Calculate remaining time to timeout
  *
  * Parameters:
+ * 		c:			the connection
  * 		q:			queue containing packet's timestamps	
  * 		wait_time: 	struct that will contain the new wait time
  *
@@ -564,7 +1455,8 @@ void send_packets(int sockfd, double loss, struct packet *pkts,
  *		 0:	success
  *		-1: the head packet's timeout expired
  */
-int calc_wait_time(struct queue_t *q, struct timespec *wait_time)
+int calc_wait_time(struct rdt_conn *c, struct queue_t *q,
+                   struct timespec *wait_time)
 {
     struct packet *pkt;
     struct timespec now, left;
@@ -573,9 +1465,8 @@ int calc_wait_time(struct queue_t *q, struct timespec *wait_time)
         handle_error("clock_gettime()");
 
     if (!q->head) {
-        /* queue is empty: turn off the timeout */
-        left.tv_sec = 15;
-        left.tv_nsec = 0;
+        /* queue is empty: wake up to keep the connection alive */
+        left = c->keepalive;
     } else {
         pkt = get_head_packet(q);
 
@@ -663,12 +1554,107 @@ int seqnum_cmp(void *x, void *y)
  * Parameters:
  * 		q		the address of the queue
  * 		acknum	the sequence number of the acked segment
+ *
+ * Returns:
+ * 		0	if the segment was waiting for its ack
+ * 		-1	otherwise (duplicate ack)
  */
-void remove_pkt_timeout(struct queue_t *q, uint8_t acknum)
+int remove_pkt_timeout(struct queue_t *q, uint8_t acknum)
 {
     struct packet pkt;
     pkt.sgt.seqnum = acknum;
-    remove_node(&pkt, q, seqnum_cmp);
+    return remove_node(&pkt, q, seqnum_cmp);
+}
+
+
+
+
+/*
+ * Function:	timer_service
+ * ------------------------------------------
+ * Loop routine of the retransmission timer: sleep until the first
+ * packet of the queue expires, then resend the expired ones. With
+ * nothing in flight for the keepalive interval, send a keepalive.
+ * Expirations are thus handled while the sender processes acks.
+ *
+ * Parameters:
+ * 		p:		the timer
+ */
+void *timer_service(void *p)
+{
+    struct rtx_timer *t = p;
+    struct rdt_conn *c = t->conn;
+    struct timespec wait_time;
+    int condret;
+
+    netem_stream(NETEM_STREAM_TIMER);
+
+    if (pthread_mutex_lock(&t->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    while (!t->stop) {
+
+        /* calculate remaining time to wait */
+        if (calc_wait_time(c, &t->queue, &wait_time) == -1) {
+            /* timeout expired: resend expired packets */
+            resend_expired(t);
+            continue;
+        }
+
+        condret = pthread_cond_timedwait(&t->cnd_changed, &t->mtx,
+                                         &wait_time);
+        if (condret == ETIMEDOUT && !t->queue.head && !t->stop)
+            send_control(c, CTL_KEEPALIVE, 0, NULL, t->loss);
+        else if (condret != 0 && condret != ETIMEDOUT)
+            handle_error("pthread_cond_timedwait");
+    }
+
+    if (pthread_mutex_unlock(&t->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    return NULL;
+}
+
+
+
+
+/*
+ * Function:	ack_received
+ * ------------------------------------------
+ * Take the acked packet away from the retransmission timer and
+ * feed its round trip time to the timeout and the stats.
+ *
+ * Parameters:
+ * 		t:			the timer
+ * 		pkt:		the packet
+ * 		adaptive:	adapt the timeout
+ *
+ * Returns:
+ * 		true if the packet was waiting for its ack (not a duplicate)
+ */
+bool ack_received(struct rtx_timer *t, struct packet *pkt, bool adaptive)
+{
+    struct rdt_conn *c = t->conn;
+    bool acked;
+
+    if (pthread_mutex_lock(&t->mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    if (adaptive)
+        update_timeout(&t->timeout, pkt);
+    //fprint_timespec(stderr, &t->timeout);
+    acked = remove_pkt_timeout(&t->queue, pkt->sgt.seqnum) == 0;
+    if (acked) {
+        STAT_ADD(c, acked, 1);
+        STAT_SUB(c, timer_queue, 1);
+        stats_rtt_sample(c, pkt);
+    }
+    STAT_SET(c, rto, tstonsec(&t->timeout));
+
+    if (pthread_mutex_unlock(&t->mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    return acked;
 }
 
 
@@ -678,77 +1664,75 @@ void remove_pkt_timeout(struct queue_t *q, uint8_t acknum)
  * Function:	send_service
  * ------------------------------------------
  * Loop routine that write the socket.
- * Wait for events, such as data from application, ack received and
- * segments' expirations.
+ * Wait for events, such as data from application and ack received.
  * Get application data, make segments and send them until the related 
- * ack has come back.
- * Handle multiple timeouts, and eventually retransmit segments.
+ * ack has come back. The expirations are handled by the
+ * retransmission timer, run by a thread of its own.
  *
  * Parameters:
- * 		p:		a pointer to the required parameters and shared structs
+ * 		p:		the connection
  */
 void *send_service(void *p)
 {
-    struct packet pkts_buffer[MAXSEQNUM];
-    struct queue_t time_queue;
-    struct timespec wait_time;
-    struct timespec timeout;
+    struct packet *pkts_buffer;
+    struct rtx_timer timer;
     struct window w;
 
-    struct shared_tools *tools = p;
-    struct circular_buffer *cb = tools->cb;
-    struct event *e = tools->e;
-    struct proto_params *params = tools->params;
-    int sockfd = tools->sockfd;
+    struct rdt_conn *c = p;
+    struct event *e = &c->e;
+    struct proto_params *params = &c->params;
 
-    double loss = params->P / 100.0;
-    unsigned int lastseqnum = 0;
+    unsigned int lastseqnum = 0, nextseqnum = 0, i;
     uint8_t acknum;
-    int condret;
+    unsigned int base;
+    int acked;
+    bool stop = false, emptied;
 
 
+    netem_stream(NETEM_STREAM_SEND);
+
+    /* the segments in flight (too many for a thread's stack) */
+    if (!(pkts_buffer = calloc(MAXSEQNUM, sizeof(*pkts_buffer))))
+        handle_error("calloc() - send_service");
+    for (i = 0; i < MAXSEQNUM; i++)
+        memcpy(pkts_buffer[i].sgt.cid, &c->cid, CID_SIZE);
+
     /* initialize send window */
     w.base = 0;
     w.width = params->N;
     reset(&w.ack_bar);
 
-    /* initialize timeout queue */
-    time_queue.head = time_queue.tail = NULL;
-
-    /* initialize timeout */
-    nsectots(&timeout, (long long) params->T * 1000000);
+    /* initialize the retransmission timer */
+    memset(&timer, 0, sizeof(timer));
+    timer.conn = c;
+    timer.loss = params->P / 100.0;
+    nsectots(&timer.timeout, (long long) params->T * 1000000);
+    STAT_SET(c, rto, tstonsec(&timer.timeout));
+    if (pthread_mutex_init(&timer.mtx, NULL) != 0)
+        handle_error("pthread_mutex_init");
+    if (pthread_cond_init(&timer.cnd_changed, NULL) != 0)
+        handle_error("pthread_cond_init");
+    if (pthread_create(&timer.thread, NULL, timer_service, &timer) != 0)
+        handle_error("pthread_create() - timer_service");
 
     if (pthread_mutex_lock(&e->mtx) != 0)
         handle_error("pthread_mutex_lock");
 
     for (;;) {
 
-        e->type = NO_EVENT;
-        if (pthread_cond_broadcast(&e->cnd_no_event) != 0)
-            handle_error("pthread_cond_broadcast()");
-
-        condret = 0;
-        while (e->type == NO_EVENT && condret != ETIMEDOUT) {
-            // no events and timeout not expired
-
-            /* calculate remaining time to wait */
-            if (calc_wait_time(&time_queue, &wait_time) == -1) {
-                /* timeout expired: resend expired packets */
-                resend_expired(sockfd, loss, &time_queue, &timeout, &w);
-                continue;
+        /* an event signaled before this point is still pending */
+        while (e->type == NO_EVENT) {
+            if (BUSY_POLL_US(c)) {
+                if (pthread_mutex_unlock(&e->mtx) != 0)
+                    handle_error("pthread_mutex_unlock");
+                spin_while(c, &e->type, NO_EVENT);
+                if (pthread_mutex_lock(&e->mtx) != 0)
+                    handle_error("pthread_mutex_lock");
+                if (e->type != NO_EVENT)
+                    break;
             }
-
-            condret =
-                pthread_cond_timedwait(&e->cnd_event, &e->mtx, &wait_time);
-            if (condret != 0 && condret != ETIMEDOUT)
-                handle_error("pthread_cond_timedwait");
-        }
-
-        /* TIMEOUT EVENT */
-        if (condret == ETIMEDOUT) {
-            //fputs("TIMEOUT EVENT\n", stderr);
-            resend_expired(sockfd, loss, &time_queue, &timeout, &w);
-            continue;
+            if (pthread_cond_wait(&e->cnd_event, &e->mtx) != 0)
+                handle_error("pthread_cond_wait");
         }
 
         switch (e->type) {
@@ -761,30 +1745,69 @@ void *send_service(void *p)
             //fputs("ACK EVENT\n", stderr);
             acknum = e->acknum;
             //fprintf(stderr, "Got ACK %d\n", acknum);
-            if (params->adaptive)
-                update_timeout(&timeout, pkts_buffer + acknum);
-            //fprint_timespec(stderr, &timeout);
-            remove_pkt_timeout(&time_queue, acknum);
+            acked = ack_received(&timer, pkts_buffer + acknum,
+                                 params->adaptive);
+            TRACE(TR_ACK, acknum, 0, acked);
             //fprint_queue(stderr, &time_queue, fprint_pkt);
+            base = w.base;
             update_window(&w, acknum);
+            if (w.base != base)
+                TRACE(TR_SLIDE, w.base, 0,
+                      (w.base - base + MAXSEQNUM) % MAXSEQNUM);
             //fprint_status(stdout, &w);
             break;
 
+        case CLOSE_EVENT:
+            stop = true;
+            break;
+
         default:
             fputs("Unexpected event type\n", stderr);
             break;
-        }
+        }
+
+        /* event consumed: let the signalers go on */
+        e->type = NO_EVENT;
+        if (pthread_cond_broadcast(&e->cnd_no_event) != 0)
+            handle_error("pthread_cond_broadcast()");
+        if (stop)
+            break;
 
         /* empty shared buffer and put segments into the local one */
-        empty_buffer(cb, pkts_buffer, &w, &lastseqnum);
+        emptied = empty_buffer(c, pkts_buffer, &w, &lastseqnum);
         /* send available segments */
-        send_packets(sockfd, loss, pkts_buffer, lastseqnum, &w,
-                     &time_queue, &timeout);
+        send_packets(&timer, pkts_buffer, &nextseqnum, lastseqnum, &w);
+
+        /* let rdt_close know when everything was acked */
+        c->flushed = emptied && w.base == lastseqnum;
+        if (c->flushed) {
+            c->fin_seqnum = lastseqnum;
+            if (pthread_cond_broadcast(&c->cnd_closing) != 0)
+                handle_error("pthread_cond_broadcast()");
+        }
     }
 
     if (pthread_mutex_unlock(&e->mtx) != 0)
         handle_error("pthread_mutex_unlock");
 
+    /* stop the timer */
+    if (pthread_mutex_lock(&timer.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    timer.stop = true;
+    if (pthread_cond_signal(&timer.cnd_changed) != 0)
+        handle_error("pthread_cond_signal");
+    if (pthread_mutex_unlock(&timer.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+    if (pthread_join(timer.thread, NULL) != 0)
+        handle_error("pthread_join() - timer_service");
+    pthread_cond_destroy(&timer.cnd_changed);
+    pthread_mutex_destroy(&timer.mtx);
+
+    /* segments left unacked by a peer that closed first */
+    while (timer.queue.head)
+        dequeue(&timer.queue);
+    free(pkts_buffer);
+
     return NULL;
 }
 
@@ -798,21 +1821,40 @@ void *send_service(void *p)
  * there is enough free space.
  *
  * Parameters:
- * 		cb:		circular buffer address
+ * 		c:		the connection
  * 		sgt:	segment address
  */
-void deliver_segment(struct circular_buffer *cb, struct segment *sgt)
+void deliver_segment(struct rdt_conn *c, struct segment *sgt)
 {
+    struct circular_buffer *cb = &c->recv_cb;
+    struct timespec t0;
+    bool blocked = false;
+
     if (pthread_mutex_lock(&cb->mtx) != 0)
         handle_error("pthread_mutex_lock");
 
     /* check free space */
-    while (space_available(cb->S, cb->E, CBUF_SIZE) <= MSS)
+    while (space_available(cb->S, cb->E, CBUF_SIZE) <= sgt->size) {
+        if (__atomic_load_n(&c->closing, __ATOMIC_RELAXED)) {
+            /* nobody will read it */
+            if (pthread_mutex_unlock(&cb->mtx) != 0)
+                handle_error("pthread_mutex_unlock");
+            return;
+        }
+        if (!blocked) {
+            stat_clock(&t0);
+            blocked = true;
+        }
         if (pthread_cond_wait(&cb->cnd_not_full, &cb->mtx) != 0)
             handle_error("pthread_cond_wait");
+    }
+    if (blocked)
+        STAT_ADD(c, deliver_blocked_ns, stat_elapsed(&t0));
 
     memcpy_tocb(cb->buf, sgt->payload, sgt->size, cb->E, CBUF_SIZE);
     cb->E = (cb->E + sgt->size) % CBUF_SIZE;
+    STAT_ADD(c, bytes_delivered, sgt->size);
+    TRACE(TR_DELIVER, sgt->seqnum, sgt->size, 0);
 
     if (pthread_cond_signal(&cb->cnd_not_empty) != 0)
         handle_error("pthread_cond_signal");
@@ -823,6 +1865,92 @@ void deliver_segment(struct circular_buffer *cb, struct segment *sgt)
 
 
 
+/*
+ * Function:	segment_intact
+ * ------------------------------------------------------------------
+ * Check the checksum of a received segment, leaving its crc field
+ * at 0, or its tag if the connection seals its segments, decrypting
+ * the payload. The extended sequence number of a sealed segment
+ * comes from the window: the sender is at most a window away.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		sgt		the segment
+ * 		xbase	extended sequence number of the base of the window
+ * 		base	the base of the window
+ *
+ * Returns:
+ * 		true	if the header and the payload arrived unchanged
+ * 		false	otherwise
+ */
+bool segment_intact(struct rdt_conn *c, struct segment *sgt,
+                    uint64_t xbase, unsigned int base)
+{
+    uint32_t crc = ntohl(sgt->crc);
+
+    if (c->rx_aead)
+        return aead_open(c->rx_aead,
+                         xbase + (int8_t) (uint8_t) (sgt->seqnum - base),
+                         sgt, SR_HEADER, sgt->payload, sgt->size);
+
+    sgt->crc = 0;
+    return crc32c(0, sgt, SR_HEADER + sgt->size) == crc;
+}
+
+
+
+/*
+ * Function:	ctl_intact
+ * ---------------------------------------------------------------
+ * Check the tag of an ack, control datagram or probe of a sealed
+ * connection, and that its counter was not seen before (the last
+ * 64 are remembered, so that reordered ones still pass).
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		buf		the datagram
+ * 		r		its size, reduced to the one of the plain datagram
+ *
+ * Returns:
+ * 		true	if the datagram is authentic and new
+ * 		false	otherwise
+ */
+bool ctl_intact(struct rdt_conn *c, uint8_t *buf, ssize_t *r)
+{
+    size_t len = *r - CTL_CTR_SIZE - AEAD_TAG;
+    uint32_t ctr, age;
+
+    if (*r != sizeof(struct ack) + CTL_CTR_SIZE + AEAD_TAG
+        && *r != sizeof(struct control) + CTL_CTR_SIZE + AEAD_TAG
+        && *r != sizeof(struct probe) + CTL_CTR_SIZE + AEAD_TAG)
+        return false;
+
+    memcpy(&ctr, buf + len, CTL_CTR_SIZE);
+    ctr = ntohl(ctr);
+    age = c->ctl_rx_top - ctr;
+    if (!ctr || (ctr <= c->ctl_rx_top
+                 && (age >= 64 || c->ctl_rx_seen >> age & 1)))
+        return false;
+
+    if (!aead_open(c->rx_aead, CTL_NONCE | ctr, buf, len + CTL_CTR_SIZE,
+                   buf + len + CTL_CTR_SIZE, 0))
+        return false;
+
+    if (ctr > c->ctl_rx_top) {
+        age = ctr - c->ctl_rx_top;
+        c->ctl_rx_seen = age >= 64 ? 0 : c->ctl_rx_seen << age;
+        c->ctl_rx_top = ctr;
+        age = 0;
+    }
+    c->ctl_rx_seen |= 1ULL << age;
+
+    *r = len;
+    return true;
+}
+
+
+
+
 /*
  * Function		process_segment
  * ------------------------------------------------------------------
@@ -833,20 +1961,21 @@ void deliver_segment(struct circular_buffer *cb, struct segment *sgt)
  * the base.
  *
  * Parameters:
+ * 		c:				the connection
  * 		sgt:			the address of the segment to process
  * 		segments_cb:	the buffer containing the segments to deliver
+ * 		S:				position of the window base in segments_cb
  * 		w:				the receive window
- * 		cb:				the shared buffer with application layer
  *
  * Returns:
  *		true:	the sequnce number is between [base - N; base + N)
  *				and must send an ack to the sender
  *		false:	otherwise
  */
-bool process_segment(struct segment *sgt, struct segment *segments_cb,
-                     struct window *w, struct circular_buffer *cb)
+bool process_segment(struct rdt_conn *c, struct segment *sgt,
+                     struct segment *segments_cb, unsigned int *S,
+                     struct window *w)
 {
-    static unsigned int S = 0;
     unsigned int i, s, seqnum;
 
     seqnum = sgt->seqnum;
@@ -860,11 +1989,15 @@ bool process_segment(struct segment *sgt, struct segment *segments_cb,
         /* check if the segment is a duplicate */
         if (is_duplicate(w, i)) {
             //fputs("Already received\n", stderr);
+            STAT_ADD(c, dup_segs, 1);
+            TRACE(TR_RECV, seqnum, sgt->size, 1);
             return true;
         }
+        TRACE(TR_RECV, seqnum, sgt->size, 0);
 
-        /* store the segment */
-        segments_cb[(S + i) % w->width] = *sgt;
+        /* store the segment (the payload has its own size) */
+        memcpy(segments_cb + (*S + i) % w->width, sgt,
+               SR_HEADER + sgt->size);
 
         /* mark segment as arrived */
         if (set_bit(&w->ack_bar, i) == -1)
@@ -877,57 +2010,241 @@ bool process_segment(struct segment *sgt, struct segment *segments_cb,
             s = calc_shift(w);
             /* deliver consecutive arrived segments */
             for (i = 0; i < s; i++) {
-                deliver_segment(cb, segments_cb + S);
-                S = (S + 1) % w->width;
+                deliver_segment(c, segments_cb + *S);
+                *S = (*S + 1) % w->width;
             }
             /* update window indexes */
             shift_window(w, s);
             w->base = (w->base + s) % MAXSEQNUM;
+            TRACE(TR_SLIDE, w->base, 0, s);
         }
         return true;
     } else if (in_prewindow(w, seqnum)) {
         //fputs("Already received\n", stderr);
+        STAT_ADD(c, dup_segs, 1);
+        TRACE(TR_RECV, seqnum, sgt->size, 1);
         return true;
     }
+    TRACE(TR_RECV, seqnum, sgt->size, 2);
     return false;
 }
 
 
 
 
+/* the peer sent its FIN: wake up the readers waiting for data */
+void close_by_peer(struct rdt_conn *c)
+{
+    if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    c->peer_closed = true;
+
+    if (pthread_cond_broadcast(&c->recv_cb.cnd_not_empty) != 0)
+        handle_error("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+}
+
+
+
+/*
+ * Function:	expire
+ * --------------------------------------------------------
+ * The peer was silent for the idle timeout: end the stream for the
+ * readers and release the writers and rdt_close, dropping what is
+ * still to be sent. The other connections of the process go on.
+ */
+void expire(struct rdt_conn *c)
+{
+    __atomic_store_n(&c->expired, true, __ATOMIC_RELAXED);
+
+    close_by_peer(c);
+
+    if (pthread_mutex_lock(&c->send_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    if (pthread_cond_broadcast(&c->send_cb.cnd_not_full) != 0)
+        handle_error("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&c->send_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    if (pthread_mutex_lock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    if (pthread_cond_broadcast(&c->cnd_closing) != 0)
+        handle_error("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+}
+
+
+
+/* give the connection up as if it expired: the peer never showed up */
+void rdt_abandon(void)
+{
+    expire(rdt_cur);
+}
+
+
+
+bool fin_was_sent(struct rdt_conn *c)
+{
+    bool sent;
+
+    if (pthread_mutex_lock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    sent = c->fin_sent;
+    if (pthread_mutex_unlock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    return sent;
+}
+
+
+
+void fin_ack_received(struct rdt_conn *c)
+{
+    if (pthread_mutex_lock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    c->fin_acked = true;
+
+    if (pthread_cond_broadcast(&c->cnd_closing) != 0)
+        handle_error("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+}
+
+
+
+
+/*
+ * Function:	follow_peer
+ * --------------------------------------------------
+ * Check the address a datagram of a roaming connection came from,
+ * if the peer moved (a NAT rebinding its port): the datagram passed
+ * its checks (a segment within the window, or an ack or control
+ * datagram, authentic if sealed), yet the data keeps going to the
+ * old address until the new one echoes a random challenge, so that
+ * a copied datagram cannot turn the transfer to another host. The
+ * challenge is repeated at most once per timeout.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		from	the sender of the datagram
+ */
+void follow_peer(struct rdt_conn *c, struct sockaddr_in *from)
+{
+    uint64_t peer = pack_peer(from);
+    struct timespec now, elapsed;
+
+    if (!c->roaming || peer == __atomic_load_n(&c->peer, __ATOMIC_RELAXED))
+        return;
+
+    stat_clock(&now);
+    if (peer == c->probe_peer) {
+        timespec_sub(&elapsed, &now, &c->probe_time);
+        if (tstonsec(&elapsed) < (long long) c->params.T * 1000000)
+            return;
+    } else {
+        if (getrandom(c->probe_data, PROBE_SIZE, 0) != PROBE_SIZE)
+            handle_error("getrandom() - path challenge");
+        c->probe_data[0] |= 1;
+        c->probe_peer = peer;
+    }
+    c->probe_time = now;
+    send_probe(c, CTL_CHALLENGE, c->probe_data, from, c->params.P / 100.0);
+}
+
+
+
+/*
+ * Function:	recv_probe
+ * --------------------------------------------------
+ * Echo a path challenge to where it came from, or move the
+ * connection to the address that echoed the last one sent.
+ *
+ * Parameters:
+ * 		c		the connection
+ * 		probe	the probe received
+ * 		from	its sender
+ */
+void recv_probe(struct rdt_conn *c, struct probe *probe,
+                struct sockaddr_in *from)
+{
+    uint64_t peer = pack_peer(from);
+    char addr[INET_ADDRSTRLEN];
+
+    if (probe->type == CTL_CHALLENGE) {
+        send_probe(c, CTL_RESPONSE, probe->data, from,
+                   c->params.P / 100.0);
+        return;
+    }
+
+    if (probe->type != CTL_RESPONSE || !c->probe_peer
+        || peer != c->probe_peer
+        || memcmp(probe->data, c->probe_data, PROBE_SIZE) != 0)
+        return;
+
+    __atomic_store_n(&c->peer, peer, __ATOMIC_RELAXED);
+    c->probe_peer = 0;
+    STAT_ADD(c, moves, 1);
+    inet_ntop(AF_INET, &from->sin_addr, addr, sizeof(addr));
+    fprintf(stderr, "Peer moved to %s:%u\n", addr, ntohs(from->sin_port));
+
+    /* a new path, maybe with another MTU */
+    update_mss(c);
+}
+
+
+
+
 /*
  * Function:	recv_service
  * ------------------------------------------
  * Loop routine that read the socket.
  * Check the size of the received data in order to recognize the content.
- * Denpendig on the content, either handle segment arrivals or
- * signal ack arrivals to the sender routine.
+ * Denpendig on the content, either handle segment arrivals,
+ * signal ack arrivals to the sender routine or handle the control
+ * datagrams. Datagrams without the connection ID are dropped.
+ * Returns when rdt_close shuts the socket down.
  *
  * Parameters:
- * 		p:		a pointer to the required parameters and shared structs
+ * 		p:		the connection
  */
 void *recv_service(void *p)
 {
-    struct shared_tools *tools = p;
+    struct rdt_conn *c = p;
 
-    struct circular_buffer *cb = tools->cb; // shared buffer with application layer
-    struct event *e = tools->e; // event struct to signal ack events
-    struct proto_params *params = tools->params;
+    struct event *e = &c->e;    // event struct to signal ack events
+    struct proto_params *params = &c->params;
 
     struct window recv_window;  // window to implement selective repeat 
-    struct segment segments_cb[params->N];  // buffer to store arrived segments
+    struct segment *segments_cb;        // buffer to store arrived segments
     struct segment *sgt;        // temporary segment address buffer
-
-    struct timeval timeout;     // connection timeout
+    struct control *ctl;        // temporary control datagram address
+    struct ack ack;             // ack to send
+    struct sockaddr_in from;    // sender of the datagram
+    socklen_t fromlen;
+    unsigned int S = 0;         // position of the window base in segments_cb
+    unsigned int base;          // window base before a segment
+    uint64_t xbase = 0;         // extended seqnum of the window base
+    unsigned int tag = SGT_TAG(c);      // after the payload if sealed
+    bool acked;
 
     double loss = params->P / 100.0;
-    uint8_t acknum;             // temporary ack buffer
     size_t max_recvsize = sizeof(struct segment);   // receive buffer max size
-    char buffer[max_recvsize];  // receive buffer
-    int sockfd = tools->sockfd; // socket file descriptor
+    char *buffer;               // receive buffer
+    int sockfd = c->sockfd;     // socket file descriptor
     ssize_t r;                  // return value for the read
 
 
+    segments_cb = calloc(params->N, sizeof(*segments_cb));
+    buffer = malloc(max_recvsize);
+    if (!segments_cb || !buffer)
+        handle_error("calloc() - recv_service");
+
+    netem_stream(NETEM_STREAM_RECV);
+
     /* initialize recv_window */
     recv_window.base = 0;
     recv_window.width = params->N;
@@ -935,16 +2252,17 @@ void *recv_service(void *p)
 
 
     /* set connection timeout */
-    timeout.tv_sec = 90;
-    timeout.tv_usec = 0;
     if (setsockopt
-        (sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+        (sockfd, SOL_SOCKET, SO_RCVTIMEO, &c->idle_timeout,
+         sizeof(c->idle_timeout)) == -1)
         handle_error("recv_service - setting socket timeout");
 
 
     for (;;) {
 
-        r = read(sockfd, buffer, max_recvsize);
+        fromlen = sizeof(from);
+        r = udt_recvfrom(sockfd, buffer, max_recvsize,
+                         (struct sockaddr *) &from, &fromlen);
 
         if (r == -1) {
 
@@ -953,116 +2271,474 @@ void *recv_service(void *p)
                 continue;
 
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // timeout expired: close connection
+                // timeout expired: the peer is gone
                 puts("Connection expired");
-                exit(EXIT_SUCCESS);
+                expire(c);
+                break;
+            }
+
+            if (errno == ECONNREFUSED && fin_was_sent(c)) {
+                // the peer is gone after the FIN_ACK
+                fin_ack_received(c);
+                continue;
             }
 
             handle_error("recv_service - read()");
         }
 
+        /* shut down by rdt_close */
+        if (__atomic_load_n(&c->closing, __ATOMIC_RELAXED))
+            break;
+
+        /*
+         * a datagram of another connection, or the SYN_ACK repeated
+         * (it carries the ID in its configuration): the confirmation
+         * got lost
+         */
+        if (r < CID_SIZE || memcmp(buffer, &c->cid, CID_SIZE) != 0) {
+            if (!c->roaming && hs_is_synack(buffer, r, c->params.cid))
+                conn_confirm(c);
+            continue;
+        }
 
-        /* segment received */
-        if (r == sizeof(struct segment)) {
 
-            sgt = (struct segment *) buffer;
-            if (process_segment(sgt, segments_cb, &recv_window, cb)) {
-                /* send ACK */
+        /* segment received */
+        sgt = (struct segment *) buffer;
+        if (r > SR_HEADER && !sgt->unused
+            && r == SR_HEADER + sgt->size + tag) {
+
+            STAT_ADD(c, segs_rcvd, 1);
+            if (!segment_intact(c, sgt, xbase, recv_window.base)) {
+                /* corrupted (or forged): no ack, the sender resends it */
+                STAT_ADD(c, bad_segs, 1);
+                continue;
+            }
+            __atomic_store_n(&c->peer_heard, true, __ATOMIC_RELAXED);
+            base = recv_window.base;
+            acked = process_segment(c, sgt, segments_cb, &S, &recv_window);
+            xbase += (recv_window.base - base + MAXSEQNUM) % MAXSEQNUM;
+            if (acked) {
+                /* within the window (or a copy whose ack got lost) */
+                follow_peer(c, &from);
+                /* send ACK, back to the sender: it is no bulk data */
                 //fprintf(stderr, "try to send ACK %u\n", sgt->seqnum);
-                if (udt_send
-                    (tools->sockfd, &sgt->seqnum, sizeof(uint8_t),
-                     loss) == -1)
-                    handle_error("udt_send() - sending ACK");
+                memcpy(ack.cid, &c->cid, CID_SIZE);
+                ack.seqnum = sgt->seqnum;
+                if (conn_send_ctl(c, &ack, sizeof(ack), &from, loss) == -1)
+                    handle_error("conn_send() - sending ACK");
+                TRACE(TR_ACK_SENT, sgt->seqnum, 0, 0);
             }
             continue;
         }
 
 
+        /* a sealed connection drops the acks and controls not authentic */
+        if (c->rx_aead && r != CID_SIZE
+            && !ctl_intact(c, (uint8_t *) buffer, &r))
+            continue;
+
+        /* a sealed connection is heard only once the peer proved its keys */
+        if (!c->rx_aead || r != CID_SIZE)
+            __atomic_store_n(&c->peer_heard, true, __ATOMIC_RELAXED);
+
+        /* path probes: not a reason to follow the sender */
+        if (r == sizeof(struct probe)) {
+            recv_probe(c, (struct probe *) buffer, &from);
+            continue;
+        }
+
+        /* on a plain connection only the ID vouches for the rest */
+        follow_peer(c, &from);
+
+
         /* ACK received */
-        if (r == sizeof(acknum)) {
+        if (r == sizeof(struct ack)) {
 
-            acknum = (uint8_t) * buffer;
-            //fprintf(stderr, "received ACK %u\n", acknum); 
-            if (cond_ack_event_signal(e, acknum) == -1)
+            STAT_ADD(c, acks_rcvd, 1);
+            if (cond_ack_event_signal(e, ((struct ack *) buffer)->seqnum)
+                == -1)
                 handle_error("cond_event_signal()");
             continue;
         }
 
 
+        /* control datagram */
+        if (r == sizeof(struct control)) {
+
+            ctl = (struct control *) buffer;
+            switch (ctl->type) {
+            case CTL_FIN:
+                /* with all the data delivered the stream is over */
+                if (ctl->arg == recv_window.base) {
+                    close_by_peer(c);
+                    send_control(c, CTL_FIN_ACK, ctl->arg, &from, loss);
+                }
+                break;
+            case CTL_FIN_ACK:
+                fin_ack_received(c);
+                break;
+            case CTL_KEEPALIVE:
+                break;
+            default:
+                fputs("recv_service: unknown control datagram\n", stderr);
+            }
+            continue;
+        }
+
+
+        /* connection confirmed */
+        if (r == CID_SIZE)
+            continue;
+
         fputs("recv_service: undefined data received\n", stderr);
     }
 
+    free(segments_cb);
+    free(buffer);
+
     return NULL;
 }
 
 
 
 
+/*
+ * Function:	stop_transport
+ * --------------------------------------------------------
+ * Stop the threads of a connection and release it.
+ * The socket is left to the caller.
+ */
+void stop_transport(struct rdt_conn *c)
+{
+    struct rdt_conn **pp;
+
+    __atomic_store_n(&c->closing, true, __ATOMIC_RELAXED);
+
+    /* wake recv_service, reading the socket or waiting for room */
+    if (shutdown(c->sockfd, SHUT_RD) == -1 && errno != ENOTCONN)
+        handle_error("shutdown()");
+    if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    if (pthread_cond_broadcast(&c->recv_cb.cnd_not_full) != 0)
+        handle_error("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+    if (pthread_join(c->recv_thread, NULL) != 0)
+        handle_error("joining recv_service");
+
+    /* then send_service, that consumes the last ack events */
+    if (cond_event_signal(&c->e, CLOSE_EVENT) == -1)
+        handle_error("cond_event_signal()");
+    if (pthread_join(c->send_thread, NULL) != 0)
+        handle_error("joining send_service");
+
+    pthread_mutex_destroy(&c->e.mtx);
+    pthread_mutex_destroy(&c->recv_cb.mtx);
+    pthread_mutex_destroy(&c->send_cb.mtx);
+    pthread_mutex_destroy(&c->ctl_mtx);
+    pthread_cond_destroy(&c->recv_cb.cnd_not_empty);
+    pthread_cond_destroy(&c->send_cb.cnd_not_empty);
+    pthread_cond_destroy(&c->recv_cb.cnd_not_full);
+    pthread_cond_destroy(&c->send_cb.cnd_not_full);
+    pthread_cond_destroy(&c->e.cnd_event);
+    pthread_cond_destroy(&c->e.cnd_no_event);
+    pthread_cond_destroy(&c->cnd_closing);
+
+    if (pthread_mutex_lock(&conns_mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    for (pp = &conns; *pp != c; pp = &(*pp)->next);
+    *pp = c->next;
+    if (pthread_mutex_unlock(&conns_mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    aead_free(c->tx_aead);
+    aead_free(c->rx_aead);
+    aead_free(c->ctl_aead);
+    if (c->mtu_sd != -1)
+        close(c->mtu_sd);
+    free(c);
+}
+
+
+
+/*
+ * Function:	rdt_close
+ * --------------------------------------------------------
+ * Close the connection: wait until all the data sent is acked, then
+ * send a FIN (retransmitted on timeout, up to FIN_RETRIES times) and
+ * wait for its FIN_ACK. If the peer closed first nothing is sent,
+ * its FIN was already acked. Then stop the transport.
+ * Data sent by the peer and not read yet is discarded.
+ * The calling thread is left without a connection.
+ */
+void rdt_close(void)
+{
+    struct rdt_conn *c = rdt_cur;
+    struct timespec rto, now, deadline;
+    double loss;
+    unsigned int i;
+    bool by_peer;
+    int ret;
+
+    rdt_cur = NULL;
+
+    if (c->pending_connect && c->early_len) {
+        connect_now(c);
+        rdt_cur = NULL;
+    }
+    if (c->pending_connect || c->connect_failed) {
+        /* never connected */
+        free(c);
+        return;
+    }
+
+    if (pthread_mutex_lock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    by_peer = c->peer_closed;
+    if (pthread_mutex_unlock(&c->recv_cb.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    if (pthread_mutex_lock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_lock");
+
+    if (!by_peer) {
+
+        /* flush: the events still pending may bring new data */
+        while ((c->e.type != NO_EVENT || !c->flushed)
+               && !__atomic_load_n(&c->expired, __ATOMIC_RELAXED))
+            if (pthread_cond_wait(&c->cnd_closing, &c->e.mtx) != 0)
+                handle_error("pthread_cond_wait");
+    }
+
+    /* nobody would answer the FIN of an expired connection */
+    if (!by_peer && !__atomic_load_n(&c->expired, __ATOMIC_RELAXED)) {
+
+        loss = c->params.P / 100.0;
+        nsectots(&rto, STAT_GET(c, rto) ? (long long) STAT_GET(c, rto)
+                 : (long long) c->params.T * 1000000);
+        c->fin_sent = true;
+        for (i = 0; i < FIN_RETRIES && !c->fin_acked; i++) {
+            send_control(c, CTL_FIN, c->fin_seqnum, NULL, loss);
+
+            if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+                handle_error("clock_gettime()");
+            timespec_add(&deadline, &now, &rto);
+            timespec_add(&rto, &rto, &rto);
+
+            while (!c->fin_acked
+                   && (ret = pthread_cond_timedwait(&c->cnd_closing,
+                                                    &c->e.mtx,
+                                                    &deadline)) != ETIMEDOUT)
+                if (ret != 0)
+                    handle_error("pthread_cond_timedwait");
+        }
+        if (!c->fin_acked)
+            fputs("rdt_close: no answer to the FIN\n", stderr);
+    }
+
+    if (pthread_mutex_unlock(&c->e.mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+    stop_transport(c);
+}
+
+
+
+
+/*
+ * Function:	init_idle
+ * --------------------------------------------------------
+ * Set the idle timeout of a connection, from the RUDP_IDLE
+ * environment variable (seconds) if present. A keepalive is sent
+ * after a third of it without traffic, so that a live peer never
+ * expires.
+ */
+void init_idle(struct rdt_conn *c)
+{
+    char *env = getenv(IDLE_ENV), *end;
+    double sec = IDLE_TIMEOUT;
+
+    if (env && *env) {
+        errno = 0;
+        sec = strtod(env, &end);
+        if (errno || *end || sec < 0.1 || sec > 86400) {
+            fprintf(stderr, "%s: invalid timeout '%s'\n", IDLE_ENV, env);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    c->idle_timeout.tv_sec = sec;
+    c->idle_timeout.tv_usec = (sec - c->idle_timeout.tv_sec) * 1000000;
+    nsectots(&c->keepalive, sec / 3 * 1000000000);
+}
+
+
+
+
+/*
+ * Function:	start_stats_dump
+ * --------------------------------------------------------
+ * Start dumping the counters periodically if the RUDP_STATS
+ * environment variable holds an interval in seconds (connections
+ * after the first one are dumped by the same thread).
+ */
+void start_stats_dump(void)
+{
+    static struct timespec interval;
+    char *env = getenv(STATS_ENV), *end;
+    pthread_t t;
+    double sec;
+
+    if (!env || !*env)
+        return;
+
+    errno = 0;
+    sec = strtod(env, &end);
+    if (errno || *end || sec < 0.01 || sec > 86400) {
+        fprintf(stderr, "%s: invalid interval '%s'\n", STATS_ENV, env);
+        exit(EXIT_FAILURE);
+    }
+    nsectots(&interval, sec * 1000000000);
+
+    if (pthread_create(&t, NULL, stats_service, &interval) != 0)
+        handle_error("creating stats_service");
+}
+
+
+
+
+/* the setup of the process, run by its first connection */
+void transport_init_once(void)
+{
+    trace_init();
+    hist_init();
+    hist_register("ack_latency", &ack_hist);
+    hist_register("rdt_send_blocked", &send_hist);
+    start_stats_dump();
+}
+
+
+
+
 /*
  * Function:	init_transport
  * ----------------------------------------------
  * Initialize shared structures and create sending and receiving
- * threads.
+ * threads. The connection becomes the one of the calling thread.
  *
  * Parameters:
  * 		sockfd	connection socket descriptor
+ * 		peer	the peer's address, followed wherever it moves
+ * 				(NULL: the socket is connected to the peer)
  * 		params	protocol's parameters
+ * 		keys	the keys of the params->aead cipher (NULL: plaintext)
+ *
+ * Returns:
+ * 		the connection
  */
-void init_transport(int sockfd, struct proto_params *params)
+struct rdt_conn *init_transport(int sockfd, struct sockaddr_in *peer,
+                                struct proto_params *params,
+                                struct aead_keys *keys)
 {
-    pthread_t t;
+    static uint64_t conn_count;
+    struct rdt_conn *c;
+    pthread_attr_t attr;
+
+    /* a postponed setup starts the connection that was waiting for it */
+    if (rdt_cur && rdt_cur->connecting) {
+        c = rdt_cur;
+        c->connecting = false;
+    } else
+        c = conn_new();
+    rdt_cur = c;
+
+    c->sockfd = sockfd;
+    c->params = *params;
+    c->cid = htonl(params->cid);
+    c->roaming = peer != NULL;
+    if (peer)
+        c->peer = pack_peer(peer);
+    if (keys && params->aead) {
+        c->tx_aead = aead_new(params->aead, keys->tx, true);
+        c->rx_aead = aead_new(params->aead, keys->rx, false);
+        c->ctl_aead = aead_new(params->aead, keys->tx, true);
+    } else
+        c->params.aead = AEAD_NONE;
+    c->tx_xseq = 0;
+    c->probe_peer = 0;
+    c->ctl_tx_ctr = c->ctl_rx_top = 0;
+    c->ctl_rx_seen = 0;
+    if (c->busy_poll)
+        set_busy_poll(c);
 
 
     /* initialize circular buffers */
 
-    recv_cb.E = recv_cb.S = 0;
-    send_cb.E = send_cb.S = 0;
-
-
-    /* initialize shared tools */
-
-    recv_tools.sockfd = sockfd;
-    recv_tools.e = &e;
-    recv_tools.cb = &recv_cb;
-    recv_tools.params = params;
-
-    send_tools = recv_tools;
-    send_tools.cb = &send_cb;
+    c->recv_cb.E = c->recv_cb.S = 0;
+    c->send_cb.E = c->send_cb.S = 0;
+    c->e.type = NO_EVENT;
+    memset(&c->stats, 0, sizeof(c->stats));
+    init_mss(c);
+    init_idle(c);
+    c->flushed = true;
+    if (pthread_once(&transport_once, transport_init_once) != 0)
+        handle_error("pthread_once() - transport_init_once");
 
 
     /* initialize mutexes */
 
-    if (pthread_mutex_init(&e.mtx, NULL) != 0)
+    if (pthread_mutex_init(&c->e.mtx, NULL) != 0)
         handle_error("pthread_mutex_init()");
-    if (pthread_mutex_init(&recv_cb.mtx, NULL) != 0)
+    if (pthread_mutex_init(&c->recv_cb.mtx, NULL) != 0)
         handle_error("pthread_mutex_init()");
-    if (pthread_mutex_init(&send_cb.mtx, NULL) != 0)
+    if (pthread_mutex_init(&c->send_cb.mtx, NULL) != 0)
+        handle_error("pthread_mutex_init()");
+    if (pthread_mutex_init(&c->ctl_mtx, NULL) != 0)
         handle_error("pthread_mutex_init()");
 
 
     /* initialize conditions */
 
-    if (pthread_cond_init(&recv_cb.cnd_not_empty, NULL) != 0)
+    if (pthread_cond_init(&c->recv_cb.cnd_not_empty, NULL) != 0)
         handle_error("pthread_cond_init()");
-    if (pthread_cond_init(&send_cb.cnd_not_empty, NULL) != 0)
+    if (pthread_cond_init(&c->send_cb.cnd_not_empty, NULL) != 0)
         handle_error("pthread_cond_init()");
 
-    if (pthread_cond_init(&recv_cb.cnd_not_full, NULL) != 0)
+    if (pthread_cond_init(&c->recv_cb.cnd_not_full, NULL) != 0)
         handle_error("pthread_cond_init()");
-    if (pthread_cond_init(&send_cb.cnd_not_full, NULL) != 0)
+    if (pthread_cond_init(&c->send_cb.cnd_not_full, NULL) != 0)
         handle_error("pthread_cond_init()");
 
-    if (pthread_cond_init(&e.cnd_event, NULL) != 0)
+    if (pthread_cond_init(&c->e.cnd_event, NULL) != 0)
+        handle_error("pthread_cond_init()");
+    if (pthread_cond_init(&c->e.cnd_no_event, NULL) != 0)
         handle_error("pthread_cond_init()");
-    if (pthread_cond_init(&e.cnd_no_event, NULL) != 0)
+    if (pthread_cond_init(&c->cnd_closing, NULL) != 0)
         handle_error("pthread_cond_init()");
 
 
-    /* create threads */
+    /* register the connection */
 
-    if (pthread_create(&t, NULL, recv_service, &recv_tools) != 0)
+    if (pthread_mutex_lock(&conns_mtx) != 0)
+        handle_error("pthread_mutex_lock");
+    c->stats.conn = ++conn_count;
+    c->next = conns;
+    conns = c;
+    if (pthread_mutex_unlock(&conns_mtx) != 0)
+        handle_error("pthread_mutex_unlock");
+
+
+    /* create threads, placed as RUDP_AFFINITY says */
+
+    affinity_attr(&attr);
+
+    if (pthread_create(&c->recv_thread, &attr, recv_service, c) != 0)
         handle_error("creating recv_service");
 
-    if (pthread_create(&t, NULL, send_service, &send_tools) != 0)
+    if (pthread_create(&c->send_thread, &attr, send_service, c) != 0)
         handle_error("creating send_service");
+
+    pthread_attr_destroy(&attr);
+
+    return c;
 }
@@ -5,22 +5,76 @@
 #include "rw.h"
 #include "basic.h"
 #include "event.h"
+#include "queue.h"
+#include "aead.h"
 
 #include <pthread.h>
 
 
 #define MTU 			1500
+#define JUMBO_MTU		9000
 #define UDPIP_HEADER 	28
-#define SR_HEADER		(sizeof(uint8_t) + sizeof(uint16_t))
-#define MSS 			(MTU - UDPIP_HEADER - SR_HEADER)
-#define CBUF_SIZE 		(5 * MSS)
+#define SR_HEADER		12          // cid, seqnum, unused, size, crc
+#define CID_SIZE		4           // connection ID, first in every datagram
+#define CTL_CTR_SIZE	4           // counter of a sealed ack or control
+#define CTL_NONCE		(1ULL << 63)        // apart from the segments
+#define MSS 			(MTU - UDPIP_HEADER - SR_HEADER)        // default
+#define MSS_MAX			(JUMBO_MTU - UDPIP_HEADER - SR_HEADER)
+#define MSS_MIN			512
+#define CBUF_SIZE 		(5 * MSS_MAX)
 #define MAXSEQNUM		(1 << 8)
+#define IDLE_TIMEOUT	90          // s without datagrams from the peer
+#define FIN_RETRIES		6
+#define BUSY_POLL_ENV	"RUDP_BUSY_POLL"
+#define BUSY_POLL_MAX	100000      // us of spinning before blocking
 
+// control datagrams
+#define CTL_FIN			1           // arg: next seqnum, all data acked
+#define CTL_FIN_ACK		2
+#define CTL_KEEPALIVE	3
+#define CTL_CHALLENGE	4           // struct probe: echo it
+#define CTL_RESPONSE	5           // struct probe: the echo
+#define PROBE_SIZE		7           // random bytes of a path challenge
 
+
+/*
+ * Every datagram of a connection starts with its ID (params.cid, in
+ * network byte order), so that the server recognizes the client
+ * wherever it sends from; the datagram type follows from its size:
+ * the ID alone confirms the connection, acks and control datagrams
+ * are a few bytes longer, path probes are as long as a segment header
+ * (never a segment: their unused byte is not 0), segments longer.
+ *
+ * On the wire only the header and size bytes of payload are sent,
+ * followed by an AEAD_TAG if the connection seals its segments
+ * (then the payload is encrypted and crc is 0). A sealed connection
+ * also seals its acks and control datagrams: they are followed by a
+ * counter, big endian, and by the tag of an empty plaintext.
+ */
 struct segment {
+	uint8_t cid[CID_SIZE];
 	uint8_t seqnum;
+	uint8_t unused;             // always 0 (not a handshake magic)
 	uint16_t size;
-	uint8_t payload[MSS];
+	uint32_t crc;               // CRC-32C of header (crc 0) and payload
+	uint8_t payload[MSS_MAX];
+};
+
+struct ack {
+	uint8_t cid[CID_SIZE];
+	uint8_t seqnum;
+};
+
+struct control {
+	uint8_t cid[CID_SIZE];
+	uint8_t type;
+	uint8_t arg;
+};
+
+struct probe {
+	uint8_t cid[CID_SIZE];
+	uint8_t type;               // CTL_CHALLENGE or CTL_RESPONSE
+	uint8_t data[PROBE_SIZE];   // random, data[0] never 0
 };
 
 struct packet {
@@ -30,6 +84,23 @@ struct packet {
 	bool rtx;
 };
 
+/*
+ * The retransmission timer of a connection, served by its own thread.
+ * A packet in the queue belongs to the timer: the sender writes a
+ * slot of its buffer only after the ack took the packet out of it.
+ */
+struct rtx_timer {
+	struct rdt_conn *conn;
+	double loss;
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd_changed; // new head of the queue, or stop
+	/* with mtx: */
+	struct queue_t queue;       // packets in flight, by expiration time
+	struct timespec timeout;    // retransmission timeout
+	bool stop;
+};
+
 struct circular_buffer {
     pthread_mutex_t mtx;
     pthread_cond_t cnd_not_empty;
@@ -39,18 +110,117 @@ struct circular_buffer {
     char buf[CBUF_SIZE];
 };
 
-struct shared_tools {
+/* connection counters: every field is a uint64_t (see rdt_get_stats) */
+struct rdt_stats {
+	/* sender */
+	uint64_t sent;              // segments sent, retransmissions included
+	uint64_t rtx;               // segments retransmitted on timeout
+	uint64_t acked;             // segments acked (first ack only)
+	uint64_t acks_rcvd;         // acks received, duplicates included
+	uint64_t bytes_sent;        // payload bytes of the first transmissions
+	uint64_t timer_queue;       // segments waiting for their ack
+	uint64_t send_cb_bytes;     // data waiting in the send buffer
+	uint64_t send_blocked_ns;   // time rdt_send waited for free space
+	/* round trip time (ns) */
+	uint64_t rtt_min;
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t rto;               // current retransmission timeout
+	/* receiver */
+	uint64_t segs_rcvd;         // segments received, duplicates included
+	uint64_t dup_segs;          // segments received more than once
+	uint64_t bad_segs;          // segments dropped for a wrong checksum
+	uint64_t bytes_delivered;   // payload bytes handed to the application
+	uint64_t recv_cb_bytes;     // data waiting in the receive buffer
+	uint64_t deliver_blocked_ns;        // time deliver_segment waited
+	uint64_t mss;               // payload of the new segments
+	uint64_t moves;             // changes of the peer's address
+	uint64_t conn;              // connection number in the process
+};
+
+/*
+ * A connection: the buffers shared by the application and the two
+ * threads serving the socket. The rdt_* functions work on the
+ * connection of the calling thread, the last one it started or
+ * selected with rdt_use, so that the commands need not carry it.
+ */
+struct rdt_conn {
 	int sockfd;
-	struct circular_buffer *cb;
-	struct event *e;
-	struct proto_params *params;
+	struct proto_params params;
+	uint32_t cid;               // params.cid, in network byte order
+	/* peer of an unconnected socket, followed when its address changes */
+	bool roaming;
+	uint64_t peer;              // address << 16 | port, atomic
+	/* a new address of the peer, used once it echoes (recv_service) */
+	uint64_t probe_peer;        // 0: none
+	uint8_t probe_data[PROBE_SIZE];
+	struct timespec probe_time; // when the challenge was sent
+	struct circular_buffer recv_cb;
+	struct circular_buffer send_cb;
+	struct event e;
+	struct rdt_stats stats;     // updated with relaxed atomics
+	pthread_t recv_thread, send_thread;
+	/* setup postponed to carry the first request (0-RTT) */
+	int (*pending_connect)(void *);
+	void *connect_arg;
+	bool connecting;            // init_transport starts this connection
+	bool connect_failed;        // nothing started: reads end, sends drop
+	uint8_t early_buf[MSS];
+	size_t early_len;
+	bool peer_heard;            // an authentic datagram arrived
+	/* the peer is gone after idle_timeout without datagrams */
+	struct timeval idle_timeout;
+	struct timespec keepalive;  // idle time before sending a keepalive
+	/* payload of the new segments, from the path MTU */
+	size_t mss;
+	size_t mss_limit;           // agreed with the peer
+	int mtu_sd;                 // roaming: connected to mtu_peer for IP_MTU
+	uint64_t mtu_peer;          // atomic, as peer
+	unsigned int busy_poll;     // us to spin before blocking (0: off)
+	/* sealed segments (NULL: plaintext), one cipher per thread */
+	struct aead *tx_aead;       // send_service
+	struct aead *rx_aead;       // recv_service
+	uint64_t tx_xseq;           // extended seqnum of the next new segment
+	/* sealed acks and controls, sent by any thread */
+	struct aead *ctl_aead;
+	pthread_mutex_t ctl_mtx;
+	uint32_t ctl_tx_ctr;        // counter of the last one sent
+	uint32_t ctl_rx_top;        // highest counter received (recv_service)
+	uint64_t ctl_rx_seen;       // the 64 counters up to it, a bit each
+	/* teardown, with e.mtx: */
+	pthread_cond_t cnd_closing; // flushed or FIN acked
+	bool flushed;               // all the data sent was acked
+	uint8_t fin_seqnum;         // next seqnum once flushed
+	bool fin_sent, fin_acked;
+	/* with recv_cb.mtx: */
+	bool peer_closed;           // FIN received (or the peer expired)
+	/* no lock: */
+	bool closing;               // threads stopping
+	bool expired;               // peer gone: new data is dropped
+	struct rdt_conn *next;      // live connections
 };
 
 
-void init_transport(int sockfd, struct proto_params *params);
+struct rdt_conn *init_transport(int sockfd, struct sockaddr_in *peer,
+                                struct proto_params *params,
+                                struct aead_keys *keys);
+void rdt_use(struct rdt_conn *conn);
+struct rdt_conn *rdt_current(void);
 void rdt_send(const void *buf, size_t len);
-void rdt_recv(void *buf, size_t len);
+size_t rdt_recv(void *buf, size_t len);
 ssize_t rdt_read_string(char *buf, size_t size);
+struct proto_params *rdt_get_params(void);
+void rdt_defer_connect(int (*connect)(void *), void *arg);
+const void *rdt_early_data(size_t *len);
+void rdt_inject(const void *buf, size_t len);
+bool rdt_peer_heard(void);
+bool rdt_expired(void);
+void rdt_abandon(void);
+void rdt_confirm(void);
+void rdt_close(void);
+void rdt_busy_poll(unsigned int usec);
+void rdt_get_stats(struct rdt_stats *stats);
+void rdt_fprint_stats(FILE * stream, struct rdt_stats *stats);
 
 
 #endif /* _TRANSPORT_H */
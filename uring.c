@@ -0,0 +1,253 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+/*
+ * Function:	uring_enabled
+ * --------------------------------------------------
+ * Returns:
+ * 		false	if RUDP_URING=0 asks for the blocking file I/O
+ */
+bool uring_enabled(void)
+{
+    char *env = getenv(URING_ENV);
+
+    return !env || strcmp(env, "0") != 0;
+}
+
+
+
+/*
+ * Function:	uring_init
+ * --------------------------------------------------
+ * Create a ring and map its queues.
+ *
+ * Parameters:
+ * 		r		the ring
+ * 		entries	the depth of the submission queue
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error (e.g. a kernel without io_uring), with errno set
+ */
+int uring_init(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    if ((r->fd = syscall(SYS_io_uring_setup, entries, &p)) == -1)
+        return -1;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    r->sq_head = (unsigned int *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) ((char *) r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned int *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    return 0;
+
+  fail_cq:
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+  fail_sq:
+    munmap(r->sq_ring, r->sq_ring_size);
+  fail:
+    err = errno;
+    close(r->fd);
+    errno = err;
+    return -1;
+}
+
+
+
+void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+
+
+/*
+ * Function:	uring_register_buffers
+ * --------------------------------------------------
+ * Pin buffers in the kernel, so that the fixed reads and writes
+ * skip mapping them at every request.
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error (e.g. RLIMIT_MEMLOCK), with errno set
+ */
+int uring_register_buffers(struct uring *r, struct iovec *iov,
+                           unsigned int n)
+{
+    if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                iov, n) == -1)
+        return -1;
+
+    r->fixed = true;
+    return 0;
+}
+
+
+
+/*
+ * Function:	uring_prep_rw
+ * --------------------------------------------------
+ * Queue a read or write request, to be sent by uring_submit.
+ *
+ * Parameters:
+ * 		r			the ring
+ * 		op			IORING_OP_READ or IORING_OP_WRITE
+ * 		fd			the file
+ * 		buf			the buffer
+ * 		len			its size
+ * 		offset		the position in the file
+ * 		buf_index	the registered buffer holding buf (ignored if none)
+ * 		data		returned with the completion
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	if the submission queue is full
+ */
+int uring_prep_rw(struct uring *r, uint8_t op, int fd, void *buf,
+                  unsigned int len, uint64_t offset, int buf_index,
+                  uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    tail = *r->sq_tail + r->sq_queued;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > *r->sq_mask) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    index = tail & *r->sq_mask;
+    sqe = r->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = data;
+    if (r->fixed) {
+        sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED
+            : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = buf_index;
+    }
+    r->sq_array[index] = index;
+    r->sq_queued++;
+
+    return 0;
+}
+
+
+
+/*
+ * Function:	uring_submit
+ * --------------------------------------------------
+ * Hand the queued requests to the kernel.
+ *
+ * Returns:
+ * 		the number of requests submitted
+ * 		-1	on error, with errno set
+ */
+int uring_submit(struct uring *r)
+{
+    unsigned int n = r->sq_queued;
+    int ret;
+
+    if (!n)
+        return 0;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->sq_queued = 0;
+
+    while ((ret = syscall(SYS_io_uring_enter, r->fd, n, 0, 0, NULL, 0))
+           == -1 && errno == EINTR);
+
+    return ret;
+}
+
+
+
+/*
+ * Function:	uring_wait
+ * --------------------------------------------------
+ * Wait for the completion of a request.
+ *
+ * Parameters:
+ * 		r		the ring
+ * 		data	where to store the data of the request
+ * 		res		where to store its result (negative errno on failure)
+ *
+ * Returns:
+ * 		0	on success
+ * 		-1	on error, with errno set
+ */
+int uring_wait(struct uring *r, uint64_t *data, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    head = *r->cq_head;
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        if (syscall(SYS_io_uring_enter, r->fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == -1
+            && errno != EINTR)
+            return -1;
+
+    cqe = r->cqes + (head & *r->cq_mask);
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _URING_H
+#define _URING_H
+
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define URING_ENV		"RUDP_URING"   // "0": blocking file I/O
+
+
+/*
+ * A minimal io_uring, set up with the raw system calls (no liburing):
+ * the submission and completion rings are mapped from the kernel and
+ * the requests of the caller are queued on the first, their results
+ * read from the second. Not thread safe: one ring per thread.
+ */
+struct uring {
+	int fd;
+	/* submission ring */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_queued;     // prepared, not yet submitted
+	/* completion ring */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* the mappings */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	bool fixed;                 // buffers registered
+};
+
+
+bool uring_enabled(void);
+int uring_init(struct uring *r, unsigned int entries);
+void uring_exit(struct uring *r);
+int uring_register_buffers(struct uring *r, struct iovec *iov,
+                           unsigned int n);
+int uring_prep_rw(struct uring *r, uint8_t op, int fd, void *buf,
+                  unsigned int len, uint64_t offset, int buf_index,
+                  uint64_t data);
+int uring_submit(struct uring *r);
+int uring_wait(struct uring *r, uint64_t *data, int *res);
+
+
+#endif /* _URING_H */